@@ -0,0 +1,172 @@
+#ifndef BUFFER_ARENA_H
+#define BUFFER_ARENA_H
+
+#include <torch/extension.h>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <utility>
+#include <algorithm>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+namespace sn2_cuda {
+    // Class BufferArena
+    /**
+     * Carves the buffers of a solver out of a single zero-filled allocation. The buffers are laid out in the order
+     * they are added, each aligned to `ALIGNMENT` bytes, so buffers that are added one after another sit together.
+     * The views returned by `get` keep the allocation alive; it is freed with the last of them.
+     */
+    class BufferArena {
+        public:
+        static constexpr int64_t ALIGNMENT = 256;
+
+        private:
+        struct Buffer {
+            std::vector<int64_t> sizes;
+            torch::ScalarType dtype;
+            int64_t offset;
+            int64_t num_bytes;
+        };
+
+        private:
+        std::vector<Buffer> buffers;
+        int64_t size = 0;
+        torch::Tensor memory;
+
+        private:
+        /**
+         * Maps a new temporary file of `size` bytes in `directory`; the file is deleted when the mapping is released.
+         * A new file reads as zeros, and the pages are written back to it rather than to the swap.
+         */
+        static torch::Tensor map_file(const std::string& directory, int64_t size) {
+#ifdef _WIN32
+            char path[MAX_PATH];
+            TORCH_CHECK(GetTempFileNameA(directory.c_str(), "sn2", 0, path) != 0,
+                        "Cannot create a file in ", directory, "; error ", GetLastError(), ".")
+            HANDLE file = CreateFileA(
+                    path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                    FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE | FILE_FLAG_SEQUENTIAL_SCAN, nullptr
+            );
+            TORCH_CHECK(file != INVALID_HANDLE_VALUE, "Cannot open ", path, "; error ", GetLastError(), ".")
+            HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, DWORD(size >> 32), DWORD(size & 0xFFFFFFFF), nullptr);
+            void* data = mapping != nullptr ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size) : nullptr;
+            const DWORD error = GetLastError();
+
+            // The view keeps the mapping and the file open
+            if (mapping != nullptr)
+                CloseHandle(mapping);
+
+            CloseHandle(file);
+            TORCH_CHECK(data != nullptr, "Cannot map ", size, " bytes of ", path, "; error ", error, ".")
+            return torch::from_blob(data, {size}, [] (void* data) { UnmapViewOfFile(data); }, torch::kUInt8);
+#else
+            std::string path = directory + "/sn2_arena_XXXXXX";
+            const int file = mkstemp(path.data());
+            TORCH_CHECK(file >= 0, "Cannot create a file in ", directory, ": ", std::strerror(errno), ".")
+            unlink(path.c_str());
+
+            void* data = ftruncate(file, size) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0) : MAP_FAILED;
+            const int error = errno;
+            close(file);
+            TORCH_CHECK(data != MAP_FAILED, "Cannot map ", size, " bytes of ", path, ": ", std::strerror(error), ".")
+            madvise(data, size, MADV_SEQUENTIAL);
+            return torch::from_blob(data, {size}, [size] (void* data) { munmap(data, size); }, torch::kUInt8);
+#endif
+        }
+
+        public:
+        /**
+         * @return the id of the new buffer
+         */
+        int32_t add(std::vector<int64_t> sizes, torch::ScalarType dtype) {
+            int64_t num_bytes = torch::elementSize(dtype);
+
+            for (const int64_t s : sizes)
+                num_bytes *= s;
+
+            this->buffers.push_back({std::move(sizes), dtype, this->size, num_bytes});
+            this->size += (num_bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+            return static_cast<int32_t>(this->buffers.size()) - 1;
+        }
+
+        public:
+        void allocate(const torch::Device& device) {
+            this->memory = torch::zeros({std::max<int64_t>(this->size, ALIGNMENT)}, torch::dtype(torch::kUInt8).device(device));
+        }
+
+        public:
+        /**
+         * Allocates the arena on the host in a memory-mapped file in `directory`, so that it may exceed the memory.
+         */
+        void allocate_mapped(const std::string& directory) {
+            this->memory = map_file(directory, std::max<int64_t>(this->size, ALIGNMENT));
+        }
+
+        public:
+        /**
+         * Uses `memory`, the allocation of an arena with the same layout, instead of allocating; its contents are kept.
+         */
+        void attach(const torch::Tensor& memory) {
+            this->memory = memory;
+        }
+
+        public:
+        const torch::Tensor& get_memory() const {
+            return this->memory;
+        }
+
+        public:
+        torch::Tensor get(int32_t id) const {
+            const Buffer& buffer = this->buffers[id];
+            const torch::Tensor memory = this->memory;
+            return torch::from_blob(
+                    memory.data_ptr<uint8_t>() + buffer.offset, buffer.sizes, [memory] (void*) { },
+                    torch::dtype(buffer.dtype).device(memory.device())
+            );
+        }
+
+        public:
+        /**
+         * Copies host data into buffers with a single transfer through a staging buffer. The whole span from the first
+         * to the last of the buffers is written, so the buffers that lie in between, if any, are zeroed.
+         * @param data pairs of a buffer id and a host pointer to as many bytes as the buffer has
+         */
+        void upload(const std::vector<std::pair<int32_t, const void*>>& data) {
+            int64_t begin = this->size, end = 0;
+
+            for (const auto& [id, ptr] : data) {
+                begin = std::min(begin, this->buffers[id].offset);
+                end = std::max(end, this->buffers[id].offset + this->buffers[id].num_bytes);
+            }
+
+            if (end <= begin)
+                return;
+
+            torch::Tensor staging = torch::zeros({end - begin}, torch::kUInt8);
+
+            for (const auto& [id, ptr] : data)
+                if (this->buffers[id].num_bytes > 0)
+                    std::memcpy(staging.data_ptr<uint8_t>() + this->buffers[id].offset - begin, ptr, this->buffers[id].num_bytes);
+
+            this->memory.narrow(0, begin, end - begin).copy_(staging);
+        }
+
+        public:
+        int64_t get_size() const {
+            return this->size;
+        }
+    };
+}
+
+#endif
\ No newline at end of file
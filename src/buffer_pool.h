@@ -0,0 +1,161 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <torch/extension.h>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <tuple>
+#include <string_view>
+#include <functional>
+
+namespace sn2_cuda {
+    // Class BufferPool
+    /**
+     * Recycles the arenas (see `BufferArena`) of destroyed solvers for new solvers of the same structure, dtype and
+     * method, so that short-lived solvers skip the allocation, the zero-fill and the upload of the index buffers.
+     * A recycled arena holds the buffers as the previous solver left them, which is the state of a solver after any
+     * number of iterations; only the weights need to be written.
+     * An arena is handed out again only once no tensor refers to it, so views kept by the user are never overwritten.
+     * The pool keeps at most `MAX_ENTRIES` arenas of at most `MAX_BYTES` in all, evicting the least recently released.
+     */
+    class BufferPool {
+        public:
+        static constexpr int32_t MAX_ENTRIES = 64;
+        static constexpr int64_t MAX_BYTES = int64_t(1) << 30;     // Of all the arenas held, on all the devices
+
+        public:
+        struct Key {
+            size_t fingerprint;                 // Hash of the structure; the structures are compared on a hit
+            int64_t size;                       // Bytes of the arena
+            int32_t dtype;
+            int32_t method;                     // -1 for the stochastic loss
+            int64_t memory_budget;              // Lays out the blocks of lambda; see `SN2Solver::make_lambda_blocks`
+            torch::Device device = torch::kCPU;
+
+            bool operator==(const Key& other) const {
+                return std::tie(fingerprint, size, dtype, method, memory_budget) ==
+                       std::tie(other.fingerprint, other.size, other.dtype, other.method, other.memory_budget) &&
+                       device == other.device;
+            }
+        };
+
+        private:
+        struct Entry {
+            Key key;
+            torch::Tensor structure;            // On the host
+            torch::Tensor memory;
+        };
+
+        public:
+        /**
+         * Returns the arena to the pool when the last copy of the solver that holds it is destroyed.
+         */
+        class Lease {
+            private:
+            Entry entry;
+            bool discarded = false;
+
+            public:
+            explicit Lease(Entry entry) : entry(std::move(entry)) { }
+
+            public:
+            Lease(const Lease&) = delete;
+            Lease& operator=(const Lease&) = delete;
+
+            public:
+            /**
+             * Frees the arena with the lease rather than returning it to the pool; for solvers that are not reused.
+             */
+            void discard() {
+                this->discarded = true;
+            }
+
+            public:
+            ~Lease() {
+                if (!this->discarded)
+                    BufferPool::get_instance().release(std::move(this->entry));
+            }
+        };
+
+        private:
+        std::list<Entry> entries;               // The least recently released first
+        int64_t num_bytes = 0;                  // Of the arenas of `entries`
+        std::mutex mutex;
+
+        private:
+        BufferPool() = default;
+
+        private:
+        void release(Entry entry) {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->num_bytes += entry.key.size;
+            this->entries.push_back(std::move(entry));
+
+            // An arena larger than the budget is not kept at all
+            while (this->entries.size() > MAX_ENTRIES || this->num_bytes > MAX_BYTES) {
+                this->num_bytes -= this->entries.front().key.size;
+                this->entries.pop_front();
+            }
+        }
+
+        public:
+        BufferPool(const BufferPool&) = delete;
+        BufferPool& operator=(const BufferPool&) = delete;
+
+        public:
+        static BufferPool& get_instance() {
+            // Never destroyed: freeing device memory while the process unloads the extension may fail
+            static BufferPool* instance = new BufferPool();
+            return *instance;
+        }
+
+        public:
+        /**
+         * @param structure a contiguous `bool` matrix on the host
+         */
+        static size_t get_fingerprint(const torch::Tensor& structure) {
+            const std::string_view bytes(static_cast<const char*>(structure.data_ptr()), structure.numel());
+            return std::hash<std::string_view>()(bytes) ^ std::hash<int64_t>()(structure.size(0) * 65599 + structure.size(1));
+        }
+
+        public:
+        /**
+         * @return an arena released under `key` for the same `structure`, or an undefined tensor
+         */
+        torch::Tensor acquire(const Key& key, const torch::Tensor& structure) {
+            std::lock_guard<std::mutex> lock(this->mutex);
+
+            for (auto entry = this->entries.rbegin(); entry != this->entries.rend(); entry++)
+                // The pool must hold the only reference; otherwise a view of the arena is still alive
+                if (entry->key == key && entry->memory.use_count() == 1 && torch::equal(entry->structure, structure)) {
+                    torch::Tensor memory = std::move(entry->memory);
+                    this->num_bytes -= entry->key.size;
+                    this->entries.erase(std::next(entry).base());
+                    return memory;
+                }
+
+            return torch::Tensor();
+        }
+
+        public:
+        /**
+         * @return a lease that returns `memory` to the pool under `key` when it is destroyed
+         */
+        static std::shared_ptr<Lease> lease(const Key& key, const torch::Tensor& structure, const torch::Tensor& memory) {
+            return std::make_shared<Lease>(Entry{key, structure, memory});
+        }
+
+        public:
+        /**
+         * Frees the arenas held by the pool.
+         */
+        void clear() {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->entries.clear();
+            this->num_bytes = 0;
+        }
+    };
+}
+
+#endif
\ No newline at end of file
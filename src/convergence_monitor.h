@@ -0,0 +1,169 @@
+#ifndef CONVERGENCE_MONITOR_H
+#define CONVERGENCE_MONITOR_H
+
+#include <torch/extension.h>
+#include "stringify.h"
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+namespace sn2_cuda {
+    // The stopping criteria of `SN2Solver::fit`
+    struct FitCriteria {
+        int64_t max_iterations = 10000;
+        int64_t check_every = 100;              // Iterations between two checks; the only points the host waits for the device
+        double rtol = 1e-6;                     // A check that lowers the best loss by less than this fraction is a stall
+        int64_t patience = 3;                   // Consecutive stalls before stopping
+        double max_seconds = 0.0;               // 0 for no limit
+        int64_t trace_size = 1024;              // Iterations kept in the trace; the earlier ones are overwritten
+        int64_t cg_check_every = 10;            // With `StochasticKullbackLeibler`, conjugate-gradient iterations between
+                                                // two reads of their residuals; 0 to always run `cg_max_iterations`
+    };
+
+    // The outcome of `SN2Solver::fit`
+    struct FitReport {
+        enum struct REASONS {
+            MAX_ITERATIONS = 0,
+            CONVERGED,                          // `patience` stalls in a row
+            MAX_SECONDS,
+            NOT_FINITE                          // The loss became NaN or infinite
+        };
+
+        int64_t iterations = 0;
+        double loss = std::numeric_limits<double>::quiet_NaN();    // Of the last iteration
+        double seconds = 0.0;
+        REASONS reason = REASONS::MAX_ITERATIONS;
+        int64_t num_pruned = 0;                 // Edges removed by the pruning of `fit`
+        torch::Tensor trace;                    // N×2 on the host: the loss and the norm of the gradient of the last N iterations
+    };
+
+    // Class ConvergenceMonitor
+    /**
+     * Records the loss and the norm of the gradient of every iteration into a ring buffer on the device of the solver,
+     * without waiting for the device, and checks `FitCriteria` every `check_every` iterations with a single read of
+     * the last loss.
+     */
+    class ConvergenceMonitor {
+        private:
+        FitCriteria criteria;
+        torch::Tensor trace;                    // trace_size×2, `double`
+        int64_t iterations = 0;
+        int64_t num_stalls = 0;
+        double best_loss = std::numeric_limits<double>::infinity();
+        double last_loss = std::numeric_limits<double>::quiet_NaN();
+        std::chrono::steady_clock::time_point start;
+
+        public:
+        ConvergenceMonitor(const FitCriteria& criteria, const torch::Device& device) : criteria(criteria) {
+            TORCH_CHECK(criteria.max_iterations >= 0, STRINGIFY(max_iterations) " must not be negative.")
+            TORCH_CHECK(criteria.check_every > 0, STRINGIFY(check_every) " must be positive.")
+            TORCH_CHECK(criteria.rtol >= 0.0, STRINGIFY(rtol) " must not be negative.")
+            TORCH_CHECK(criteria.patience > 0, STRINGIFY(patience) " must be positive.")
+            TORCH_CHECK(criteria.max_seconds >= 0.0, STRINGIFY(max_seconds) " must not be negative.")
+            TORCH_CHECK(criteria.trace_size > 0, STRINGIFY(trace_size) " must be positive.")
+            TORCH_CHECK(criteria.cg_check_every >= 0, STRINGIFY(cg_check_every) " must not be negative.")
+            this->trace = torch::full({criteria.trace_size, 2}, std::numeric_limits<double>::quiet_NaN(), torch::dtype(torch::kDouble).device(device));
+            this->start = std::chrono::steady_clock::now();
+        }
+
+        public:
+        /**
+         * Records the iteration; neither tensor is read on the host.
+         * @param loss a scalar tensor
+         * @param grad_norm a scalar tensor
+         */
+        void record(const torch::Tensor& loss, const torch::Tensor& grad_norm) {
+            torch::Tensor row = this->trace[this->iterations % this->criteria.trace_size];
+            row[0].copy_(loss, /*non_blocking=*/true);
+            row[1].copy_(grad_norm, /*non_blocking=*/true);
+            this->iterations++;
+        }
+
+        public:
+        /**
+         * @return whether the next call of `check` reads the loss
+         */
+        bool is_check_due() const {
+            return this->iterations > 0 && this->iterations % this->criteria.check_every == 0;
+        }
+
+        public:
+        /**
+         * @return whether the fit is to stop; `reason` is then set
+         */
+        bool check(FitReport::REASONS& reason) {
+            if (this->iterations >= this->criteria.max_iterations) {
+                reason = FitReport::REASONS::MAX_ITERATIONS;
+                return true;
+            }
+
+            if (!this->is_check_due())
+                return false;
+
+            if (this->criteria.max_seconds > 0.0 && this->get_seconds() >= this->criteria.max_seconds) {
+                reason = FitReport::REASONS::MAX_SECONDS;
+                return true;
+            }
+
+            // The only synchronization with the device
+            this->last_loss = this->trace[(this->iterations - 1) % this->criteria.trace_size][0].item<double>();
+
+            if (!std::isfinite(this->last_loss)) {
+                reason = FitReport::REASONS::NOT_FINITE;
+                return true;
+            }
+
+            if (this->best_loss - this->last_loss < this->criteria.rtol * std::abs(this->best_loss))
+                this->num_stalls++;
+            else
+                this->num_stalls = 0;
+
+            this->best_loss = std::min(this->best_loss, this->last_loss);
+
+            if (this->num_stalls >= this->criteria.patience) {
+                reason = FitReport::REASONS::CONVERGED;
+                return true;
+            }
+
+            return false;
+        }
+
+        public:
+        int64_t get_iterations() const {
+            return this->iterations;
+        }
+
+        public:
+        double get_seconds() const {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - this->start).count();
+        }
+
+        public:
+        /**
+         * @return the last loss read by `check`; NaN before the first check
+         */
+        double get_last_loss() const {
+            return this->last_loss;
+        }
+
+        public:
+        FitReport get_report(FitReport::REASONS reason) const {
+            FitReport report;
+            const int64_t size = this->criteria.trace_size;
+            const int64_t first = this->iterations > size ? this->iterations % size : 0;
+            const torch::Tensor trace = this->trace.to(torch::kCPU);
+            report.iterations = this->iterations;
+            report.seconds = this->get_seconds();
+            report.reason = reason;
+            report.trace = torch::cat({trace.narrow(0, first, std::min(size, this->iterations) - first), trace.narrow(0, 0, first)});
+
+            if (this->iterations > 0)
+                report.loss = report.trace[-1][0].item<double>();
+
+            return report;
+        }
+    };
+}
+
+#endif
\ No newline at end of file
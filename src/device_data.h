@@ -2,10 +2,23 @@
 #define DEVICE_DATA_H
 #include <torch/extension.h>
 #include <stdio.h>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+
+/*
+ * The accessors are compiled for both the device (by nvcc) and the host; the host path runs the same accessors
+ * on tensors allocated on the CPU.
+ */
+#ifdef __CUDACC__
+#define SN2_HOST_DEVICE __device__ __host__ __forceinline__
+#else
+#define SN2_HOST_DEVICE inline
+#endif
 
 namespace sn2_cuda {
     /*
-     * A declaration for the cpp compiler and a definition for the nvcc compiler.
+     * The constructors are only declared for the cpp compiler.
      */
 
     // Stores the structural data for a layer in sn2
@@ -15,19 +28,19 @@ namespace sn2_cuda {
         int32_t base;
         int32_t num;
         int32_t lat_width;
+        const int32_t* lat_vars;                // The latent variables of the layer; resolved once by the execution plan
 
-#ifdef __CUDACC__
         public:
-        __device__ __host__ __forceinline__ int32_t get_num_vars() const {
+        SN2_HOST_DEVICE int32_t get_num_vars() const {
             return base + num + lat_width;
         }
 
         public:
-        __device__ __host__ __forceinline__ int32_t get_num_new_vars() const {
+        SN2_HOST_DEVICE int32_t get_num_new_vars() const {
             return num;
         }
 
-#else
+#ifndef __CUDACC__
         public:
         LayerData(
             const int32_t idx,
@@ -35,7 +48,8 @@ namespace sn2_cuda {
         ):  idx(idx),
             base(base),
             num(0),
-            lat_width(0)
+            lat_width(0),
+            lat_vars(nullptr)
         { }
 
         public:
@@ -43,17 +57,30 @@ namespace sn2_cuda {
         :   idx(0),
             base(0),
             num(0),
-            lat_width(0)
+            lat_width(0),
+            lat_vars(nullptr)
         { }
 #endif
     };
 
+    // A block of consecutive layers of the backward pass whose rows of lambda are recomputed together
+    struct LambdaBlock {
+        int32_t first_layer;                    // The backward pass runs from `last_layer` down to `first_layer`
+        int32_t last_layer;                     // ^
+        int32_t num_rows;
+        const int32_t* rows;                    // The variables whose rows of lambda the layers read
+        const int32_t* row_map;                 // The row of every variable in the buffer of lambda; -1 if none
+    };
+
     /**
      * Stores the reference to all the matrices that are passed to kernel functions
      * facilitates access to matrix entries by providing a model-view architecture
-     * @tparam scalar_t `float` or `double`
+     * @tparam scalar_t `float`, `double`, or `c10::BFloat16` on the host
+     * @tparam index_t the type of the offsets into the matrices: `int32_t`, or `int64_t` for the models whose
+     *                 matrices have more than 2³¹ entries (see `needs_wide_indices`)
+     * @tparam accscalar_t the type in which the passes accumulate their sums (see `acc_scalar_t`)
      */
-    template <typename scalar_t>
+    template <typename scalar_t, typename index_t = int32_t, typename accscalar_t = scalar_t>
     class DeviceData {
         private:
         const bool* structure;
@@ -68,123 +95,210 @@ namespace sn2_cuda {
         const int32_t* parents_bases;
         const int32_t* children;
         const int32_t* children_bases;
-        const int32_t* lat_neighbors;
-        const int32_t* lat_neighbors_bases;
         const int32_t* lat_range;
+        const int32_t* lat_slots;               // The slot of every latent variable in the backward buffers
+        const int32_t* lambda_rows;             // The row of every variable in `lambda`, or -1; all of them if null
         int32_t vis_len;
         int32_t lat_len;
+        int32_t num_lat_slots;                  // At most as many as the latent variables of the widest layer
         int32_t num_layers;
 
-#ifdef __CUDACC__
+        private:
+        /**
+         * @return the offset of the entry at `row` and `col` of a row-major matrix with `stride` columns
+         */
+        static SN2_HOST_DEVICE index_t offset(int32_t row, int32_t stride, int32_t col) {
+            return index_t(row) * stride + col;
+        }
+
+        private:
+        static SN2_HOST_DEVICE int32_t lower(int32_t u, int32_t v) {
+            return u < v ? u : v;
+        }
+
+        private:
+        static SN2_HOST_DEVICE int32_t upper(int32_t u, int32_t v) {
+            return u < v ? v : u;
+        }
+
+        private:
+        /**
+         * The backward buffers (the covariance gradients and the omegas) are written by one layer and read by the
+         * previous one, so they only hold the latent variables of a layer. The latent variables whose layers do not
+         * overlap share a slot; the visible variables follow the `num_lat_slots` slots.
+         */
+        SN2_HOST_DEVICE int32_t get_slot(int32_t u) const {
+            return u < 0 ? lat_slots[u + lat_len] : num_lat_slots + u;
+        }
+
         public:
-        __device__ __forceinline__ scalar_t get_w_accum(int32_t a, int32_t d) const {
+        SN2_HOST_DEVICE scalar_t get_w_accum(int32_t a, int32_t d) const {
             if (a == d)
                 return 1.0;
             else if (a < 0 && d < 0)
                 return 0.0;
             else
-                return (a < d) ? w_accum[(a + lat_len) * vis_len + d] : 0.0;
+                return (a < d) ? w_accum[offset(a + lat_len, vis_len, d)] : scalar_t(0.0);
         }
 
         public:
-        __device__ __forceinline__ void set_w_accum(int32_t a, int32_t d, scalar_t val) {
+        SN2_HOST_DEVICE void set_w_accum(int32_t a, int32_t d, scalar_t val) {
             if (a <= d)
-                w_accum[(a + lat_len) * vis_len + d] = val;
+                w_accum[offset(a + lat_len, vis_len, d)] = val;
         }
 
         public:
-        __device__ __forceinline__ scalar_t get_weight(int32_t p, int32_t c, const LayerData& layer) const {
+        SN2_HOST_DEVICE scalar_t get_weight(int32_t p, int32_t c, const LayerData& layer) const {
             if (p == c)
                 return 1.0;
             else if (c >= layer.base) // if the variable is visible and appearing on this layer forward
-                return weights[(p + lat_len) * vis_len + c];
+                return weights[offset(p + lat_len, vis_len, c)];
             else
                 return 0.0;
         }
 
         public:
-        __device__ __forceinline__ void set_weight(int32_t p, int32_t c, scalar_t val) {
+        SN2_HOST_DEVICE void set_weight(int32_t p, int32_t c, scalar_t val) {
             if (p <= c)
-                weights[(p + lat_len) * vis_len + c] = val;
+                weights[offset(p + lat_len, vis_len, c)] = val;
         }
 
         public:
-        __device__ __forceinline__ scalar_t get_weight_grad(int32_t p, int32_t c, const LayerData& layer) const {
+        SN2_HOST_DEVICE scalar_t get_weight_grad(int32_t p, int32_t c, const LayerData& layer) const {
             if (p == c)
                 return 0.0;
             else if (c >= layer.base)
-                return weights_grad[(p + lat_len) * vis_len + c];
+                return weights_grad[offset(p + lat_len, vis_len, c)];
             else
                 return 0.0;
         }
 
         public:
-        __device__ __forceinline__ void set_weight_grad(int32_t p, int32_t c, scalar_t val) {
-            if (p <= c && structure[(p + lat_len) * vis_len + c])
-                weights_grad[(p + lat_len) * vis_len + c] = val;
+        SN2_HOST_DEVICE void set_weight_grad(int32_t p, int32_t c, scalar_t val) {
+            if (p <= c && structure[offset(p + lat_len, vis_len, c)])
+                weights_grad[offset(p + lat_len, vis_len, c)] = val;
         }
 
         public:
-        __device__ __forceinline__ scalar_t get_covariance(int32_t u, int32_t v) const {
+        SN2_HOST_DEVICE scalar_t get_covariance(int32_t u, int32_t v) const {
             if (u >= 0 || v >= 0)
-                return covariance[(min(u, v) + lat_len) * vis_len + max(u, v)];
+                return covariance[offset(lower(u, v) + lat_len, vis_len, upper(u, v))];
             else
                 return u == v ? 1.0 : 0.0;
         }
 
         public:
-        __device__ __forceinline__ void set_covariance(int32_t u, int32_t v, scalar_t val) {
+        SN2_HOST_DEVICE void set_covariance(int32_t u, int32_t v, scalar_t val) {
             if (u >= 0 && v >= 0)
-                covariance[(u + lat_len) * vis_len + v] = covariance[(v + lat_len) * vis_len + u] = val;
+                covariance[offset(u + lat_len, vis_len, v)] = covariance[offset(v + lat_len, vis_len, u)] = val;
             else if (u >= 0 || v >= 0)
-                covariance[(min(u, v) + lat_len) * vis_len + max(u, v)] = val;
+                covariance[offset(lower(u, v) + lat_len, vis_len, upper(u, v))] = val;
+        }
+
+        public:
+        /**
+         * @return the row of `u` in the storage of the covariance; `get_covariance(u, v) == row[v]` for visible `v`
+         *         if `u` is latent or both are visible (the visible block is stored symmetrically)
+         */
+        SN2_HOST_DEVICE const scalar_t* get_covariance_row(int32_t u) const {
+            return covariance + offset(u + lat_len, vis_len, 0);
         }
 
         public:
-        __device__ __forceinline__ scalar_t get_omega(int32_t a, int32_t d, int8_t buff) const {
+        SN2_HOST_DEVICE scalar_t get_omega(int32_t a, int32_t d, int8_t buff) const {
             if (a < 0) {
-                return omegas[buff][(a + lat_len) * (lat_len + vis_len) + (d + lat_len)];
+                return omegas[buff][offset(a + lat_len, num_lat_slots + vis_len, get_slot(d))];
             } else
                 return 0.0;
         }
 
         public:
-        __device__ __forceinline__ void set_omega(int32_t a, int32_t d, scalar_t val, int8_t buff) {
+        SN2_HOST_DEVICE void set_omega(int32_t a, int32_t d, scalar_t val, int8_t buff) {
             if (a < 0)
-                omegas[buff][(a + lat_len) * (lat_len + vis_len) + (d + lat_len)] = val;
+                omegas[buff][offset(a + lat_len, num_lat_slots + vis_len, get_slot(d))] = val;
         }
 
         public:
-        __device__ __forceinline__ scalar_t get_covariance_grad(int32_t u, int32_t v, int8_t buff) const {
+        SN2_HOST_DEVICE scalar_t get_covariance_grad(int32_t u, int32_t v, int8_t buff) const {
             if (u >= 0 || v >= 0) {
-                return covariance_grads[buff][(min(u, v) + lat_len) * vis_len + max(u, v)];
+                return covariance_grads[buff][offset(get_slot(lower(u, v)), vis_len, upper(u, v))];
             } else
                 return 0.0;
         }
 
         public:
-        __device__ __forceinline__ void set_covariance_grad(int32_t u, int32_t v, scalar_t val, int8_t buff) {
+        SN2_HOST_DEVICE void set_covariance_grad(int32_t u, int32_t v, scalar_t val, int8_t buff) {
             if (u >= 0 || v >= 0)
-                covariance_grads[buff][(min(u, v) + lat_len) * vis_len + max(u, v)] = val;
+                covariance_grads[buff][offset(get_slot(lower(u, v)), vis_len, upper(u, v))] = val;
         }
 
         public:
-        __device__ __forceinline__ scalar_t get_lambda(int32_t np, int32_t nc) const {
+        /**
+         * @return the row of `u` in the storage of the covariance gradient; `get_covariance_grad(u, v, buff) == row[v]`
+         *         for `v >= u` (only the upper triangle is stored)
+         */
+        SN2_HOST_DEVICE const scalar_t* get_covariance_grad_row(int32_t u, int8_t buff) const {
+            return covariance_grads[buff] + offset(get_slot(u), vis_len, 0);
+        }
+
+        private:
+        SN2_HOST_DEVICE int32_t get_lambda_row_index(int32_t np) const {
+            return lambda_rows ? lambda_rows[np + lat_len] : np + lat_len;
+        }
+
+        public:
+        SN2_HOST_DEVICE scalar_t get_lambda(int32_t np, int32_t nc) const {
             if (np == nc)
                 return get_covariance(np, nc);
             else if (nc >= 0)
-                return lambda[(np + lat_len) * vis_len + nc];
+                return lambda[offset(get_lambda_row_index(np), vis_len, nc)];
             else
                 return 0.0;
         }
 
         public:
-        __device__ __forceinline__ scalar_t set_lambda(int32_t np, int32_t nc, scalar_t val) {
-            lambda[(np + lat_len) * vis_len + nc] = val;
+        /**
+         * @return the row of `np` in the storage of lambda; `get_lambda(np, nc) == row[nc]` for visible `nc != np`
+         */
+        SN2_HOST_DEVICE const scalar_t* get_lambda_row(int32_t np) const {
+            return lambda + offset(get_lambda_row_index(np), vis_len, 0);
         }
 
         public:
-        __device__ __forceinline__ int32_t get_num_parents(int32_t v, const LayerData& layer) const {
+        SN2_HOST_DEVICE void set_lambda(int32_t np, int32_t nc, scalar_t val) {
+            const int32_t row = get_lambda_row_index(np);
+
+            if (row >= 0)
+                lambda[offset(row, vis_len, nc)] = val;
+        }
+
+        public:
+        /**
+         * @return lambda[q, k] for a new variable `k` of `layer`, as `covar::forward_kernel` computes it from the final
+         *         covariance: Σ_p B[p, k] Σ[p, q] if `q` is the parent of a variable `j <= k` of the layer (an earlier
+         *         variable is its own parent), and 0 otherwise
+         */
+        SN2_HOST_DEVICE scalar_t recompute_lambda(int32_t q, int32_t k, const LayerData& layer) const {
+            if (q >= 0 && q >= layer.base)
+                return 0.0;
+            else if (q < 0 && get_num_parents(q, layer) == 0) {
+                // Not its own parent; a parent of a new variable of the layer if its first child there comes no later
+                const index_t idx = offset(q + lat_len, num_layers, layer.idx - 1);
+
+                if (children_bases[idx + 1] == children_bases[idx] || children[children_bases[idx]] > k)
+                    return 0.0;
+            }
+
+            accscalar_t lambda_qk = 0.0;
+
+            for (int32_t t = parents_bases[k]; t < parents_bases[k + 1]; t++)
+                lambda_qk += accscalar_t(get_edge_weight(parents[t], k)) * get_covariance(parents[t], q);
+
+            return lambda_qk;
+        }
+
+        public:
+        SN2_HOST_DEVICE int32_t get_num_parents(int32_t v, const LayerData& layer) const {
             if (v >= layer.base)
                 return parents_bases[v + 1] - parents_bases[v];
             else if (v >= 0)
@@ -197,7 +311,7 @@ namespace sn2_cuda {
         }
 
         public:
-        __device__ __forceinline__ int32_t get_parent(int32_t v, int32_t idx, const LayerData& layer) const {
+        SN2_HOST_DEVICE int32_t get_parent(int32_t v, int32_t idx, const LayerData& layer) const {
             if (v >= layer.base)
                 return parents[parents_bases[v] + idx];
             else
@@ -210,8 +324,8 @@ namespace sn2_cuda {
          * @param begin the index of the first child is stored in it. Either -1 (the node parets itself) or 0 (otherwise)
          * @param end the index after the last child. Number of children in the current layer (except for itself)
          */
-        __device__ __forceinline__ void get_children_range(int32_t v, int32_t& begin, int32_t& end, const LayerData& layer) const {
-            const int32_t idx = (v + lat_len) * num_layers + layer.idx;
+        SN2_HOST_DEVICE void get_children_range(int32_t v, int32_t& begin, int32_t& end, const LayerData& layer) const {
+            const index_t idx = offset(v + lat_len, num_layers, layer.idx);
             end = children_bases[idx + 1] - children_bases[idx];
 
             if (v >= 0)
@@ -226,34 +340,81 @@ namespace sn2_cuda {
         /**
          * Get the `idx`-th child of `v` in layer `layer`; also get `v` if `idx == -1`.
          */
-        __device__ __forceinline__ int32_t get_child(int32_t v, int32_t idx, const LayerData& layer) const {
+        SN2_HOST_DEVICE int32_t get_child(int32_t v, int32_t idx, const LayerData& layer) const {
             if (idx == -1)
                 return v;
             else {
-                const int32_t base_idx = (v + lat_len) * num_layers + layer.idx;
+                const index_t base_idx = offset(v + lat_len, num_layers, layer.idx);
                 return children[children_bases[base_idx] + idx];
             }
         }
 
         public:
-        __device__ __forceinline__ int32_t get_layer_var(int32_t idx, const LayerData& layer) const {
+        SN2_HOST_DEVICE scalar_t get_edge_weight(int32_t p, int32_t c) const {
+            return weights[offset(p + lat_len, vis_len, c)];
+        }
+
+        public:
+        SN2_HOST_DEVICE int32_t get_num_all_parents(int32_t v) const {
+            return parents_bases[v + 1] - parents_bases[v];
+        }
+
+        public:
+        SN2_HOST_DEVICE int32_t get_all_parent(int32_t v, int32_t idx) const {
+            return parents[parents_bases[v] + idx];
+        }
+
+        public:
+        /**
+         * @param v the node whose children in all the layers are requested
+         * @param begin the index of the first child is stored in it; to be passed to `get_any_child`
+         * @param end the index after the last child is stored in it
+         */
+        SN2_HOST_DEVICE void get_all_children_range(int32_t v, int32_t& begin, int32_t& end) const {
+            const index_t idx = offset(v + lat_len, num_layers, 0);
+            begin = children_bases[idx];
+            end = children_bases[idx + num_layers - 1];
+        }
+
+        public:
+        SN2_HOST_DEVICE int32_t get_any_child(int32_t idx) const {
+            return children[idx];
+        }
+
+        public:
+        SN2_HOST_DEVICE int32_t get_layer_var(int32_t idx, const LayerData& layer) const {
             if (idx >= layer.lat_width)
                 return idx - layer.lat_width;
             else
-                return lat_neighbors[lat_neighbors_bases[layer.idx] + idx];
+                return layer.lat_vars[idx];
         }
 
         public:
-        __host__ __device__ __forceinline__ int32_t get_vis_len() const {
+        SN2_HOST_DEVICE int32_t get_vis_len() const {
             return vis_len;
         }
 
         public:
-        __host__ __device__ __forceinline__ int32_t get_lat_len() const {
+        SN2_HOST_DEVICE int32_t get_lat_len() const {
             return lat_len;
         }
 
-#else
+        public:
+        SN2_HOST_DEVICE int32_t get_num_lat_slots() const {
+            return num_lat_slots;
+        }
+
+        public:
+        /**
+         * @return a copy that reads and writes the rows of lambda given by `lambda_rows` (see `LambdaBlock`)
+         */
+        DeviceData with_lambda_rows(const int32_t* const lambda_rows) const {
+            DeviceData data = *this;
+            data.lambda_rows = lambda_rows;
+            return data;
+        }
+
+#ifndef __CUDACC__
         public:
         DeviceData(
                 const bool* const structure,
@@ -268,11 +429,12 @@ namespace sn2_cuda {
                 const int32_t* const parents_bases,
                 const int32_t* const children,
                 const int32_t* const children_bases,
-                const int32_t* const lat_neighbors,
-                const int32_t* const lat_neighbors_bases,
                 const int32_t* const lat_range,
+                const int32_t* const lat_slots,
+                const int32_t* const lambda_rows,
                 const int32_t vis_len,
                 const int32_t lat_len,
+                const int32_t num_lat_slots,
                 const int32_t num_layers
         ):  structure(structure),
             lambda(lambda),
@@ -282,25 +444,91 @@ namespace sn2_cuda {
             w_accum(w_accum),
             covariance_grads{
                 covariance_grads,
-                covariance_grads ? covariance_grads + ((lat_len + vis_len) * vis_len) : nullptr
+                covariance_grads ? covariance_grads + offset(num_lat_slots + vis_len, vis_len, 0) : nullptr
             },
             omegas{
                 omegas,
-                omegas ? omegas + (lat_len * (lat_len + vis_len)) : nullptr
+                omegas ? omegas + offset(lat_len, num_lat_slots + vis_len, 0) : nullptr
             },
             parents(parents),
             parents_bases(parents_bases),
             children(children),
             children_bases(children_bases),
-            lat_neighbors(lat_neighbors),
-            lat_neighbors_bases(lat_neighbors_bases),
             lat_range(lat_range),
+            lat_slots(lat_slots),
+            lambda_rows(lambda_rows),
             vis_len(vis_len),
             lat_len(lat_len),
+            num_lat_slots(num_lat_slots),
             num_layers(num_layers)
         { }
 #endif
     };
+
+    /**
+     * @return whether an offset into the matrices of `DeviceData` may not fit in `int32_t`; the largest are the
+     *         (|L|+|V|)×|V| matrices, the |L|×(slots+|V|) omegas and the (|L|+|V|)×layers bases of the children
+     */
+    inline bool needs_wide_indices(int64_t lat_len, int64_t vis_len, int64_t num_lat_slots, int64_t num_layers) {
+        const int64_t max_offset = std::max({
+                (lat_len + vis_len) * vis_len,
+                lat_len * (num_lat_slots + vis_len),
+                (lat_len + vis_len) * num_layers
+        });
+        return max_offset > std::numeric_limits<int32_t>::max();
+    }
+
+    /**
+     * The type in which the passes over `scalar_t` matrices accumulate: `double` for the mixed precision of `float`
+     * models, `float` for the `c10::BFloat16` storage, and `scalar_t` otherwise.
+     */
+    template <typename scalar_t, bool mixed>
+    using acc_scalar_t = std::conditional_t<
+            std::is_same_v<scalar_t, c10::BFloat16>,
+            float,
+            std::conditional_t<mixed, double, scalar_t>
+    >;
+
+    // Whether the device kernels are compiled for `scalar_t`; the `c10::BFloat16` storage runs on the host only
+    template <typename scalar_t>
+    constexpr bool has_device_kernels = !std::is_same_v<scalar_t, c10::BFloat16>;
 }
 
+/*
+ * Runs the lambda `...` with `scalar_t` dispatched as by `AT_DISPATCH_FLOATING_TYPES`, and as `c10::BFloat16` for the
+ * `torch::kBFloat16` storage.
+ */
+#define SN2_DISPATCH_FLOATING_TYPES(TYPE, NAME, ...) \
+    AT_DISPATCH_FLOATING_TYPES_AND(at::ScalarType::BFloat16, TYPE, NAME, __VA_ARGS__)
+
+/*
+ * Runs the lambda `...` with `index_t` defined as `int64_t` if `WIDE` and as `int32_t` otherwise; the offset type of
+ * `DeviceData` is dispatched the way `AT_DISPATCH_FLOATING_TYPES` dispatches `scalar_t`.
+ */
+#define SN2_DISPATCH_INDEX_TYPES(WIDE, ...)     \
+    [&] {                                       \
+        if (WIDE) {                             \
+            using index_t = int64_t;            \
+            return __VA_ARGS__();               \
+        } else {                                \
+            using index_t = int32_t;            \
+            return __VA_ARGS__();               \
+        }                                       \
+    }()
+
+/*
+ * Runs the lambda `...` with `index_t` dispatched as by `SN2_DISPATCH_INDEX_TYPES`, and with `accscalar_t` defined as
+ * `acc_scalar_t<scalar_t, MIXED>`; the three types are those of `DeviceData`.
+ */
+#define SN2_DISPATCH_DATA_TYPES(WIDE, MIXED, ...)                               \
+    SN2_DISPATCH_INDEX_TYPES(WIDE, ([&] {                                       \
+        if (MIXED) {                                                            \
+            using accscalar_t = sn2_cuda::acc_scalar_t<scalar_t, true>;         \
+            return __VA_ARGS__();                                               \
+        } else {                                                                \
+            using accscalar_t = sn2_cuda::acc_scalar_t<scalar_t, false>;        \
+            return __VA_ARGS__();                                               \
+        }                                                                       \
+    }))
+
 #endif
\ No newline at end of file
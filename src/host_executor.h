@@ -0,0 +1,315 @@
+#ifndef HOST_EXECUTOR_H
+#define HOST_EXECUTOR_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+#include <stdint.h>
+
+namespace sn2_cuda {
+    namespace host {
+        // Class TaskGraph
+        /**
+         * A directed acyclic graph of tasks; a task becomes ready as soon as all of its predecessors are finished.
+         */
+        class TaskGraph {
+            friend class Executor;
+
+            public:
+            using Task = std::function<void()>;
+
+            private:
+            std::vector<Task> tasks;
+            std::vector<std::vector<int32_t>> successors;
+            std::vector<int32_t> num_predecessors;
+
+            public:
+            /**
+             * @return the id of the new task
+             */
+            int32_t add_task(Task task) {
+                this->tasks.push_back(std::move(task));
+                this->successors.emplace_back();
+                this->num_predecessors.push_back(0);
+                return static_cast<int32_t>(this->tasks.size()) - 1;
+            }
+
+            public:
+            /**
+             * Makes `after` wait for `before` to finish.
+             */
+            void add_dependency(int32_t before, int32_t after) {
+                this->successors[before].push_back(after);
+                this->num_predecessors[after]++;
+            }
+
+            public:
+            /**
+             * Adds an empty task that finishes after all of `before`; useful for joining many tasks with many others.
+             * @return the id of the join task
+             */
+            int32_t add_join(const std::vector<int32_t>& before) {
+                const int32_t join = this->add_task(nullptr);
+
+                for (const int32_t task : before)
+                    this->add_dependency(task, join);
+
+                return join;
+            }
+
+            public:
+            int32_t size() const {
+                return static_cast<int32_t>(this->tasks.size());
+            }
+
+            public:
+            bool empty() const {
+                return this->tasks.empty();
+            }
+        };
+
+        // Class Executor
+        /**
+         * A pool of threads that runs the tasks of a `TaskGraph` as soon as they are ready.
+         * Every thread keeps its ready tasks in its own deque; it runs the latest of them (which usually reuses the data
+         * its predecessor just wrote), and steals the oldest task of another thread when it runs out of tasks.
+         * The calling thread takes part in running the graph. Only one graph runs on the pool at a time; a graph that
+         * is submitted while the pool is busy, or from a task of the running graph, runs on the calling thread alone.
+         */
+        class Executor {
+            private:
+            struct Worker {
+                std::deque<int32_t> queue;
+                std::mutex mutex;
+            };
+
+            private:
+            std::vector<std::unique_ptr<Worker>> workers;       // Worker 0 is the calling thread
+            std::vector<std::thread> threads;
+            std::mutex run_mutex;                               // Held by the thread running a graph on the pool
+            std::mutex state_mutex;
+            std::condition_variable start_condition;
+            std::condition_variable idle_condition;
+            const TaskGraph* graph = nullptr;
+            std::unique_ptr<std::atomic<int32_t>[]> pending;    // Number of unfinished predecessors of every task
+            std::atomic<int32_t> remaining{0};                  // Number of unfinished tasks of the running graph
+            std::atomic<bool> failed{false};
+            std::exception_ptr error;
+            uint64_t generation = 0;
+            int32_t num_active = 0;
+            static inline thread_local bool in_task = false;     // Whether the thread is running a task of the pool
+
+            private:
+            explicit Executor(int32_t num_threads) {
+                for (int32_t i = 0; i < num_threads; i++)
+                    this->workers.push_back(std::make_unique<Worker>());
+
+                for (int32_t i = 1; i < num_threads; i++)
+                    this->threads.emplace_back(&Executor::thread_main, this, i);
+            }
+
+            private:
+            void push(int32_t self, int32_t task) {
+                std::lock_guard<std::mutex> lock(this->workers[self]->mutex);
+                this->workers[self]->queue.push_back(task);
+            }
+
+            private:
+            bool pop(int32_t self, int32_t& task) {
+                std::lock_guard<std::mutex> lock(this->workers[self]->mutex);
+
+                if (this->workers[self]->queue.empty())
+                    return false;
+
+                task = this->workers[self]->queue.back();
+                this->workers[self]->queue.pop_back();
+                return true;
+            }
+
+            private:
+            bool steal(int32_t self, int32_t& task) {
+                const int32_t num_workers = static_cast<int32_t>(this->workers.size());
+
+                for (int32_t i = 1; i < num_workers; i++) {
+                    Worker& victim = *this->workers[(self + i) % num_workers];
+                    std::lock_guard<std::mutex> lock(victim.mutex);
+
+                    if (!victim.queue.empty()) {
+                        task = victim.queue.front();
+                        victim.queue.pop_front();
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+
+            private:
+            void execute(int32_t self, int32_t task) {
+                const auto& function = this->graph->tasks[task];
+
+                if (function && !this->failed.load(std::memory_order_relaxed)) {
+                    try {
+                        in_task = true;
+                        function();
+                        in_task = false;
+                    } catch (...) {
+                        in_task = false;
+                        std::lock_guard<std::mutex> lock(this->state_mutex);
+
+                        if (!this->failed.exchange(true))
+                            this->error = std::current_exception();
+                    }
+                }
+
+                for (const int32_t successor : this->graph->successors[task])
+                    if (this->pending[successor].fetch_sub(1, std::memory_order_acq_rel) == 1)
+                        this->push(self, successor);
+
+                this->remaining.fetch_sub(1, std::memory_order_acq_rel);
+            }
+
+            private:
+            void work(int32_t self) {
+                int32_t task;
+
+                while (this->remaining.load(std::memory_order_acquire) > 0) {
+                    if (this->pop(self, task) || this->steal(self, task))
+                        this->execute(self, task);
+                    else
+                        std::this_thread::yield();
+                }
+            }
+
+            private:
+            void thread_main(int32_t self) {
+                uint64_t seen_generation = 0;
+
+                for (;;) {
+                    {
+                        std::unique_lock<std::mutex> lock(this->state_mutex);
+                        this->start_condition.wait(lock, [&] { return this->generation != seen_generation; });
+                        seen_generation = this->generation;
+                        this->num_active++;
+                    }
+
+                    this->work(self);
+
+                    {
+                        std::lock_guard<std::mutex> lock(this->state_mutex);
+
+                        if (--this->num_active == 0)
+                            this->idle_condition.notify_all();
+                    }
+                }
+            }
+
+            private:
+            /**
+             * Runs `graph` on the calling thread in a topological order.
+             */
+            static void run_serially(const TaskGraph& graph) {
+                std::vector<int32_t> pending(graph.num_predecessors);
+                std::vector<int32_t> ready;
+
+                for (int32_t task = 0; task < graph.size(); task++)
+                    if (pending[task] == 0)
+                        ready.push_back(task);
+
+                while (!ready.empty()) {
+                    const int32_t task = ready.back();
+                    ready.pop_back();
+
+                    if (graph.tasks[task])
+                        graph.tasks[task]();
+
+                    for (const int32_t successor : graph.successors[task])
+                        if (--pending[successor] == 0)
+                            ready.push_back(successor);
+                }
+            }
+
+            public:
+            Executor(const Executor&) = delete;
+            Executor& operator=(const Executor&) = delete;
+
+            public:
+            /**
+             * @return the executor shared by all the solvers; it has one thread per hardware thread
+             */
+            static Executor& get_instance() {
+                // Never destroyed: joining threads while the process unloads the extension may deadlock
+                static Executor* instance = new Executor(std::max(1u, std::thread::hardware_concurrency()));
+                return *instance;
+            }
+
+            public:
+            int32_t get_num_threads() const {
+                return static_cast<int32_t>(this->workers.size());
+            }
+
+            public:
+            /**
+             * Runs all the tasks of `graph` and returns when they are finished; rethrows the first exception of a task.
+             */
+            void run(const TaskGraph& graph) {
+                // The calling thread of the running graph holds `run_mutex`, which it may not try to lock again
+                if (in_task) {
+                    run_serially(graph);
+                    return;
+                }
+
+                std::unique_lock<std::mutex> run_lock(this->run_mutex, std::try_to_lock);
+
+                if (!run_lock.owns_lock() || this->workers.size() == 1 || graph.size() <= 1) {
+                    if (run_lock.owns_lock())
+                        run_lock.unlock();              // The tasks may submit graphs of their own
+
+                    run_serially(graph);
+                    return;
+                }
+
+                this->graph = &graph;
+                this->pending.reset(new std::atomic<int32_t>[graph.size()]);
+                this->failed = false;
+                this->error = nullptr;
+                int32_t next_worker = 0;
+
+                for (int32_t task = 0; task < graph.size(); task++) {
+                    this->pending[task].store(graph.num_predecessors[task], std::memory_order_relaxed);
+
+                    if (graph.num_predecessors[task] == 0)
+                        this->push(next_worker++ % static_cast<int32_t>(this->workers.size()), task);
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(this->state_mutex);
+                    this->remaining.store(graph.size(), std::memory_order_release);
+                    this->generation++;
+                }
+
+                this->start_condition.notify_all();
+                this->work(0);
+
+                {
+                    // No thread may touch `graph` after it is returned to the caller
+                    std::unique_lock<std::mutex> lock(this->state_mutex);
+                    this->idle_condition.wait(lock, [&] { return this->num_active == 0; });
+                    this->graph = nullptr;
+                }
+
+                if (this->error)
+                    std::rethrow_exception(this->error);
+            }
+        };
+    }
+}
+
+#endif
\ No newline at end of file
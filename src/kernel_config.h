@@ -4,5 +4,10 @@
 #define SHARED_MEMORY_SIZE_FORWARD 8 * 1024
 #define SHARED_MEMORY_SIZE_BACKWARD 8 * 1024
 #define THREADS_PER_BLOCK 256
+#define MIN_SEGMENT_SIZE 64             // Rows of a layer are split into segments no shorter than this (see `work_partition.h`)
+#define MAX_SEGMENT_SIZE 512            // ^ nor longer than this; a segment of `double` edges fits the shared memory
+#define MAX_UNROLLED_DEGREE 8           // Layers whose segments are no longer than this run kernels unrolled for their degree
+#define MAX_TINY_MODEL_SIZE 32          // The largest |L| and |V| of the models of `SN2BatchSolver` (see `tiny_model.h`)
+#define TINY_THREADS_PER_BLOCK 128      // Models per block of `SN2BatchSolver`; every model is one thread
 
 #endif
\ No newline at end of file
@@ -0,0 +1,136 @@
+#ifndef METHOD_SELECTION_H
+#define METHOD_SELECTION_H
+
+#include "device_data.h"
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+namespace sn2_cuda {
+    // The estimated (or measured) cost of a forward and a backward pass with one method
+    struct MethodCost {
+        double flops = 0.0;
+        double bytes = 0.0;                     // Memory traffic
+        double launches = 0.0;                  // Kernel launches, or synchronizations of the host executor
+        double memory = 0.0;                    // Bytes of the buffers of the method
+        double seconds = 0.0;                   // Estimated from the above, or measured if `measured`
+        bool measured = false;
+    };
+
+    // Class MethodCosts
+    /**
+     * A rough cost model of `SN2Solver::METHODS` on a compiled structure. The sparse methods are counted term by term
+     * over the layers, where every term reads an entry of a dense matrix; the dense method is counted as the triangular
+     * solves and matrix products it runs. The time of a method is the larger of its compute and memory time, plus a
+     * fixed latency per launch.
+     */
+    class MethodCosts {
+        public:
+        MethodCost covar;
+        MethodCost accum;
+        MethodCost trisolve;
+
+        private:
+        struct Machine {
+            double flops_per_second;
+            double bytes_per_second;
+            double seconds_per_launch;
+        };
+
+        private:
+        static Machine get_machine(const bool on_device) {
+            if (on_device)
+                return {1e13, 5e11, 5e-6};
+
+            const double num_threads = std::max(1u, std::thread::hardware_concurrency());
+            return {num_threads * 1e10, 2e10, 2e-6};
+        }
+
+        private:
+        static void estimate_seconds(MethodCost& cost, const Machine& machine) {
+            cost.seconds = std::max(cost.flops / machine.flops_per_second, cost.bytes / machine.bytes_per_second)
+                         + cost.launches * machine.seconds_per_launch;
+            cost.measured = false;
+        }
+
+        public:
+        MethodCosts() = default;
+
+        public:
+        /**
+         * @param layers_vec the layers, with `lat_vars` readable from the host
+         * @param data the structure, with the index arrays readable from the host
+         * @param scalar_size the size of `float` or `double`
+         * @param on_device whether the solver runs on CUDA
+         */
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        MethodCosts(const std::vector<LayerData>& layers_vec, const DeviceData<scalar_t, index_t, accscalar_t>& data, const int32_t scalar_size, const bool on_device) {
+            const double lat_len = data.get_lat_len();
+            const double vis_len = data.get_vis_len();
+            const double total_len = lat_len + vis_len;
+            const double slots_len = data.get_num_lat_slots() + vis_len;   // The rows of the backward buffers
+            const double num_layers = layers_vec.size() > 1 ? layers_vec.size() - 1 : 0;
+            double num_edges = 0.0, forward_terms = 0.0, backward_terms = 0.0;
+
+            for (const auto& layer : layers_vec) {
+                double parents_i = 0.0, parents_j = 0.0, children = 0.0;
+
+                for (int32_t x = 0; x < layer.get_num_new_vars(); x++)
+                    parents_i += data.get_num_parents(x + layer.base, layer);
+
+                for (int32_t y = 0; y < layer.get_num_vars(); y++) {
+                    int32_t begin, end;
+                    const int32_t v = data.get_layer_var(y, layer);
+                    data.get_children_range(v, begin, end, layer);
+                    parents_j += data.get_num_parents(v, layer);
+                    children += end - begin;
+                    num_edges += end;
+                }
+
+                // Pa(i)×Pa(j) for the new variables `i` and the variables `j ≤ i` of the layer; same for the children
+                forward_terms += parents_i * parents_j / 2.0;
+                backward_terms += children * children / 2.0;
+            }
+
+            // λ and Σ take a multiply-add each per term; the gradients of the weights read a row of |V| per edge
+            covar.flops = 4.0 * forward_terms + 2.0 * backward_terms + 2.0 * num_edges * vis_len;
+            covar.bytes = scalar_size * (forward_terms + backward_terms + 2.0 * num_edges * vis_len);
+            covar.launches = 3.0 * num_layers;
+            covar.memory = scalar_size * (2.0 * total_len + 2.0 * slots_len) * vis_len;
+
+            // W^acc and Ω take a column of |L| per edge, the gradients of the weights too; plus Σ = Aᵀ A and Ω = A G
+            accum.flops = 6.0 * num_edges * lat_len + 4.0 * lat_len * vis_len * vis_len;
+            accum.bytes = scalar_size * (3.0 * num_edges * lat_len + 2.0 * lat_len * vis_len + 2.0 * vis_len * vis_len);
+            accum.launches = 3.0 * num_layers + 2.0;
+            accum.memory = scalar_size * (2.0 * vis_len * vis_len + lat_len * vis_len + 2.0 * lat_len * slots_len);
+
+            // Two triangular solves with |L| right-hand sides and three products of |L|×|V| by |V|×|V|
+            trisolve.flops = 2.0 * lat_len * vis_len * vis_len + 6.0 * lat_len * vis_len * vis_len;
+            trisolve.bytes = scalar_size * (5.0 * vis_len * vis_len + 7.0 * lat_len * vis_len);
+            trisolve.launches = 8.0;
+            trisolve.memory = scalar_size * (3.0 * vis_len * vis_len + lat_len * vis_len);
+
+            const Machine machine = get_machine(on_device);
+            estimate_seconds(covar, machine);
+            estimate_seconds(accum, machine);
+            estimate_seconds(trisolve, machine);
+        }
+
+        public:
+        /**
+         * @return 0, 1 or 2 for the cheapest of `covar`, `accum` and `trisolve`; the order of `SN2Solver::METHODS`
+         */
+        int32_t get_cheapest() const {
+            const MethodCost* costs[] = {&covar, &accum, &trisolve};
+            int32_t cheapest = 0;
+
+            for (int32_t m = 1; m < 3; m++)
+                if (costs[m]->seconds < costs[cheapest]->seconds)
+                    cheapest = m;
+
+            return cheapest;
+        }
+    };
+}
+
+#endif
\ No newline at end of file
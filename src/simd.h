@@ -0,0 +1,589 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <c10/util/BFloat16.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <type_traits>
+
+/*
+ * Dot products for the inner loops of the host path, in AVX2 and AVX-512 variants that are selected at runtime
+ * from the features of the CPU. Every variant is compiled for its own target, so the extension still loads on
+ * CPUs without them. Set the environment variable `SN2_SIMD` to `scalar`, `avx2` or `avx512` to force a variant.
+ * The products of `float` vectors can be accumulated in `double` lanes (`accscalar_t`), for the mixed precision, and
+ * those of `c10::BFloat16` vectors in `float` lanes; on CPUs with AVX512-BF16 the contiguous ones use its native
+ * dot-product instruction. The deterministic mode uses the portable variant of a fixed shape (`fixed`) instead.
+ */
+#if defined(__x86_64__) || defined(_M_X64)
+#define SN2_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(SN2_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+#define SN2_TARGET(features) __attribute__((target(features)))
+#else
+#define SN2_TARGET(features)
+#endif
+
+namespace sn2_cuda {
+    namespace simd {
+        enum struct ISA {
+            SCALAR = 0,
+            AVX2,
+            AVX512,
+            AVX512_BF16                         // AVX-512 and its `c10::BFloat16` dot products
+        };
+
+        // The operations of a variant for `scalar_t`, accumulated in `accscalar_t`
+        template <typename scalar_t, typename accscalar_t = scalar_t>
+        struct Kernels {
+            /**
+             * @return Σ_k a[k] b[k] for k < n
+             */
+            accscalar_t (*dot)(const scalar_t* a, const scalar_t* b, int32_t n);
+
+            /**
+             * @return Σ_k a[k] b[k * stride] for k < n
+             */
+            accscalar_t (*dot_strided)(const scalar_t* a, const scalar_t* b, int64_t stride, int32_t n);
+
+            /**
+             * @return Σ_k a[k] b[indices[k]] for k < n
+             */
+            accscalar_t (*gather_dot)(const scalar_t* a, const scalar_t* b, const int32_t* indices, int32_t n);
+        };
+
+        namespace scalar {
+            template <typename scalar_t, typename accscalar_t = scalar_t>
+            accscalar_t dot(const scalar_t* a, const scalar_t* b, int32_t n) {
+                accscalar_t sum = 0.0;
+
+                for (int32_t k = 0; k < n; k++)
+                    sum += accscalar_t(a[k]) * b[k];
+
+                return sum;
+            }
+
+            template <typename scalar_t, typename accscalar_t = scalar_t>
+            accscalar_t dot_strided(const scalar_t* a, const scalar_t* b, int64_t stride, int32_t n) {
+                accscalar_t sum = 0.0;
+
+                for (int32_t k = 0; k < n; k++)
+                    sum += accscalar_t(a[k]) * b[k * stride];
+
+                return sum;
+            }
+
+            template <typename scalar_t, typename accscalar_t = scalar_t>
+            accscalar_t gather_dot(const scalar_t* a, const scalar_t* b, const int32_t* indices, int32_t n) {
+                accscalar_t sum = 0.0;
+
+                for (int32_t k = 0; k < n; k++)
+                    sum += accscalar_t(a[k]) * b[indices[k]];
+
+                return sum;
+            }
+        }
+
+        /*
+         * Dot products of a fixed shape, for the deterministic mode: the products are added to `WIDTH` partial sums
+         * in turn, the partial sums are added as a fixed tree, and the remaining products are added last. The sums are
+         * therefore the same on every CPU, whatever variant it supports. The products and the additions are separate
+         * statements, so that the compiler does not fuse them.
+         */
+        namespace fixed {
+            constexpr int32_t WIDTH = 8;
+
+            /**
+             * @return Σ_k a[k] b_at(k) for k < n
+             */
+            template <typename scalar_t, typename accscalar_t, typename Function>
+            accscalar_t reduce(const scalar_t* a, int32_t n, const Function& b_at) {
+                accscalar_t lanes[WIDTH] = { };
+                accscalar_t tail = 0.0;
+                int32_t k = 0;
+
+                for (; k + WIDTH <= n; k += WIDTH)
+                    for (int32_t l = 0; l < WIDTH; l++) {
+                        const accscalar_t product = accscalar_t(a[k + l]) * accscalar_t(b_at(k + l));
+                        lanes[l] += product;
+                    }
+
+                for (; k < n; k++) {
+                    const accscalar_t product = accscalar_t(a[k]) * accscalar_t(b_at(k));
+                    tail += product;
+                }
+
+                const accscalar_t sum = ((lanes[0] + lanes[4]) + (lanes[2] + lanes[6])) + ((lanes[1] + lanes[5]) + (lanes[3] + lanes[7]));
+                return sum + tail;
+            }
+
+            template <typename scalar_t, typename accscalar_t = scalar_t>
+            accscalar_t dot(const scalar_t* a, const scalar_t* b, int32_t n) {
+                return reduce<scalar_t, accscalar_t>(a, n, [b] (int32_t k) { return b[k]; });
+            }
+
+            template <typename scalar_t, typename accscalar_t = scalar_t>
+            accscalar_t dot_strided(const scalar_t* a, const scalar_t* b, int64_t stride, int32_t n) {
+                return reduce<scalar_t, accscalar_t>(a, n, [b, stride] (int32_t k) { return b[k * stride]; });
+            }
+
+            template <typename scalar_t, typename accscalar_t = scalar_t>
+            accscalar_t gather_dot(const scalar_t* a, const scalar_t* b, const int32_t* indices, int32_t n) {
+                return reduce<scalar_t, accscalar_t>(a, n, [b, indices] (int32_t k) { return b[indices[k]]; });
+            }
+        }
+
+#ifdef SN2_SIMD_X86
+        /*
+         * Each variant defines its vector operations for `float` and `double` (`Vec`), and the dot products on top
+         * of them; everything in a variant is compiled for the features of that variant only. `Vec<float, double>`
+         * loads `float` values into `double` lanes, at half the width; `Vec<c10::BFloat16, float>` loads `c10::BFloat16`
+         * values into `float` lanes, whose upper halves they are. There is no gather of 16-bit values, so the latter
+         * gathers element by element.
+         */
+        namespace avx2 {
+            template <typename scalar_t, typename accscalar_t = scalar_t>
+            struct Vec;
+
+            template <>
+            struct Vec<double> {
+                using type = __m256d;
+                using offsets_type = __m256i;
+                static constexpr int32_t width = 4;
+
+                SN2_TARGET("avx2,fma") static type zero() { return _mm256_setzero_pd(); }
+                SN2_TARGET("avx2,fma") static type load(const double* a) { return _mm256_loadu_pd(a); }
+                SN2_TARGET("avx2,fma") static type fmadd(type a, type b, type c) { return _mm256_fmadd_pd(a, b, c); }
+                SN2_TARGET("avx2,fma") static type add(type a, type b) { return _mm256_add_pd(a, b); }
+
+                SN2_TARGET("avx2,fma") static type gather(const double* b, const int32_t* indices) {
+                    return _mm256_i32gather_pd(b, _mm_loadu_si128(reinterpret_cast<const __m128i*>(indices)), 8);
+                }
+
+                SN2_TARGET("avx2,fma") static offsets_type make_offsets(int64_t stride) {
+                    return _mm256_set_epi64x(3 * stride, 2 * stride, stride, 0);
+                }
+
+                SN2_TARGET("avx2,fma") static type gather(const double* b, offsets_type offsets) {
+                    return _mm256_i64gather_pd(b, offsets, 8);
+                }
+
+                SN2_TARGET("avx2,fma") static double reduce(type a) {
+                    const __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+                    return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+                }
+            };
+
+            template <>
+            struct Vec<float> {
+                using type = __m256;
+                using offsets_type = __m256i;
+                static constexpr int32_t width = 8;
+
+                SN2_TARGET("avx2,fma") static type zero() { return _mm256_setzero_ps(); }
+                SN2_TARGET("avx2,fma") static type load(const float* a) { return _mm256_loadu_ps(a); }
+                SN2_TARGET("avx2,fma") static type fmadd(type a, type b, type c) { return _mm256_fmadd_ps(a, b, c); }
+                SN2_TARGET("avx2,fma") static type add(type a, type b) { return _mm256_add_ps(a, b); }
+
+                SN2_TARGET("avx2,fma") static type gather(const float* b, const int32_t* indices) {
+                    return _mm256_i32gather_ps(b, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices)), 4);
+                }
+
+                SN2_TARGET("avx2,fma") static offsets_type make_offsets(int64_t stride) {
+                    const int32_t s = static_cast<int32_t>(stride);
+                    return _mm256_set_epi32(7 * s, 6 * s, 5 * s, 4 * s, 3 * s, 2 * s, s, 0);
+                }
+
+                SN2_TARGET("avx2,fma") static type gather(const float* b, offsets_type offsets) {
+                    return _mm256_i32gather_ps(b, offsets, 4);
+                }
+
+                SN2_TARGET("avx2,fma") static float reduce(type a) {
+                    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+                    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+                    return _mm_cvtss_f32(_mm_add_ss(sum, _mm_movehdup_ps(sum)));
+                }
+            };
+
+            template <>
+            struct Vec<float, double> : Vec<double> {
+                SN2_TARGET("avx2,fma") static type load(const float* a) { return _mm256_cvtps_pd(_mm_loadu_ps(a)); }
+
+                SN2_TARGET("avx2,fma") static type gather(const float* b, const int32_t* indices) {
+                    return _mm256_cvtps_pd(_mm_i32gather_ps(b, _mm_loadu_si128(reinterpret_cast<const __m128i*>(indices)), 4));
+                }
+
+                SN2_TARGET("avx2,fma") static type gather(const float* b, offsets_type offsets) {
+                    return _mm256_cvtps_pd(_mm256_i64gather_ps(b, offsets, 4));
+                }
+            };
+
+            template <>
+            struct Vec<c10::BFloat16, float> : Vec<float> {
+                using offsets_type = int64_t;
+
+                SN2_TARGET("avx2,fma") static type load(const c10::BFloat16* a) {
+                    const __m128i bits = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+                    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(bits), 16));
+                }
+
+                SN2_TARGET("avx2,fma") static type gather(const c10::BFloat16* b, const int32_t* indices) {
+                    c10::BFloat16 values[width];
+
+                    for (int32_t k = 0; k < width; k++)
+                        values[k] = b[indices[k]];
+
+                    return load(values);
+                }
+
+                static offsets_type make_offsets(int64_t stride) {
+                    return stride;
+                }
+
+                SN2_TARGET("avx2,fma") static type gather(const c10::BFloat16* b, offsets_type stride) {
+                    c10::BFloat16 values[width];
+
+                    for (int32_t k = 0; k < width; k++)
+                        values[k] = b[k * stride];
+
+                    return load(values);
+                }
+            };
+
+            template <typename scalar_t, typename accscalar_t = scalar_t>
+            SN2_TARGET("avx2,fma") accscalar_t dot(const scalar_t* a, const scalar_t* b, int32_t n) {
+                using V = Vec<scalar_t, accscalar_t>;
+                typename V::type sum_0 = V::zero(), sum_1 = V::zero();
+                int32_t k = 0;
+
+                // Two accumulators hide the latency of the fused multiply-add
+                for (; k + 2 * V::width <= n; k += 2 * V::width) {
+                    sum_0 = V::fmadd(V::load(a + k), V::load(b + k), sum_0);
+                    sum_1 = V::fmadd(V::load(a + k + V::width), V::load(b + k + V::width), sum_1);
+                }
+
+                for (; k + V::width <= n; k += V::width)
+                    sum_0 = V::fmadd(V::load(a + k), V::load(b + k), sum_0);
+
+                return V::reduce(V::add(sum_0, sum_1)) + scalar::dot<scalar_t, accscalar_t>(a + k, b + k, n - k);
+            }
+
+            template <typename scalar_t, typename accscalar_t = scalar_t>
+            SN2_TARGET("avx2,fma") accscalar_t dot_strided(const scalar_t* a, const scalar_t* b, int64_t stride, int32_t n) {
+                using V = Vec<scalar_t, accscalar_t>;
+                const typename V::offsets_type offsets = V::make_offsets(stride);
+                typename V::type sum = V::zero();
+                int32_t k = 0;
+
+                for (; k + V::width <= n; k += V::width)
+                    sum = V::fmadd(V::load(a + k), V::gather(b + k * stride, offsets), sum);
+
+                return V::reduce(sum) + scalar::dot_strided<scalar_t, accscalar_t>(a + k, b + k * stride, stride, n - k);
+            }
+
+            template <typename scalar_t, typename accscalar_t = scalar_t>
+            SN2_TARGET("avx2,fma") accscalar_t gather_dot(const scalar_t* a, const scalar_t* b, const int32_t* indices, int32_t n) {
+                using V = Vec<scalar_t, accscalar_t>;
+                typename V::type sum = V::zero();
+                int32_t k = 0;
+
+                for (; k + V::width <= n; k += V::width)
+                    sum = V::fmadd(V::load(a + k), V::gather(b, indices + k), sum);
+
+                return V::reduce(sum) + scalar::gather_dot<scalar_t, accscalar_t>(a + k, b, indices + k, n - k);
+            }
+        }
+
+        namespace avx512 {
+            template <typename scalar_t, typename accscalar_t = scalar_t>
+            struct Vec;
+
+            template <>
+            struct Vec<double> {
+                using type = __m512d;
+                using offsets_type = __m512i;
+                static constexpr int32_t width = 8;
+
+                SN2_TARGET("avx512f") static type zero() { return _mm512_setzero_pd(); }
+                SN2_TARGET("avx512f") static type load(const double* a) { return _mm512_loadu_pd(a); }
+                SN2_TARGET("avx512f") static type fmadd(type a, type b, type c) { return _mm512_fmadd_pd(a, b, c); }
+                SN2_TARGET("avx512f") static type add(type a, type b) { return _mm512_add_pd(a, b); }
+
+                SN2_TARGET("avx512f") static type gather(const double* b, const int32_t* indices) {
+                    return _mm512_i32gather_pd(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices)), b, 8);
+                }
+
+                SN2_TARGET("avx512f") static offsets_type make_offsets(int64_t stride) {
+                    return _mm512_set_epi64(7 * stride, 6 * stride, 5 * stride, 4 * stride, 3 * stride, 2 * stride, stride, 0);
+                }
+
+                SN2_TARGET("avx512f") static type gather(const double* b, offsets_type offsets) {
+                    return _mm512_i64gather_pd(offsets, b, 8);
+                }
+
+                SN2_TARGET("avx512f") static double reduce(type a) {
+                    return _mm512_reduce_add_pd(a);
+                }
+            };
+
+            template <>
+            struct Vec<float> {
+                using type = __m512;
+                using offsets_type = __m512i;
+                static constexpr int32_t width = 16;
+
+                SN2_TARGET("avx512f") static type zero() { return _mm512_setzero_ps(); }
+                SN2_TARGET("avx512f") static type load(const float* a) { return _mm512_loadu_ps(a); }
+                SN2_TARGET("avx512f") static type fmadd(type a, type b, type c) { return _mm512_fmadd_ps(a, b, c); }
+                SN2_TARGET("avx512f") static type add(type a, type b) { return _mm512_add_ps(a, b); }
+
+                SN2_TARGET("avx512f") static type gather(const float* b, const int32_t* indices) {
+                    return _mm512_i32gather_ps(_mm512_loadu_si512(indices), b, 4);
+                }
+
+                SN2_TARGET("avx512f") static offsets_type make_offsets(int64_t stride) {
+                    const int32_t s = static_cast<int32_t>(stride);
+                    return _mm512_set_epi32(15 * s, 14 * s, 13 * s, 12 * s, 11 * s, 10 * s, 9 * s, 8 * s,
+                                            7 * s, 6 * s, 5 * s, 4 * s, 3 * s, 2 * s, s, 0);
+                }
+
+                SN2_TARGET("avx512f") static type gather(const float* b, offsets_type offsets) {
+                    return _mm512_i32gather_ps(offsets, b, 4);
+                }
+
+                SN2_TARGET("avx512f") static float reduce(type a) {
+                    return _mm512_reduce_add_ps(a);
+                }
+            };
+
+            template <>
+            struct Vec<float, double> : Vec<double> {
+                SN2_TARGET("avx512f") static type load(const float* a) { return _mm512_cvtps_pd(_mm256_loadu_ps(a)); }
+
+                SN2_TARGET("avx512f") static type gather(const float* b, const int32_t* indices) {
+                    return _mm512_cvtps_pd(_mm256_i32gather_ps(b, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices)), 4));
+                }
+
+                SN2_TARGET("avx512f") static type gather(const float* b, offsets_type offsets) {
+                    return _mm512_cvtps_pd(_mm512_i64gather_ps(offsets, b, 4));
+                }
+            };
+
+            template <>
+            struct Vec<c10::BFloat16, float> : Vec<float> {
+                using offsets_type = int64_t;
+
+                SN2_TARGET("avx512f") static type load(const c10::BFloat16* a) {
+                    const __m256i bits = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a));
+                    return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(bits), 16));
+                }
+
+                SN2_TARGET("avx512f") static type gather(const c10::BFloat16* b, const int32_t* indices) {
+                    c10::BFloat16 values[width];
+
+                    for (int32_t k = 0; k < width; k++)
+                        values[k] = b[indices[k]];
+
+                    return load(values);
+                }
+
+                static offsets_type make_offsets(int64_t stride) {
+                    return stride;
+                }
+
+                SN2_TARGET("avx512f") static type gather(const c10::BFloat16* b, offsets_type stride) {
+                    c10::BFloat16 values[width];
+
+                    for (int32_t k = 0; k < width; k++)
+                        values[k] = b[k * stride];
+
+                    return load(values);
+                }
+            };
+
+            template <typename scalar_t, typename accscalar_t = scalar_t>
+            SN2_TARGET("avx512f") accscalar_t dot(const scalar_t* a, const scalar_t* b, int32_t n) {
+                using V = Vec<scalar_t, accscalar_t>;
+                typename V::type sum_0 = V::zero(), sum_1 = V::zero();
+                int32_t k = 0;
+
+                for (; k + 2 * V::width <= n; k += 2 * V::width) {
+                    sum_0 = V::fmadd(V::load(a + k), V::load(b + k), sum_0);
+                    sum_1 = V::fmadd(V::load(a + k + V::width), V::load(b + k + V::width), sum_1);
+                }
+
+                for (; k + V::width <= n; k += V::width)
+                    sum_0 = V::fmadd(V::load(a + k), V::load(b + k), sum_0);
+
+                return V::reduce(V::add(sum_0, sum_1)) + scalar::dot<scalar_t, accscalar_t>(a + k, b + k, n - k);
+            }
+
+            template <typename scalar_t, typename accscalar_t = scalar_t>
+            SN2_TARGET("avx512f") accscalar_t dot_strided(const scalar_t* a, const scalar_t* b, int64_t stride, int32_t n) {
+                using V = Vec<scalar_t, accscalar_t>;
+                const typename V::offsets_type offsets = V::make_offsets(stride);
+                typename V::type sum = V::zero();
+                int32_t k = 0;
+
+                for (; k + V::width <= n; k += V::width)
+                    sum = V::fmadd(V::load(a + k), V::gather(b + k * stride, offsets), sum);
+
+                return V::reduce(sum) + scalar::dot_strided<scalar_t, accscalar_t>(a + k, b + k * stride, stride, n - k);
+            }
+
+            template <typename scalar_t, typename accscalar_t = scalar_t>
+            SN2_TARGET("avx512f") accscalar_t gather_dot(const scalar_t* a, const scalar_t* b, const int32_t* indices, int32_t n) {
+                using V = Vec<scalar_t, accscalar_t>;
+                typename V::type sum = V::zero();
+                int32_t k = 0;
+
+                for (; k + V::width <= n; k += V::width)
+                    sum = V::fmadd(V::load(a + k), V::gather(b, indices + k), sum);
+
+                return V::reduce(sum) + scalar::gather_dot<scalar_t, accscalar_t>(a + k, b, indices + k, n - k);
+            }
+        }
+
+        namespace avx512_bf16 {
+            /**
+             * `avx512::dot` with `_mm512_dpbf16_ps`, which multiplies 32 pairs of `c10::BFloat16` values and adds the
+             * products in pairs to 16 `float` lanes.
+             */
+            SN2_TARGET("avx512f,avx512bf16") inline float dot(const c10::BFloat16* a, const c10::BFloat16* b, int32_t n) {
+                __m512 sum_0 = _mm512_setzero_ps(), sum_1 = _mm512_setzero_ps();
+                __m512bh a_0, a_1, b_0, b_1;
+                int32_t k = 0;
+
+                for (; k + 64 <= n; k += 64) {
+                    memcpy(&a_0, a + k, sizeof(a_0));
+                    memcpy(&b_0, b + k, sizeof(b_0));
+                    memcpy(&a_1, a + k + 32, sizeof(a_1));
+                    memcpy(&b_1, b + k + 32, sizeof(b_1));
+                    sum_0 = _mm512_dpbf16_ps(sum_0, a_0, b_0);
+                    sum_1 = _mm512_dpbf16_ps(sum_1, a_1, b_1);
+                }
+
+                for (; k + 32 <= n; k += 32) {
+                    memcpy(&a_0, a + k, sizeof(a_0));
+                    memcpy(&b_0, b + k, sizeof(b_0));
+                    sum_0 = _mm512_dpbf16_ps(sum_0, a_0, b_0);
+                }
+
+                return _mm512_reduce_add_ps(_mm512_add_ps(sum_0, sum_1)) + avx512::dot<c10::BFloat16, float>(a + k, b + k, n - k);
+            }
+        }
+#endif
+
+        /**
+         * @return the widest variant supported by both the CPU and the operating system
+         */
+        inline ISA detect_isa() {
+#ifdef SN2_SIMD_X86
+#if defined(_MSC_VER)
+            int info[4];
+            __cpuid(info, 1);
+            const bool fma = info[2] & (1 << 12);
+            const bool os_saves_avx = (info[2] & (1 << 27)) && (_xgetbv(0) & 0x6) == 0x6;
+            const bool os_saves_avx512 = os_saves_avx && (_xgetbv(0) & 0xE6) == 0xE6;
+            __cpuidex(info, 7, 0);
+            const bool avx2 = info[1] & (1 << 5);
+            const bool avx512f = info[1] & (1 << 16);
+            __cpuidex(info, 7, 1);
+            const bool avx512bf16 = info[0] & (1 << 5);
+#else
+            __builtin_cpu_init();
+            const bool fma = __builtin_cpu_supports("fma");
+            const bool os_saves_avx = true;         // `__builtin_cpu_supports` accounts for the operating system
+            const bool os_saves_avx512 = true;
+            const bool avx2 = __builtin_cpu_supports("avx2");
+            const bool avx512f = __builtin_cpu_supports("avx512f");
+            const bool avx512bf16 = __builtin_cpu_supports("avx512bf16");
+#endif
+            if (avx512f && avx512bf16 && os_saves_avx512)
+                return ISA::AVX512_BF16;
+            else if (avx512f && os_saves_avx512)
+                return ISA::AVX512;
+            else if (avx2 && fma && os_saves_avx)
+                return ISA::AVX2;
+#endif
+            return ISA::SCALAR;
+        }
+
+        /**
+         * @return the variant in use; the detected one unless `SN2_SIMD` asks for a narrower one
+         */
+        inline ISA get_isa() {
+            static const ISA isa = [] {
+                const ISA detected = detect_isa();
+                const char* requested = getenv("SN2_SIMD");
+
+                if (requested == nullptr)
+                    return detected;
+                else if (strcmp(requested, "scalar") == 0)
+                    return ISA::SCALAR;
+                else if (strcmp(requested, "avx2") == 0 && detected >= ISA::AVX2)
+                    return ISA::AVX2;
+                else if (strcmp(requested, "avx512") == 0 && detected >= ISA::AVX512)
+                    return ISA::AVX512;
+                else
+                    return detected;
+            }();
+
+            return isa;
+        }
+
+        /**
+         * @param deterministic whether to return the `fixed` variant rather than the one in use
+         */
+        template <typename scalar_t, typename accscalar_t = scalar_t>
+        const Kernels<scalar_t, accscalar_t>& get_kernels(bool deterministic = false) {
+            using K = Kernels<scalar_t, accscalar_t>;
+            static const K fixed_kernels = {
+                    fixed::dot<scalar_t, accscalar_t>,
+                    fixed::dot_strided<scalar_t, accscalar_t>,
+                    fixed::gather_dot<scalar_t, accscalar_t>
+            };
+            static const K kernels = [] () -> K {
+                switch (get_isa()) {
+#ifdef SN2_SIMD_X86
+                    case ISA::AVX512_BF16:
+                        if constexpr (std::is_same_v<scalar_t, c10::BFloat16>)
+                            return {
+                                    avx512_bf16::dot,
+                                    avx512::dot_strided<scalar_t, accscalar_t>,
+                                    avx512::gather_dot<scalar_t, accscalar_t>
+                            };
+                        [[fallthrough]];
+                    case ISA::AVX512:
+                        return {
+                                avx512::dot<scalar_t, accscalar_t>,
+                                avx512::dot_strided<scalar_t, accscalar_t>,
+                                avx512::gather_dot<scalar_t, accscalar_t>
+                        };
+                    case ISA::AVX2:
+                        return {
+                                avx2::dot<scalar_t, accscalar_t>,
+                                avx2::dot_strided<scalar_t, accscalar_t>,
+                                avx2::gather_dot<scalar_t, accscalar_t>
+                        };
+#endif
+                    default:
+                        return {
+                                scalar::dot<scalar_t, accscalar_t>,
+                                scalar::dot_strided<scalar_t, accscalar_t>,
+                                scalar::gather_dot<scalar_t, accscalar_t>
+                        };
+                }
+            }();
+
+            return deterministic ? fixed_kernels : kernels;
+        }
+    }
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,266 @@
+#ifndef SN2_BATCH_SOLVER_H
+#define SN2_BATCH_SOLVER_H
+
+#include <torch/extension.h>
+#include "stringify.h"
+#include "kernel_config.h"
+#include "tiny_model.h"
+#include "host_executor.h"
+#include <optional>
+#include <algorithm>
+
+namespace sn2_cuda {
+    using namespace torch::indexing;
+
+    // Declarations
+    namespace tiny {
+        template <typename scalar_t>
+        void forward(BatchData<scalar_t>& data);
+
+        template <typename scalar_t>
+        void backward(BatchData<scalar_t>& data);
+    }
+
+    // Class SN2BatchSolver
+    /**
+     * Fits a batch of tiny models (at most `MAX_TINY_MODEL_SIZE` latent and visible variables) at once with the
+     * Kullback-Leibler loss. Every model runs on its own thread with its matrices in stack arrays (see `tiny_model.h`);
+     * a forward or backward pass of the whole batch is one launch, instead of the layer-by-layer launches and the
+     * per-model tensors of an `SN2Solver` per model.
+     * The models share the numbers of latent and visible variables; the structure may differ from model to model.
+     */
+    class SN2BatchSolver {
+        private:
+        torch::Tensor structure;                // B×(|L|+|V|)×|V|
+        torch::Tensor weights;                  // ^
+        torch::Tensor visible_covariance;       // B×|V|×|V|
+        torch::Tensor sample_covariance;        // ^
+        torch::Tensor sample_covariance_inv;    // ^
+        torch::Tensor sample_covariance_logdet; // B
+        torch::Dtype dtype;
+        int64_t batch_size;
+        int32_t visible_size;
+        int32_t latent_size;
+
+        private:
+        /**
+         * @return `tensor` as a contiguous batch; a single matrix is repeated for every model
+         */
+        torch::Tensor to_batch(const torch::Tensor& tensor, const torch::TensorOptions& options) const {
+            const auto batch = tensor.dim() == 2 ? tensor.unsqueeze(0).expand({this->batch_size, tensor.size(0), tensor.size(1)}) : tensor;
+            return batch.to(options).contiguous();
+        }
+
+        private:
+        static int64_t get_batch_size(const std::optional<torch::Tensor>& tensor, int64_t batch_size, const char* name) {
+            if (!tensor.has_value())
+                return batch_size;
+
+            TORCH_CHECK(tensor->dim() == 2 || tensor->dim() == 3, name, " must be 2- or 3-dimensional; it is ", tensor->dim(), "-dimensional.")
+
+            if (tensor->dim() == 2)
+                return batch_size;
+
+            TORCH_CHECK(batch_size < 0 || tensor->size(0) == batch_size, name, " has ", tensor->size(0), " models; expected ", batch_size, ".")
+            return tensor->size(0);
+        }
+
+        private:
+        template <typename scalar_t>
+        tiny::BatchData<scalar_t> get_data() {
+            tiny::BatchData<scalar_t> data;
+            data.structure = this->structure.data_ptr<bool>();
+            data.weights = this->weights.data_ptr<scalar_t>();
+            data.weights_grad = this->weights.mutable_grad().data_ptr<scalar_t>();
+            data.visible_covariance = this->visible_covariance.data_ptr<scalar_t>();
+            data.sample_covariance_inv = this->sample_covariance_inv.defined() ? this->sample_covariance_inv.data_ptr<scalar_t>() : nullptr;
+            data.batch_size = this->batch_size;
+            data.lat_len = this->latent_size;
+            data.vis_len = this->visible_size;
+            return data;
+        }
+
+        private:
+        /**
+         * Runs the forward or backward pass of every model; on the host, the batch is split into a few chunks per
+         * thread of the executor.
+         */
+        template <typename scalar_t, bool backward>
+        void run() {
+            tiny::BatchData<scalar_t> data = this->get_data<scalar_t>();
+
+            if (this->weights.is_cuda()) {
+                if (backward)
+                    tiny::backward<scalar_t>(data);
+                else
+                    tiny::forward<scalar_t>(data);
+
+                return;
+            }
+
+            tiny::dispatch_size(data, [&] (auto size) {
+                constexpr int32_t model_size = decltype(size)::value;
+                host::Executor& executor = host::Executor::get_instance();
+                const int64_t num_chunks = std::min<int64_t>(this->batch_size, int64_t(executor.get_num_threads()) * 4);
+                host::TaskGraph graph;
+
+                for (int64_t chunk = 0; chunk < num_chunks; chunk++)
+                    graph.add_task([data, chunk, num_chunks] () mutable {
+                        for (int64_t b = data.batch_size * chunk / num_chunks; b < data.batch_size * (chunk + 1) / num_chunks; b++)
+                            if (backward)
+                                tiny::backward_model<scalar_t, model_size>(data, b);
+                            else
+                                tiny::forward_model<scalar_t, model_size>(data, b);
+                    });
+
+                executor.run(graph);
+            });
+        }
+
+        public:
+        /**
+         * SN2BatchSolver constructor.
+         * @param structure a vertical matrix of `bool` values shared by all the models, or a batch of such matrices
+         * @param batch_size the number of models; needed only if none of the other arguments is a batch
+         * @param parameters the initial parameters of the models; a matrix or a batch
+         * @param sample_covariance the sample covariance of the models; a matrix or a batch
+         * @param dtype `torch::kFloat` or `torch::kDouble`
+         * @param validate Apply extra validations; set `false` to avoid unneccesary calculations
+         * @param device the device on which the solver runs; CUDA if available and not given
+         */
+        SN2BatchSolver(
+                torch::Tensor structure,
+                std::optional<int64_t> batch_size = std::nullopt,
+                std::optional<torch::Tensor> parameters = std::nullopt,
+                std::optional<torch::Tensor> sample_covariance = std::nullopt,
+                torch::Dtype dtype = torch::kFloat,
+                bool validate = true,
+                std::optional<torch::Device> device = std::nullopt
+        ) {
+            torch::Device solver_device = torch::kCPU;
+
+            if (device.has_value())
+                solver_device = device.value();
+            else if (torch::cuda::is_available())
+                solver_device = structure.device().is_cuda() ? structure.device() : torch::Device(torch::kCUDA);
+
+            TORCH_CHECK(solver_device.is_cpu() || solver_device.is_cuda(), STRINGIFY(SN2BatchSolver) " runs either on CUDA or on the CPU; ", solver_device, " is not supported.")
+            TORCH_CHECK(solver_device.is_cpu() || torch::cuda::is_available(), "CUDA is not available. Consider initializing " STRINGIFY(SN2BatchSolver) " with " STRINGIFY(device="cpu") ".")
+            TORCH_CHECK(dtype == torch::kFloat || dtype == torch::kDouble, STRINGIFY(dtype) " must be either " STRINGIFY(torch::kFloat) " or " STRINGIFY(torch::kDouble) ".")
+            TORCH_CHECK(!batch_size.has_value() || batch_size.value() >= 0, STRINGIFY(batch_size) " must not be negative.")
+
+            int64_t resolved_batch_size = batch_size.has_value() ? batch_size.value() : -1;
+            resolved_batch_size = get_batch_size(structure, resolved_batch_size, STRINGIFY(structure));
+            resolved_batch_size = get_batch_size(parameters, resolved_batch_size, STRINGIFY(parameters));
+            resolved_batch_size = get_batch_size(sample_covariance, resolved_batch_size, STRINGIFY(sample_covariance));
+            this->batch_size = resolved_batch_size < 0 ? 1 : resolved_batch_size;
+            this->dtype = dtype;
+            this->visible_size = structure.size(-1);
+            this->latent_size = structure.size(-2) - this->visible_size;
+
+            TORCH_CHECK(this->visible_size > 0, STRINGIFY(structure) " needs at least one visible variable.")
+            TORCH_CHECK(this->latent_size >= 0, STRINGIFY(structure) " must be a vertical-rectangular matrix.")
+            TORCH_CHECK(this->latent_size <= MAX_TINY_MODEL_SIZE && this->visible_size <= MAX_TINY_MODEL_SIZE,
+                        STRINGIFY(SN2BatchSolver) " supports up to ", MAX_TINY_MODEL_SIZE, " latent and visible variables; "
+                        "consider using " STRINGIFY(SN2Solver) " for larger models.")
+            TORCH_CHECK(!parameters.has_value() || parameters->sizes().slice(parameters->dim() - 2) == structure.sizes().slice(structure.dim() - 2),
+                        STRINGIFY(parameters) " must be of the same size as " STRINGIFY(structure) ".")
+
+            const torch::TensorOptions options = torch::TensorOptions()
+                    .dtype(dtype)
+                    .device(solver_device)
+                    .requires_grad(false);
+            this->structure = to_batch(structure, options.dtype(torch::kBool));
+
+            if (validate) {
+                auto&& latent_structure = this->structure.index({Slice(), Slice(None, this->latent_size), Slice()});
+                auto&& visible_structure = this->structure.index({Slice(), Slice(this->latent_size, None), Slice()});
+
+                TORCH_CHECK(
+                        latent_structure.any(1).all().item<bool>(),
+                        "All visible variables must be connected to at least one latent variable."
+                )
+
+                TORCH_CHECK(
+                        !torch::tril(visible_structure).any().item<bool>(),
+                        "Visible space must be an upper-triangular matrix."
+                )
+            }
+
+            this->weights = this->structure.to(options);
+            this->weights *= parameters.has_value() ? to_batch(parameters.value(), options) : torch::randn_like(this->weights);
+            this->weights.mutable_grad() = torch::zeros_like(this->weights);
+            this->visible_covariance = torch::zeros({this->batch_size, this->visible_size, this->visible_size}, options);
+
+            if (sample_covariance.has_value())
+                this->set_sample_covariance(sample_covariance.value());
+        }
+
+        public:
+        void forward() {
+            AT_DISPATCH_FLOATING_TYPES(this->dtype, "SN2BatchSolver::forward", ([&] {
+                this->run<scalar_t, false>();
+            }));
+        }
+
+        public:
+        void backward() {
+            TORCH_CHECK(this->sample_covariance.defined(), STRINGIFY(sample_covariance) " has not been set.")
+            AT_DISPATCH_FLOATING_TYPES(this->dtype, "SN2BatchSolver::backward", ([&] {
+                this->run<scalar_t, true>();
+            }));
+        }
+
+        public:
+        /**
+         * @return the Kullback-Leibler loss of every model
+         */
+        torch::Tensor loss() {
+            TORCH_CHECK(this->sample_covariance.defined(), STRINGIFY(sample_covariance) " has not been set.")
+            return torch::mul(this->sample_covariance_inv, this->visible_covariance).sum({1, 2})
+                    .subtract_(torch::logdet(this->visible_covariance))
+                    .subtract_(this->visible_size)
+                    .add_(this->sample_covariance_logdet)
+                    .div_(2.0);
+        }
+
+        public:
+        void set_sample_covariance(const torch::Tensor& sample_covariance) {
+            TORCH_CHECK((sample_covariance.dim() == 2 || sample_covariance.dim() == 3) &&
+                        sample_covariance.size(-1) == this->visible_size && sample_covariance.size(-2) == this->visible_size,
+                        STRINGIFY(sample_covariance) " must be a ", this->visible_size, "×", this->visible_size, " matrix or a batch of them.")
+            TORCH_CHECK(sample_covariance.dim() == 2 || sample_covariance.size(0) == this->batch_size,
+                        STRINGIFY(sample_covariance) " has ", sample_covariance.size(0), " models; expected ", this->batch_size, ".")
+            this->sample_covariance = to_batch(sample_covariance, this->weights.options());
+            this->sample_covariance_inv = torch::inverse(this->sample_covariance).contiguous();
+            this->sample_covariance_logdet = torch::logdet(this->sample_covariance);
+        }
+
+        public:
+        const torch::Tensor& get_sample_covariance() const {
+            return this->sample_covariance;
+        }
+
+        public:
+        torch::Tensor& get_weights() {
+            return this->weights;
+        }
+
+        public:
+        void set_weights(const torch::Tensor& weights) {
+            this->weights.copy_(weights);
+        }
+
+        public:
+        torch::Tensor& get_visible_covariance() {
+            return this->visible_covariance;
+        }
+
+        public:
+        int64_t get_batch_size() const {
+            return this->batch_size;
+        }
+    };
+}
+
+#endif
\ No newline at end of file
@@ -1,5 +1,7 @@
 #include <torch/extension.h>
 #include "sn2_solver.h"
+#include "sn2_decomposed_solver.h"
+#include "sn2_batch_solver.h"
 
 using namespace sn2_cuda;
 using namespace sn2_cuda::loss;
@@ -34,9 +36,41 @@ class PyLossBase : public LossBase {
     }
 };
 
+// Accept both `torch.device` objects and strings such as "cpu" or "cuda:0"
+static std::optional<torch::Device> to_device(const std::optional<py::object>& device) {
+    if (!device.has_value() || device->is_none())
+        return std::nullopt;
+    else if (py::isinstance<py::str>(device.value()))
+        return torch::Device(device->cast<std::string>());
+    else
+        return device->cast<torch::Device>();
+}
+
+// The costs of every method, keyed by the names of `SN2Solver.METHODS`
+static py::dict to_dict(const MethodCosts& costs) {
+    py::dict dict;
+    const std::pair<const char*, const MethodCost*> methods[] = {
+            {"COVAR", &costs.covar}, {"ACCUM", &costs.accum}, {"TRISOLVE", &costs.trisolve}
+    };
+
+    for (const auto& [name, cost] : methods) {
+        py::dict cost_dict;
+        cost_dict["flops"] = cost->flops;
+        cost_dict["bytes"] = cost->bytes;
+        cost_dict["launches"] = cost->launches;
+        cost_dict["memory"] = cost->memory;
+        cost_dict["seconds"] = cost->seconds;
+        cost_dict["measured"] = cost->measured;
+        dict[name] = cost_dict;
+    }
+
+    return dict;
+}
+
 
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
     auto loss = m.def_submodule("loss");
+    const FitCriteria fit_criteria;     // The defaults of `SN2Solver.fit`
 
     py::class_<LossBase, PyLossBase, std::shared_ptr<LossBase>>(loss, "LossBase")
             .def(py::init<>())
@@ -51,6 +85,11 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
     py::class_<KullbackLeibler, LossBase, std::shared_ptr<KullbackLeibler>>(loss, "KullbackLeibler")
             .def(py::init<>());
 
+    py::class_<StochasticKullbackLeibler, KullbackLeibler, std::shared_ptr<StochasticKullbackLeibler>>(loss, "StochasticKullbackLeibler")
+            .def(py::init<int64_t, int64_t, double, int64_t>(),
+                 py::arg("num_probes")=16, py::arg("num_lanczos_steps")=32,
+                 py::arg("cg_tolerance")=1e-6, py::arg("cg_max_iterations")=1000);
+
     py::class_<Bhattacharyya, LossBase, std::shared_ptr<Bhattacharyya>>(loss, "Bhattacharyya")
             .def(py::init<>());
 
@@ -62,7 +101,16 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
                                   std::optional<py::object> dtype,
                                   std::optional<std::shared_ptr<LossBase>> loss_function,
                                   std::optional<SN2Solver::METHODS> method,
-                                  std::optional<bool> validate
+                                  std::optional<bool> validate,
+                                  std::optional<bool> presolve,
+                                  std::optional<py::object> device,
+                                  std::optional<int64_t> trial_iterations,
+                                  std::optional<int64_t> memory_budget,
+                                  std::optional<std::string> mmap_directory,
+                                  std::optional<bool> mixed_precision,
+                                  std::optional<double> promotion_threshold,
+                                  std::optional<bool> deterministic,
+                                  std::optional<SN2Solver::INITIALIZATIONS> initialization
                           ) {
                               return SN2Solver(
                                       structure,
@@ -71,12 +119,26 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
                                       dtype.has_value() ? torch::python::detail::py_object_to_dtype(dtype.value()) : torch::kFloat,
                                       loss_function.has_value() ? loss_function.value() : nullptr,
                                       method.has_value() ? method.value() : SN2Solver::METHODS::COVAR,
-                                      !validate.has_value() || validate.value()
+                                      !validate.has_value() || validate.value(),
+                                      presolve.has_value() && presolve.value(),
+                                      to_device(device),
+                                      trial_iterations.has_value() ? trial_iterations.value() : 0,
+                                      memory_budget.has_value() ? memory_budget.value() : 0,
+                                      std::move(mmap_directory),
+                                      mixed_precision.has_value() && mixed_precision.value(),
+                                      promotion_threshold.has_value() ? promotion_threshold.value() : 0.0,
+                                      deterministic.has_value() && deterministic.value(),
+                                      initialization.has_value() ? initialization.value() : SN2Solver::INITIALIZATIONS::RANDOM
                               );
                           }
                  ), py::arg("structure"), py::arg("weights")=std::nullopt, py::arg("sample_covariance")=std::nullopt,
                  py::arg("dtype")=std::nullopt, py::arg("loss")=std::nullopt, py::arg("method")=std::nullopt,
-                 py::arg("validate")=std::nullopt, /* keep the user-defined loss function alive */ py::keep_alive<1, 6>())
+                 py::arg("validate")=std::nullopt, py::arg("presolve")=std::nullopt,
+                 py::arg("device")=std::nullopt, py::arg("trial_iterations")=std::nullopt,
+                 py::arg("memory_budget")=std::nullopt, py::arg("mmap_directory")=std::nullopt,
+                 py::arg("mixed_precision")=std::nullopt, py::arg("promotion_threshold")=std::nullopt,
+                 py::arg("deterministic")=std::nullopt, py::arg("initialization")=std::nullopt,
+                 /* keep the user-defined loss function alive */ py::keep_alive<1, 6>())
             .def("forward", &SN2Solver::forward)
             .def("backward", &SN2Solver::backward)
             .def_property_readonly("omegas_", &SN2Solver::get_omegas)
@@ -84,13 +146,125 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
             .def_property_readonly("covariance_", &SN2Solver::get_covariance)
             .def_property_readonly("lv_transformation_", &SN2Solver::get_lv_transformation)
             .def_property_readonly("visible_covariance_", &SN2Solver::get_visible_covariance)
+            .def_property_readonly("low_rank_", &SN2Solver::is_low_rank)
+            .def_property_readonly("expanded_weights_", &SN2Solver::get_expanded_weights)
+            .def_property_readonly("latent_map_", &SN2Solver::get_latent_map)
+            .def_property_readonly("method_", &SN2Solver::get_method)
+            .def_property_readonly("method_costs_", [] (const SN2Solver& solver) { return to_dict(solver.get_method_costs()); })
             .def_property("weights", &SN2Solver::get_weights, &SN2Solver::set_weights)
             .def_property("sample_covariance", &SN2Solver::get_sample_covariance, &SN2Solver::set_sample_covariance)
+            .def_property("promotion_state", &SN2Solver::get_promotion_state, &SN2Solver::set_promotion_state)
+            .def("promote", &SN2Solver::promote, py::arg("state")=std::vector<torch::Tensor>())
             .def("loss", &SN2Solver::loss)
-            .def("loss_proxy", &SN2Solver::loss_proxy);
+            .def("loss_proxy", &SN2Solver::loss_proxy)
+            .def("fit", [] (
+                         SN2Solver& solver, int64_t max_iterations, int64_t check_every, double rtol, int64_t patience,
+                         double max_seconds, int64_t trace_size, int64_t cg_check_every, double lr,
+                         std::pair<double, double> betas, double eps, double l1, double group_l1, int64_t prune_after
+                 ) {
+                     return solver.fit({max_iterations, check_every, rtol, patience, max_seconds, trace_size, cg_check_every},
+                                       lr, betas, eps, l1, group_l1, prune_after);
+                 }, py::arg("max_iterations")=fit_criteria.max_iterations, py::arg("check_every")=fit_criteria.check_every,
+                 py::arg("rtol")=fit_criteria.rtol, py::arg("patience")=fit_criteria.patience,
+                 py::arg("max_seconds")=fit_criteria.max_seconds, py::arg("trace_size")=fit_criteria.trace_size,
+                 py::arg("cg_check_every")=fit_criteria.cg_check_every,
+                 py::arg("lr")=1e-3, py::arg("betas")=std::make_pair(0.9, 0.999), py::arg("eps")=1e-8,
+                 py::arg("l1")=0.0, py::arg("group_l1")=0.0, py::arg("prune_after")=0)
+            .def("prune", &SN2Solver::prune, py::arg("edges"));
 
     py::enum_<SN2Solver::METHODS>(sn2_solver, "METHODS")
             .value("COVAR", SN2Solver::METHODS::COVAR)
             .value("ACCUM", SN2Solver::METHODS::ACCUM)
+            .value("TRISOLVE", SN2Solver::METHODS::TRISOLVE)
+            .value("AUTO", SN2Solver::METHODS::AUTO)
+            .value("NONE", SN2Solver::METHODS::NONE)
+            .export_values();
+
+    py::enum_<SN2Solver::INITIALIZATIONS>(sn2_solver, "INITIALIZATIONS")
+            .value("RANDOM", SN2Solver::INITIALIZATIONS::RANDOM)
+            .value("REGRESSION", SN2Solver::INITIALIZATIONS::REGRESSION)
+            .export_values();
+
+    auto fit_report = py::class_<FitReport>(m, "FitReport")
+            .def_readonly("iterations", &FitReport::iterations)
+            .def_readonly("loss", &FitReport::loss)
+            .def_readonly("seconds", &FitReport::seconds)
+            .def_readonly("reason", &FitReport::reason)
+            .def_readonly("num_pruned", &FitReport::num_pruned)
+            .def_readonly("trace", &FitReport::trace);
+
+    py::enum_<FitReport::REASONS>(fit_report, "REASONS")
+            .value("MAX_ITERATIONS", FitReport::REASONS::MAX_ITERATIONS)
+            .value("CONVERGED", FitReport::REASONS::CONVERGED)
+            .value("MAX_SECONDS", FitReport::REASONS::MAX_SECONDS)
+            .value("NOT_FINITE", FitReport::REASONS::NOT_FINITE)
             .export_values();
+
+    py::class_<SN2DecomposedSolver>(m, "SN2DecomposedSolver")
+            .def(py::init([] (
+                                  torch::Tensor& structure,
+                                  std::optional<torch::Tensor> parameters,
+                                  std::optional<torch::Tensor> sample_covariance,
+                                  std::optional<py::object> dtype,
+                                  std::optional<std::shared_ptr<LossBase>> loss_function,
+                                  std::optional<SN2Solver::METHODS> method,
+                                  std::optional<bool> validate,
+                                  std::optional<py::object> device
+                          ) {
+                              return SN2DecomposedSolver(
+                                      structure,
+                                      std::move(parameters),
+                                      std::move(sample_covariance),
+                                      dtype.has_value() ? torch::python::detail::py_object_to_dtype(dtype.value()) : torch::kFloat,
+                                      loss_function.has_value() ? loss_function.value() : nullptr,
+                                      method.has_value() ? method.value() : SN2Solver::METHODS::COVAR,
+                                      !validate.has_value() || validate.value(),
+                                      to_device(device)
+                              );
+                          }
+                 ), py::arg("structure"), py::arg("weights")=std::nullopt, py::arg("sample_covariance")=std::nullopt,
+                 py::arg("dtype")=std::nullopt, py::arg("loss")=std::nullopt, py::arg("method")=std::nullopt,
+                 py::arg("validate")=std::nullopt, py::arg("device")=std::nullopt)
+            .def("forward", &SN2DecomposedSolver::forward)
+            .def("backward", &SN2DecomposedSolver::backward)
+            .def_property_readonly("visible_covariance_", &SN2DecomposedSolver::get_visible_covariance)
+            .def_property_readonly("num_components_", &SN2DecomposedSolver::get_num_components)
+            .def_property_readonly("components_", &SN2DecomposedSolver::get_components)
+            .def_property("weights", &SN2DecomposedSolver::get_weights, &SN2DecomposedSolver::set_weights)
+            .def_property("sample_covariance", &SN2DecomposedSolver::get_sample_covariance, &SN2DecomposedSolver::set_sample_covariance)
+            .def("loss", &SN2DecomposedSolver::loss);
+
+    py::class_<SN2BatchSolver>(m, "SN2BatchSolver")
+            .def(py::init([] (
+                                  torch::Tensor& structure,
+                                  std::optional<int64_t> batch_size,
+                                  std::optional<torch::Tensor> parameters,
+                                  std::optional<torch::Tensor> sample_covariance,
+                                  std::optional<py::object> dtype,
+                                  std::optional<bool> validate,
+                                  std::optional<py::object> device
+                          ) {
+                              return SN2BatchSolver(
+                                      structure,
+                                      batch_size,
+                                      std::move(parameters),
+                                      std::move(sample_covariance),
+                                      dtype.has_value() ? torch::python::detail::py_object_to_dtype(dtype.value()) : torch::kFloat,
+                                      !validate.has_value() || validate.value(),
+                                      to_device(device)
+                              );
+                          }
+                 ), py::arg("structure"), py::arg("batch_size")=std::nullopt, py::arg("weights")=std::nullopt,
+                 py::arg("sample_covariance")=std::nullopt, py::arg("dtype")=std::nullopt,
+                 py::arg("validate")=std::nullopt, py::arg("device")=std::nullopt)
+            .def("forward", &SN2BatchSolver::forward)
+            .def("backward", &SN2BatchSolver::backward)
+            .def_property_readonly("visible_covariance_", &SN2BatchSolver::get_visible_covariance)
+            .def_property_readonly("batch_size_", &SN2BatchSolver::get_batch_size)
+            .def_property("weights", &SN2BatchSolver::get_weights, &SN2BatchSolver::set_weights)
+            .def_property("sample_covariance", &SN2BatchSolver::get_sample_covariance, &SN2BatchSolver::set_sample_covariance)
+            .def("loss", &SN2BatchSolver::loss);
+
+    m.def("clear_buffer_pool", [] () { BufferPool::get_instance().clear(); },
+          "Frees the buffers kept for recycling by new solvers of the same structure, dtype and method.");
 }
\ No newline at end of file
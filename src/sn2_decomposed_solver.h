@@ -0,0 +1,313 @@
+#ifndef SN2_DECOMPOSED_SOLVER_H
+#define SN2_DECOMPOSED_SOLVER_H
+
+#include <torch/extension.h>
+#include <ATen/cuda/CUDAContext.h>
+#include <ATen/cuda/CUDAEvent.h>
+#include <c10/cuda/CUDAGuard.h>
+#include "stringify.h"
+#include "sn2_solver.h"
+#include <vector>
+#include <numeric>
+#include <optional>
+#include <typeinfo>
+
+namespace sn2_cuda {
+    using namespace torch::indexing;
+    using namespace sn2_cuda::loss;
+
+    // Class SN2DecomposedSolver
+    /**
+     * Splits the structure into its connected components and fits one `SN2Solver` per component concurrently.
+     * The visible covariance of the whole model is block diagonal, so the Kullback-Leibler loss separates; the weights
+     * and the visible covariance are stitched back into the layout of the original structure.
+     */
+    class SN2DecomposedSolver {
+        private:
+        torch::Tensor weights;                  // Weights in the layout of the original structure
+        torch::Tensor visible_covariance;       // ^
+        torch::Tensor sample_covariance;        // ^
+        torch::Tensor loss_offset;              // (log det S - Σ_k log det S_k) / 2; restores the loss of the whole model
+        std::vector<torch::Tensor> rows;        // Rows (latent, then visible) of each component in the original structure
+        std::vector<torch::Tensor> columns;     // Columns (visible) of each component in the original structure
+        std::vector<SN2Solver> solvers;
+        std::vector<c10::cuda::CUDAStream> streams;
+        int32_t visible_size;
+        int32_t latent_size;
+        bool stochastic;
+
+        private:
+        /**
+         * Labels the connected components of the graph whose edges are the non-zero entries of `structure`.
+         * Components are numbered in the order of their first visible variable.
+         * @return the component of every variable (latent first); -1 for latent variables with no children
+         */
+        static std::vector<int32_t> label_components(const torch::Tensor& structure, int32_t& num_components) {
+            const int32_t total_size = structure.size(0);
+            const int32_t visible_size = structure.size(1);
+            const int32_t latent_size = total_size - visible_size;
+            const torch::Tensor host_structure = structure.to(torch::kCPU, torch::kBool);
+            const auto structure_acc = host_structure.accessor<bool, 2>();
+            std::vector<int32_t> roots(total_size), labels(total_size, -1), root_labels(total_size, -1);
+            std::iota(roots.begin(), roots.end(), 0);
+
+            const auto find = [&roots] (int32_t v) {
+                while (roots[v] != v)
+                    v = roots[v] = roots[roots[v]];
+
+                return v;
+            };
+
+            for (int32_t p = 0; p < total_size; p++)
+                for (int32_t c = 0; c < visible_size; c++)
+                    if (structure_acc[p][c])
+                        roots[find(p)] = find(c + latent_size);
+
+            num_components = 0;
+
+            for (int32_t c = 0; c < visible_size; c++) {
+                int32_t& root_label = root_labels[find(c + latent_size)];
+                labels[c + latent_size] = root_label = (root_label == -1) ? num_components++ : root_label;
+            }
+
+            for (int32_t p = 0; p < latent_size; p++)
+                labels[p] = root_labels[find(p)];
+
+            return labels;
+        }
+
+        private:
+        static torch::Tensor to_index_tensor(const std::vector<int64_t>& vec, const torch::Device& device) {
+            return torch::from_blob(const_cast<int64_t*>(vec.data()), {static_cast<int64_t>(vec.size())}, torch::kInt64)
+                    .to(device, /*non_blocking=*/false, /*copy=*/true);
+        }
+
+        private:
+        /**
+         * @return a new loss for a component; its sample covariance is the component's own (see `set_sample_covariance`)
+         */
+        static std::shared_ptr<LossBase> make_component_loss(const std::shared_ptr<LossBase>& loss_function) {
+            const auto stochastic_loss_function = std::dynamic_pointer_cast<StochasticKullbackLeibler>(loss_function);
+            TORCH_CHECK(!loss_function || typeid(*loss_function) == typeid(KullbackLeibler) || stochastic_loss_function,
+                        STRINGIFY(SN2DecomposedSolver) " only supports the Kullback-Leibler losses, which separate over the components.")
+
+            if (stochastic_loss_function)
+                return stochastic_loss_function->make_unset();
+
+            return std::make_shared<KullbackLeibler>();
+        }
+
+        private:
+        /**
+         * Calls `function(k)` for every component `k` concurrently. On CUDA, each component is queued on its own stream
+         * from the calling thread; on the CPU, each component is a task of a graph of the shared `host::Executor`,
+         * whose own graphs then run on the thread of the task.
+         */
+        template <typename Function>
+        void for_each_component(const Function& function) {
+            if (this->solvers.size() == 1) {
+                function(0);
+                return;
+            }
+
+            if (this->streams.empty()) {
+                host::TaskGraph graph;
+
+                for (size_t k = 0; k < this->solvers.size(); k++)
+                    graph.add_task([&function, k] { function(k); });
+
+                host::Executor::get_instance().run(graph);
+                return;
+            }
+
+            at::cuda::CUDAEvent inputs_ready;
+            inputs_ready.record(at::cuda::getCurrentCUDAStream());
+
+            for (size_t k = 0; k < this->solvers.size(); k++) {
+                inputs_ready.block(this->streams[k]);
+                c10::cuda::CUDAStreamGuard guard(this->streams[k]);
+                function(k);
+            }
+
+            for (const auto& stream : this->streams) {
+                at::cuda::CUDAEvent outputs_ready;
+                outputs_ready.record(stream);
+                outputs_ready.block(at::cuda::getCurrentCUDAStream());
+            }
+        }
+
+        private:
+        inline torch::Tensor get_block(const torch::Tensor& tensor, size_t k, bool rows_are_visible = false) {
+            return tensor.index({(rows_are_visible ? this->columns[k] : this->rows[k]).unsqueeze(1), this->columns[k]});
+        }
+
+        private:
+        inline void set_block(torch::Tensor& tensor, size_t k, const torch::Tensor& value, bool rows_are_visible = false) {
+            tensor.index_put_({(rows_are_visible ? this->columns[k] : this->rows[k]).unsqueeze(1), this->columns[k]}, value);
+        }
+
+        public:
+        /**
+         * SN2DecomposedSolver constructor; takes the same arguments as `SN2Solver`, except for `presolve`.
+         * Only the Kullback-Leibler losses are supported, since they separate over the components.
+         */
+        SN2DecomposedSolver(
+                torch::Tensor structure,
+                std::optional<torch::Tensor> parameters = std::nullopt,
+                std::optional<torch::Tensor> sample_covariance = std::nullopt,
+                torch::Dtype dtype = torch::kFloat,
+                std::shared_ptr<LossBase> loss_function = nullptr,
+                SN2Solver::METHODS method = SN2Solver::METHODS::COVAR,
+                bool validate = true,
+                std::optional<torch::Device> device = std::nullopt
+        ) {
+            TORCH_CHECK(structure.dim() == 2, STRINGIFY(structure) " must be 2-dimensional; it is ", structure.dim(), "-dimensional.")
+            TORCH_CHECK(!parameters.has_value() || parameters->sizes() == structure.sizes(), STRINGIFY(parameters) " must be of the same size as " STRINGIFY(structure) ".")
+            this->visible_size = structure.size(1);
+            this->latent_size = structure.size(0) - this->visible_size;
+            this->stochastic = static_cast<bool>(std::dynamic_pointer_cast<StochasticKullbackLeibler>(loss_function));
+
+            int32_t num_components;
+            const std::vector<int32_t> labels = label_components(structure, num_components);
+            std::vector<std::vector<int64_t>> rows_vec(num_components), columns_vec(num_components);
+
+            for (int32_t v = 0; v < labels.size(); v++)
+                if (labels[v] >= 0) {
+                    rows_vec[labels[v]].push_back(v);
+
+                    if (v >= this->latent_size)
+                        columns_vec[labels[v]].push_back(v - this->latent_size);
+                }
+
+            const auto bool_structure = structure.to(torch::kBool);
+
+            for (int32_t k = 0; k < num_components; k++) {
+                this->rows.push_back(to_index_tensor(rows_vec[k], structure.device()));
+                this->columns.push_back(to_index_tensor(columns_vec[k], structure.device()));
+                this->solvers.emplace_back(
+                        get_block(bool_structure, k),
+                        parameters.has_value() ? std::optional<torch::Tensor>(get_block(parameters->to(structure.device()), k)) : std::nullopt,
+                        std::nullopt, dtype, make_component_loss(loss_function), method, validate, false, device
+                );
+            }
+
+            TORCH_CHECK(!this->solvers.empty(), STRINGIFY(structure) " needs at least one visible variable.")
+            const auto& options = this->solvers.front().get_weights().options();
+            this->weights = torch::zeros({this->latent_size + this->visible_size, this->visible_size}, options);
+            this->weights.mutable_grad() = torch::zeros_like(this->weights);
+            this->visible_covariance = torch::zeros({this->visible_size, this->visible_size}, options);
+
+            for (int32_t k = 0; k < num_components; k++) {
+                this->rows[k] = this->rows[k].to(options.device());
+                this->columns[k] = this->columns[k].to(options.device());
+                set_block(this->weights, k, this->solvers[k].get_weights());
+
+                if (this->weights.is_cuda())
+                    this->streams.push_back(at::cuda::getStreamFromPool(false, options.device().index()));
+            }
+
+            if (sample_covariance.has_value())
+                this->set_sample_covariance(sample_covariance.value());
+        }
+
+        public:
+        void forward() {
+            // Copied as weights updated in place, without `SN2Solver::set_weights` and its check of the low-rank loss
+            for (size_t k = 0; k < this->solvers.size(); k++)
+                this->solvers[k].get_weights().copy_(get_block(this->weights, k));
+
+            for_each_component([this] (size_t k) { this->solvers[k].forward(); });
+
+            if (!this->stochastic)
+                for (size_t k = 0; k < this->solvers.size(); k++)
+                    set_block(this->visible_covariance, k, this->solvers[k].get_visible_covariance(), true);
+        }
+
+        public:
+        void backward() {
+            for_each_component([this] (size_t k) { this->solvers[k].backward(); });
+
+            for (size_t k = 0; k < this->solvers.size(); k++)
+                set_block(this->weights.mutable_grad(), k, this->solvers[k].get_weights().grad());
+        }
+
+        public:
+        torch::Tensor loss() {
+            TORCH_CHECK(this->sample_covariance.defined(), STRINGIFY(sample_covariance) " has not been set.")
+            torch::Tensor loss = this->loss_offset.clone();
+
+            for (auto& solver : this->solvers)
+                loss.add_(solver.loss());
+
+            return loss;
+        }
+
+        public:
+        /**
+         * Gives every component the sample covariance S_k whose inverse is the matching diagonal block of S⁻¹;
+         * with these, the component losses add up to the loss of the whole model.
+         */
+        void set_sample_covariance(const torch::Tensor& sample_covariance) {
+            TORCH_CHECK(sample_covariance.dim() == 2 && sample_covariance.size(0) == visible_size && sample_covariance.size(1) == visible_size,
+                        STRINGIFY(sample_covariance) " must be a ", visible_size, "×", visible_size, " matrix.")
+            this->sample_covariance = sample_covariance.to(this->weights.options());
+
+            if (this->solvers.size() == 1) {
+                this->solvers.front().set_sample_covariance(this->sample_covariance);
+                this->loss_offset = torch::zeros({}, this->weights.options());
+                return;
+            }
+
+            const auto precision = torch::inverse(this->sample_covariance);
+            torch::Tensor logdet_difference = torch::logdet(this->sample_covariance);
+
+            for (size_t k = 0; k < this->solvers.size(); k++) {
+                const auto component_sample_covariance = torch::inverse(get_block(precision, k, true));
+                this->solvers[k].set_sample_covariance(component_sample_covariance);
+                logdet_difference = logdet_difference - torch::logdet(component_sample_covariance);
+            }
+
+            this->loss_offset = logdet_difference.div(2.0);
+        }
+
+        public:
+        const torch::Tensor& get_sample_covariance() const {
+            return this->sample_covariance;
+        }
+
+        public:
+        torch::Tensor& get_weights() {
+            return this->weights;
+        }
+
+        public:
+        void set_weights(const torch::Tensor& weights) {
+            this->weights.copy_(weights);
+
+            for (size_t k = 0; k < this->solvers.size(); k++)
+                this->solvers[k].set_weights(get_block(this->weights, k));
+        }
+
+        public:
+        torch::Tensor& get_visible_covariance() {
+            TORCH_CHECK(!this->stochastic,
+                        STRINGIFY(visible_covariance) " is not computed when the loss is " STRINGIFY(StochasticKullbackLeibler) ".")
+            return this->visible_covariance;
+        }
+
+        public:
+        int64_t get_num_components() const {
+            return this->solvers.size();
+        }
+
+        public:
+        /**
+         * @return the visible variables of every component, in the order of the original structure
+         */
+        const std::vector<torch::Tensor>& get_components() const {
+            return this->columns;
+        }
+    };
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,184 @@
+#ifndef SN2_PRESOLVE_H
+#define SN2_PRESOLVE_H
+
+#include <torch/extension.h>
+#include "stringify.h"
+#include <vector>
+#include <map>
+#include <algorithm>
+
+namespace sn2_cuda {
+    using namespace torch::indexing;
+
+    // Class ModelReduction
+    /**
+     * Presolve pass that shrinks the latent space of a structure without changing the covariances it can express.
+     * Latent variables with no children are removed, and the k latent variables sharing a child set C are merged into
+     * min(k, |C|) latent variables, since their contribution W_Cᵀ W_C to the covariance has rank at most |C|.
+     * In particular, all the latent variables with the same single child are merged into one.
+     */
+    class ModelReduction {
+        private:
+        struct LatentGroup {
+            torch::Tensor latents;              // Latent variables of the group in the original structure
+            torch::Tensor children;             // Their common children
+            torch::Tensor rows;                 // Rows of its first latent variables in the reduced structure; one per row kept
+        };
+
+        private:
+        torch::Tensor structure;                // Reduced structure
+        torch::Tensor latent_map;               // Row of every original latent variable in the reduced structure; -1 if removed
+        std::vector<LatentGroup> groups;
+        int64_t visible_size;
+        int64_t latent_size;                    // Number of latent variables in the original structure
+        int64_t reduced_latent_size;            // Number of latent variables in the reduced structure
+
+        private:
+        static torch::Tensor to_index_tensor(const std::vector<int64_t>& vec, const torch::Device& device) {
+            return torch::from_blob(const_cast<int64_t*>(vec.data()), {static_cast<int64_t>(vec.size())}, torch::kInt64)
+                    .to(device, /*non_blocking=*/false, /*copy=*/true);
+        }
+
+        public:
+        /**
+         * ModelReduction constructor.
+         * @param structure a vertical matrix of `bool` values indicating the structure of the AMASEM
+         */
+        explicit ModelReduction(const torch::Tensor& structure) {
+            TORCH_CHECK(structure.dim() == 2, STRINGIFY(structure) " must be 2-dimensional; it is ", structure.dim(), "-dimensional.")
+            TORCH_CHECK(structure.size(0) >= structure.size(1), STRINGIFY(structure) " must be a vertical-rectangular matrix.")
+            this->visible_size = structure.size(1);
+            this->latent_size = structure.size(0) - this->visible_size;
+
+            const torch::Tensor host_structure = structure.to(torch::kCPU, torch::kBool).contiguous();
+            const auto structure_acc = host_structure.accessor<bool, 2>();
+            std::map<std::vector<int64_t>, std::vector<int64_t>> child_sets;    // Child set -> latent variables
+            std::vector<std::vector<int64_t>> group_children;
+
+            for (int64_t l = 0; l < this->latent_size; l++) {
+                std::vector<int64_t> children;
+
+                for (int64_t c = 0; c < this->visible_size; c++)
+                    if (structure_acc[l][c])
+                        children.push_back(c);
+
+                if (children.empty())
+                    continue;
+
+                auto& latents = child_sets[children];
+
+                if (latents.empty())
+                    group_children.push_back(children);
+
+                latents.push_back(l);
+            }
+
+            std::vector<int64_t> latent_map_vec(this->latent_size, -1);
+            std::vector<int64_t> reduced_rows;
+
+            // A merged group keeps its first latent variables
+            for (const auto& children : group_children) {
+                const auto& latents = child_sets[children];
+                const int64_t num = std::min<int64_t>(latents.size(), children.size());
+                reduced_rows.insert(reduced_rows.end(), latents.begin(), latents.begin() + num);
+            }
+
+            // The kept latent variables stay in their original order, so an irreducible structure is kept as it is
+            std::sort(reduced_rows.begin(), reduced_rows.end());
+            this->reduced_latent_size = reduced_rows.size();
+
+            for (int64_t r = 0; r < this->reduced_latent_size; r++)
+                latent_map_vec[reduced_rows[r]] = r;
+
+            for (const auto& children : group_children) {
+                const auto& latents = child_sets[children];
+                std::vector<int64_t> rows;
+
+                for (int64_t i = 0; i < std::min<int64_t>(latents.size(), children.size()); i++)
+                    rows.push_back(latent_map_vec[latents[i]]);
+
+                this->groups.push_back({
+                        to_index_tensor(latents, structure.device()),
+                        to_index_tensor(children, structure.device()),
+                        to_index_tensor(rows, structure.device())
+                });
+            }
+
+            for (int64_t v = 0; v < this->visible_size; v++)
+                reduced_rows.push_back(this->latent_size + v);
+
+            this->latent_map = to_index_tensor(latent_map_vec, structure.device());
+            this->structure = structure.to(torch::kBool).index({to_index_tensor(reduced_rows, structure.device())});
+        }
+
+        public:
+        /**
+         * @return whether the reduced structure is the original structure
+         */
+        bool is_identity() const {
+            return this->reduced_latent_size == this->latent_size;
+        }
+
+        public:
+        const torch::Tensor& get_structure() const {
+            return this->structure;
+        }
+
+        public:
+        const torch::Tensor& get_latent_map() const {
+            return this->latent_map;
+        }
+
+        public:
+        /**
+         * Maps the parameters of the original structure onto the reduced structure.
+         * The rows W_C of a merged group are replaced by the R factor of W_C = QR, which keeps W_Cᵀ W_C = Rᵀ R.
+         */
+        torch::Tensor reduce(const torch::Tensor& parameters) const {
+            TORCH_CHECK(parameters.dim() == 2 && parameters.size(0) == this->latent_size + this->visible_size && parameters.size(1) == this->visible_size,
+                        STRINGIFY(parameters) " must be of the same size as the original " STRINGIFY(structure) ".")
+            const auto device = parameters.device();
+            torch::Tensor reduced = torch::zeros({this->reduced_latent_size + this->visible_size, this->visible_size}, parameters.options());
+            reduced.index_put_({Slice(this->reduced_latent_size, None)}, parameters.index({Slice(this->latent_size, None)}));
+
+            for (const auto& group : this->groups) {
+                const auto latents = group.latents.to(device);
+                const auto children = group.children.to(device);
+                torch::Tensor group_parameters = parameters.index({latents.unsqueeze(1), children});
+
+                if (group.rows.size(0) < latents.size(0))
+                    group_parameters = std::get<1>(torch::linalg_qr(group_parameters, "r"));
+
+                reduced.index_put_({group.rows.to(device).unsqueeze(1), children}, group_parameters);
+            }
+
+            return reduced;
+        }
+
+        public:
+        /**
+         * Maps the parameters of the reduced structure back onto the original structure.
+         * Every merged group keeps its rows in its first latent variables; the rest of them get zero weights.
+         */
+        torch::Tensor expand(const torch::Tensor& parameters) const {
+            TORCH_CHECK(parameters.dim() == 2 && parameters.size(0) == this->reduced_latent_size + this->visible_size && parameters.size(1) == this->visible_size,
+                        STRINGIFY(parameters) " must be of the same size as the reduced " STRINGIFY(structure) ".")
+            const auto device = parameters.device();
+            torch::Tensor expanded = torch::zeros({this->latent_size + this->visible_size, this->visible_size}, parameters.options());
+            expanded.index_put_({Slice(this->latent_size, None)}, parameters.index({Slice(this->reduced_latent_size, None)}));
+
+            for (const auto& group : this->groups) {
+                const auto latents = group.latents.index({Slice(None, group.rows.size(0))}).to(device);
+                const auto children = group.children.to(device);
+                expanded.index_put_(
+                        {latents.unsqueeze(1), children},
+                        parameters.index({group.rows.to(device).unsqueeze(1), children})
+                );
+            }
+
+            return expanded;
+        }
+    };
+}
+
+#endif
\ No newline at end of file
@@ -2,60 +2,146 @@
 #define SN2_SOLVER_H
 
 #include <torch/extension.h>
+#include <ATen/cuda/CUDAContext.h>
+#include <c10/util/ScopeExit.h>
 #include "stringify.h"
 #include "device_data.h"
 #include "declarations.h"
 #include "sn2_solver_loss.h"
+#include "sn2_presolve.h"
+#include "sn2_warm_start.h"
+#include "sn2_solver_host.h"
+#include "work_partition.h"
+#include "method_selection.h"
+#include "buffer_arena.h"
+#include "buffer_pool.h"
+#include "convergence_monitor.h"
 #include <stddef.h>
 #include <vector>
 #include <set>
 #include <variant>
 #include <iostream>
 #include <optional>
+#include <string>
 #include <utility>
+#include <typeinfo>
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <cmath>
 
 namespace sn2_cuda {
     using namespace torch::indexing;
     using namespace sn2_cuda::loss;
 
     // Declarations
+    class DevicePlan;
+
+    /**
+     * Builds the launch configurations, streams and events of a structure once, on the device `device_index`.
+     */
+    std::shared_ptr<DevicePlan> make_device_plan(
+            const std::vector<LayerData>& layers_vec,
+            const WorkPartition& partition,
+            const std::vector<LambdaBlock>& lambda_blocks,
+            int32_t lat_len,
+            int32_t vis_len,
+            int32_t device_index
+    );
+
     namespace covar {
-        template <typename scalar_t>
+        template <typename scalar_t, typename index_t, typename accscalar_t>
         void forward(
-                const std::vector<LayerData>& layers_vec,
-                DeviceData<scalar_t>& data
+                DevicePlan& plan,
+                DeviceData<scalar_t, index_t, accscalar_t>& data
         );
 
-        template <typename scalar_t>
+        template <typename scalar_t, typename index_t, typename accscalar_t>
         void backward(
-                const std::vector<LayerData>& layers_vec,
-                DeviceData<scalar_t>& data
+                DevicePlan& plan,
+                DeviceData<scalar_t, index_t, accscalar_t>& data
         );
     }
 
     namespace accum {
-        template <typename scalar_t>
+        template <typename scalar_t, typename index_t, typename accscalar_t>
         void forward(
-                const std::vector<LayerData>& layers_vec,
-                DeviceData<scalar_t>& data
+                DevicePlan& plan,
+                DeviceData<scalar_t, index_t, accscalar_t>& data
         );
 
-        template <typename scalar_t>
+        template <typename scalar_t, typename index_t, typename accscalar_t>
         void backward(
-                const std::vector<LayerData>& layers_vec,
-                DeviceData<scalar_t>& data
+                DevicePlan& plan,
+                DeviceData<scalar_t, index_t, accscalar_t>& data
         );
     }
 
-    extern template class DeviceData<float>;
-    extern template class DeviceData<double>;
+    namespace stochastic {
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        void solve(
+                DevicePlan& plan,
+                DeviceData<scalar_t, index_t, accscalar_t>& data,
+                const scalar_t* in,
+                scalar_t* out,
+                int32_t num_probes
+        );
+
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        void project(
+                DeviceData<scalar_t, index_t, accscalar_t>& data,
+                const scalar_t* in,
+                scalar_t* out,
+                int32_t num_probes
+        );
+
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        void solve_transposed_projection(
+                DevicePlan& plan,
+                DeviceData<scalar_t, index_t, accscalar_t>& data,
+                const scalar_t* latent_in,
+                scalar_t* out,
+                int32_t num_probes
+        );
+
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        void bilinear_backward(
+                DeviceData<scalar_t, index_t, accscalar_t>& data,
+                const scalar_t* left_1,
+                const scalar_t* right_1,
+                const scalar_t* left_2,
+                const scalar_t* right_2,
+                scalar_t alpha,
+                int32_t num_probes,
+                int32_t max_num_parents
+        );
+    }
+
+    // The low-rank loss is used when |L'| * LOW_RANK_RATIO <= |V|, where |L'| counts latents with several children
+    constexpr int64_t LOW_RANK_RATIO = 4;
+
+    extern template class DeviceData<float, int32_t>;
+    extern template class DeviceData<float, int32_t, double>;
+    extern template class DeviceData<float, int64_t>;
+    extern template class DeviceData<float, int64_t, double>;
+    extern template class DeviceData<double, int32_t>;
+    extern template class DeviceData<double, int64_t>;
 
     // Class SN2Solver
     class SN2Solver {
         public:
         enum struct METHODS {
             COVAR = 0,
-            ACCUM
+            ACCUM,
+            TRISOLVE,                           // Dense: triangular solves and matrix products over the whole of B
+            AUTO,                               // The cheapest of the above for the structure (see `MethodCosts`)
+            NONE                                // No dense pass; the method of `StochasticKullbackLeibler`
+        };
+
+        public:
+        enum struct INITIALIZATIONS {
+            RANDOM = 0,                         // Standard normal weights
+            REGRESSION                          // Estimated from the sample covariance (see `WarmStart`)
         };
 
         private:
@@ -71,25 +157,418 @@ namespace sn2_cuda {
         torch::Tensor latent_neighbors;         // ^
         torch::Tensor latent_neighbors_bases;   // ^
         torch::Tensor latent_presence_range;    // ^
+        torch::Tensor latent_slots;             // ^
+        torch::Tensor lambda_rows;              // ^
+        torch::Tensor lambda_row_maps;          // ^
         std::vector<LayerData> layers_vec;      // ^
+        torch::Tensor host_structure;           // ^
+        std::shared_ptr<BufferPool::Lease> pool_lease;  // Returns the arena to `BufferPool` with the last copy of the solver
+        struct {                                // The index buffers as built on the host; uploaded by `init_arena`
+            std::vector<int32_t> parents;
+            std::vector<int32_t> parents_bases;
+            std::vector<int32_t> children;
+            std::vector<int32_t> children_bases;
+            std::vector<int32_t> latent_neighbors;
+            std::vector<int32_t> latent_neighbors_bases;
+            std::vector<int32_t> latent_presence_range;
+            std::vector<int32_t> latent_slots;
+            std::vector<int32_t> lambda_rows;   // The rows of all the blocks of `lambda_blocks`
+            std::vector<int32_t> lambda_row_maps;   // A map of no rows for the forward pass, then one per block
+        } host_indices;
+        std::vector<LambdaBlock> lambda_blocks; // Empty if the forward pass keeps lambda whole
         torch::Tensor weights_accum;
         torch::Tensor omegas;
+        torch::Tensor transformation;           // I - B; used by `METHODS::TRISOLVE`
+        torch::Tensor private_latents;          // Latent variables with a single child (for the low-rank loss)
+        torch::Tensor private_children;         // ^
+        torch::Tensor shared_latents;           // ^
+        torch::Tensor transformation_edges;     // ^ The entries of I - B: the diagonal and the visible edges, row-major
         std::variant<
                 std::monostate,
-                DeviceData<float>,
-                DeviceData<double>
+                DeviceData<float, int32_t>,
+                DeviceData<float, int32_t, double>,
+                DeviceData<float, int64_t>,
+                DeviceData<float, int64_t, double>,
+                DeviceData<double, int32_t>,
+                DeviceData<double, int64_t>,
+                DeviceData<c10::BFloat16, int32_t, float>,
+                DeviceData<c10::BFloat16, int64_t, float>
         > data;
+        std::shared_ptr<DevicePlan> device_plan;    // Execution plan of the structure; built once by `make_plan`
+        std::variant<                               // ^
+                std::monostate,
+                std::shared_ptr<host::HostPlan<float, int32_t>>,
+                std::shared_ptr<host::HostPlan<float, int32_t, double>>,
+                std::shared_ptr<host::HostPlan<float, int64_t>>,
+                std::shared_ptr<host::HostPlan<float, int64_t, double>>,
+                std::shared_ptr<host::HostPlan<double, int32_t>>,
+                std::shared_ptr<host::HostPlan<double, int64_t>>,
+                std::shared_ptr<host::HostPlan<c10::BFloat16, int32_t, float>>,
+                std::shared_ptr<host::HostPlan<c10::BFloat16, int64_t, float>>
+        > host_plan;
 
         int32_t visible_size;                   // Number of visible variables (|V|)
         int32_t latent_size;                    // Number of latent variables (|V| + |L|)
-        torch::DeviceIndex cuda_device_number;
+        int32_t num_latent_slots;               // Latent rows of the backward buffers (see `DeviceData::get_slot`)
+        int64_t memory_budget;                  // Bytes of lambda to keep with `METHODS::COVAR`; 0 for no limit
+        std::optional<std::string> mmap_directory;  // Where the arena is mapped from a file; in memory if not set
+        int32_t max_num_parents;                // Largest in-degree of a visible variable
+        bool wide_indices;                      // Whether `data` takes 64-bit offsets (see `needs_wide_indices`)
+        bool mixed_precision;                   // Whether a `float` solver accumulates and computes the loss in `double`
+        double promotion_threshold;             // Relative decrease of the loss below which `promote` is called; 0 never
+        double last_loss;                       // The loss of the previous check of `fit`, for `promotion_threshold`
+        std::vector<torch::Tensor> promotion_state; // Converted by the automatic `promote`; see `set_promotion_state`
+        bool deterministic;                     // Whether the sums on the host have a fixed shape; see `simd::fixed`
+        struct {                                // S⁻¹ and log det S of the deterministic loss; see `deterministic_loss_proxy`
+            torch::Tensor sample_covariance;    // The S they are of
+            torch::Tensor inverse;
+            double logdet;
+        } deterministic_sample_terms;
+        torch::Device device = torch::kCPU;    // CUDA runs the kernels; the CPU runs their host counterparts
         torch::Dtype dtype;
         bool validate;
+        bool low_rank;                          // Whether the loss is computed from the low-rank factors of Σ
+        LowRankFactors low_rank_factors;        // Of the weights of the last forward pass, with `low_rank`
+        bool low_rank_factors_valid = false;    // Whether D of `low_rank_factors` is non-singular
+        bool low_rank_check_due = true;         // Whether the next forward pass reads `low_rank_factors_valid`
         METHODS method;
+        MethodCosts method_costs;               // Estimated when `method` is `METHODS::AUTO`
         void (SN2Solver::*forward_method)(void);
         void (SN2Solver::*backward_method)(void);
 
         std::shared_ptr<LossBase> loss_function;
+        std::shared_ptr<StochasticKullbackLeibler> stochastic_loss_function;
+        std::shared_ptr<ModelReduction> reduction;  // Maps the user's structure onto the one solved; null if not presolved
+
+        private:
+        /**
+         * Products with the visible covariance Σ = (I - B)⁻ᵀ W_Lᵀ W_L (I - B)⁻¹ computed from the structure,
+         * layer by layer, without materializing any |V|×|V| matrix.
+         */
+        class StructuredCovariance : public CovarianceOperator {
+            SN2Solver& solver;
+
+            public:
+            explicit StructuredCovariance(SN2Solver& solver) : solver(solver) { }
+
+            public:
+            int64_t get_size() const override {
+                return solver.visible_size;
+            }
+
+            private:
+            torch::Tensor solve(const torch::Tensor& x) const {
+                auto out = torch::empty_like(x);
+                SN2_DISPATCH_FLOATING_TYPES(solver.dtype, "StructuredCovariance::solve", ([&] {
+                    SN2_DISPATCH_DATA_TYPES(solver.wide_indices, solver.mixed_precision, ([&] {
+                        if (solver.on_host())
+                            solver.get_host_plan<scalar_t, index_t, accscalar_t>().solve(x.data_ptr<scalar_t>(), out.data_ptr<scalar_t>(), x.size(1));
+                        else if constexpr (has_device_kernels<scalar_t>)
+                            stochastic::solve<scalar_t>(
+                                    *solver.device_plan, std::get<DeviceData<scalar_t, index_t, accscalar_t>>(solver.data),
+                                    x.data_ptr<scalar_t>(), out.data_ptr<scalar_t>(), x.size(1)
+                            );
+                    }));
+                }));
+                return out;
+            }
+
+            private:
+            void project(const torch::Tensor& x, const torch::Tensor& out) const {
+                SN2_DISPATCH_FLOATING_TYPES(solver.dtype, "StructuredCovariance::project", ([&] {
+                    SN2_DISPATCH_DATA_TYPES(solver.wide_indices, solver.mixed_precision, ([&] {
+                        if (solver.on_host())
+                            solver.get_host_plan<scalar_t, index_t, accscalar_t>().project(x.data_ptr<scalar_t>(), out.data_ptr<scalar_t>(), x.size(1));
+                        else if constexpr (has_device_kernels<scalar_t>)
+                            stochastic::project<scalar_t>(
+                                    std::get<DeviceData<scalar_t, index_t, accscalar_t>>(solver.data),
+                                    x.data_ptr<scalar_t>(), out.data_ptr<scalar_t>(), x.size(1)
+                            );
+                    }));
+                }));
+            }
+
+            private:
+            void solve_transposed_projection(const torch::Tensor& latent_x, const torch::Tensor& out) const {
+                SN2_DISPATCH_FLOATING_TYPES(solver.dtype, "StructuredCovariance::solve_transposed_projection", ([&] {
+                    SN2_DISPATCH_DATA_TYPES(solver.wide_indices, solver.mixed_precision, ([&] {
+                        if (solver.on_host())
+                            solver.get_host_plan<scalar_t, index_t, accscalar_t>().solve_transposed_projection(
+                                    latent_x.data_ptr<scalar_t>(), out.data_ptr<scalar_t>(), latent_x.size(1)
+                            );
+                        else if constexpr (has_device_kernels<scalar_t>)
+                            stochastic::solve_transposed_projection<scalar_t>(
+                                    *solver.device_plan, std::get<DeviceData<scalar_t, index_t, accscalar_t>>(solver.data),
+                                    latent_x.data_ptr<scalar_t>(), out.data_ptr<scalar_t>(), latent_x.size(1)
+                            );
+                    }));
+                }));
+            }
+
+            public:
+            torch::Tensor apply(const torch::Tensor& x) const override {
+                const auto solved = solve(x.contiguous());
+                const auto latent = torch::empty({solver.latent_size, x.size(1)}, x.options());
+                const auto out = torch::empty_like(solved);
+                project(solved, latent);
+                solve_transposed_projection(latent, out);
+                return out;
+            }
+
+            public:
+            void bilinear_backward(const torch::Tensor& x, const torch::Tensor& y, double alpha) const override {
+                // left_1 = [W_L q; (I - B)⁻ᵀ W_Lᵀ W_L q], left_2 = [W_L p; (I - B)⁻ᵀ W_Lᵀ W_L p],
+                // where p = (I - B)⁻¹ x and q = (I - B)⁻¹ y
+                const auto solved_x = solve(x.contiguous());
+                const auto solved_y = solve(y.contiguous());
+                auto left_1 = torch::empty({solver.latent_size + solver.visible_size, x.size(1)}, x.options());
+                auto left_2 = torch::empty_like(left_1);
+                project(solved_y, left_1.narrow(0, 0, solver.latent_size));
+                project(solved_x, left_2.narrow(0, 0, solver.latent_size));
+                solve_transposed_projection(left_1.narrow(0, 0, solver.latent_size), left_1.narrow(0, solver.latent_size, solver.visible_size));
+                solve_transposed_projection(left_2.narrow(0, 0, solver.latent_size), left_2.narrow(0, solver.latent_size, solver.visible_size));
+
+                SN2_DISPATCH_FLOATING_TYPES(solver.dtype, "StructuredCovariance::bilinear_backward", ([&] {
+                    SN2_DISPATCH_DATA_TYPES(solver.wide_indices, solver.mixed_precision, ([&] {
+                        if (solver.on_host())
+                            solver.get_host_plan<scalar_t, index_t, accscalar_t>().bilinear_backward(
+                                    left_1.data_ptr<scalar_t>(), solved_x.data_ptr<scalar_t>(),
+                                    left_2.data_ptr<scalar_t>(), solved_y.data_ptr<scalar_t>(),
+                                    alpha, x.size(1)
+                            );
+                        else if constexpr (has_device_kernels<scalar_t>)
+                            stochastic::bilinear_backward<scalar_t>(
+                                    std::get<DeviceData<scalar_t, index_t, accscalar_t>>(solver.data),
+                                    left_1.data_ptr<scalar_t>(), solved_x.data_ptr<scalar_t>(),
+                                    left_2.data_ptr<scalar_t>(), solved_y.data_ptr<scalar_t>(),
+                                    alpha, x.size(1), solver.max_num_parents
+                            );
+                    }));
+                }));
+            }
+        };
+
+        private:
+        inline bool on_host() const {
+            return this->device.is_cpu();
+        }
+
+        private:
+        /**
+         * @return the dtype of the loss and of its gradient; `double` with the mixed precision, and `float` with the
+         *         `bfloat16` storage
+         */
+        inline torch::Dtype get_loss_dtype() const {
+            if (this->mixed_precision)
+                return torch::kDouble;
+            else if (this->dtype == torch::kBFloat16)
+                return torch::kFloat;
+            else
+                return this->dtype;
+        }
+
+        private:
+        /**
+         * `matmul_into` by `host::dense::matmul_transposed`, for the deterministic mode on the host.
+         */
+        void deterministic_matmul_into(torch::Tensor& out, const torch::Tensor& a, const torch::Tensor& b) const {
+            const auto a_rows = a.to(this->dtype).contiguous();
+            const auto b_columns = b.to(this->dtype).transpose(0, 1).contiguous();
+            const auto result = torch::empty({a.size(0), b.size(1)}, a_rows.options());
+
+            SN2_DISPATCH_FLOATING_TYPES(this->dtype, "SN2Solver::deterministic_matmul_into", ([&] {
+                SN2_DISPATCH_DATA_TYPES(this->wide_indices, this->mixed_precision, ([&] {
+                    host::dense::matmul_transposed<scalar_t, accscalar_t>(
+                            a_rows.data_ptr<scalar_t>(), b_columns.data_ptr<scalar_t>(), result.data_ptr<scalar_t>(),
+                            result.size(0), result.size(1), a_rows.size(1), simd::get_kernels<scalar_t, accscalar_t>(true)
+                    );
+                }));
+            }));
+            out.copy_(result);
+        }
+
+        private:
+        /**
+         * `solve_triangular_into` by `host::dense::solve_unitriangular`, for the deterministic mode on the host.
+         */
+        void deterministic_solve_triangular_into(torch::Tensor& out, const torch::Tensor& a, const torch::Tensor& b, bool upper) const {
+            const auto a_columns = a.to(this->dtype).transpose(0, 1).contiguous();
+            const auto b_rows = b.to(this->dtype).contiguous();
+            const auto result = torch::empty_like(b_rows);
+
+            SN2_DISPATCH_FLOATING_TYPES(this->dtype, "SN2Solver::deterministic_solve_triangular_into", ([&] {
+                SN2_DISPATCH_DATA_TYPES(this->wide_indices, this->mixed_precision, ([&] {
+                    host::dense::solve_unitriangular<scalar_t, accscalar_t>(
+                            a_columns.data_ptr<scalar_t>(), b_rows.data_ptr<scalar_t>(), result.data_ptr<scalar_t>(),
+                            result.size(0), result.size(1), upper, simd::get_kernels<scalar_t, accscalar_t>(true)
+                    );
+                }));
+            }));
+            out.copy_(result);
+        }
+
+        private:
+        /**
+         * out = a b; unless the loss is in the dtype of the buffers, the product is computed in the dtype of the loss
+         * and rounded into `out`.
+         */
+        inline void matmul_into(torch::Tensor& out, const torch::Tensor& a, const torch::Tensor& b) const {
+            const torch::Dtype loss_dtype = this->get_loss_dtype();
+
+            if (this->deterministic && this->on_host())
+                this->deterministic_matmul_into(out, a, b);
+            else if (loss_dtype != this->dtype)
+                out.copy_(torch::matmul(a.to(loss_dtype), b.to(loss_dtype)));
+            else
+                torch::matmul_out(out, a, b);
+        }
+
+        private:
+        /**
+         * @return whether the loss is `KullbackLeibler`, computed by `deterministic_loss_proxy` and
+         *         `deterministic_loss_backward` in the deterministic mode on the host
+         */
+        inline bool has_deterministic_loss() const {
+            return this->deterministic && this->on_host() && typeid(*this->loss_function) == typeid(KullbackLeibler);
+        }
+
+        private:
+        /**
+         * The Cholesky factor of the symmetric `matrix` by `host::dense::cholesky`, for the deterministic mode.
+         * @return the factor, or an undefined tensor if `matrix` is not positive definite
+         */
+        torch::Tensor deterministic_cholesky(const torch::Tensor& matrix) const {
+            const auto a = matrix.contiguous();
+            torch::Tensor factor = torch::empty_like(a);
+            bool positive_definite;
+
+            AT_DISPATCH_FLOATING_TYPES(a.scalar_type(), "SN2Solver::deterministic_cholesky", ([&] {
+                positive_definite = host::dense::cholesky<scalar_t, scalar_t>(
+                        a.data_ptr<scalar_t>(), factor.data_ptr<scalar_t>(), a.size(0), simd::get_kernels<scalar_t>(true)
+                );
+            }));
+
+            return positive_definite ? factor : torch::Tensor();
+        }
+
+        private:
+        /**
+         * @return log det of the matrix of the Cholesky `factor`, summed in order; NaN if `factor` is undefined
+         */
+        static double deterministic_logdet(const torch::Tensor& factor) {
+            if (!factor.defined())
+                return std::numeric_limits<double>::quiet_NaN();
+
+            const auto diagonal = factor.diagonal().to(torch::kDouble).contiguous();
+            const double* values = diagonal.data_ptr<double>();
+            double logdet = 0.0;
+
+            for (int64_t j = 0; j < diagonal.numel(); j++)
+                logdet += 2.0 * std::log(values[j]);
+
+            return logdet;
+        }
+
+        private:
+        /**
+         * @return the inverse of the matrix of the Cholesky `factor` by `host::dense::cholesky_inverse`; NaN if
+         *         `factor` is undefined, of the size and dtype of `matrix`
+         */
+        torch::Tensor deterministic_inverse(const torch::Tensor& factor, const torch::Tensor& matrix) const {
+            if (!factor.defined())
+                return torch::full_like(matrix, std::numeric_limits<double>::quiet_NaN());
+
+            const auto factor_transposed = factor.transpose(0, 1).contiguous();
+            torch::Tensor inverse = torch::empty_like(factor);
+
+            AT_DISPATCH_FLOATING_TYPES(factor.scalar_type(), "SN2Solver::deterministic_inverse", ([&] {
+                host::dense::cholesky_inverse<scalar_t, scalar_t>(
+                        factor.data_ptr<scalar_t>(), factor_transposed.data_ptr<scalar_t>(), inverse.data_ptr<scalar_t>(),
+                        factor.size(0), simd::get_kernels<scalar_t>(true)
+                );
+            }));
+
+            return inverse;
+        }
+
+        private:
+        /**
+         * @return S⁻¹ and log det S of the deterministic loss, computed once for every S
+         */
+        const decltype(deterministic_sample_terms)& get_deterministic_sample_terms() {
+            const torch::Tensor& sample_covariance = this->get_sample_covariance();
+
+            if (!this->deterministic_sample_terms.sample_covariance.is_same(sample_covariance)) {
+                const torch::Tensor factor = this->deterministic_cholesky(sample_covariance);
+                this->deterministic_sample_terms = {
+                        sample_covariance,
+                        this->deterministic_inverse(factor, sample_covariance),
+                        deterministic_logdet(factor)
+                };
+            }
+
+            return this->deterministic_sample_terms;
+        }
+
+        private:
+        /**
+         * `KullbackLeibler::loss_proxy`, tr(S⁻¹ Σ) - log det Σ, with the fixed-shape sums of `host::dense` in place of
+         * LAPACK; the sums are the same whatever the number of threads.
+         */
+        torch::Tensor deterministic_loss_proxy(const torch::Tensor& visible_covariance) {
+            const auto sigma = visible_covariance.contiguous();
+            const auto& sample_terms = this->get_deterministic_sample_terms();
+            double trace;
+
+            AT_DISPATCH_FLOATING_TYPES(sigma.scalar_type(), "SN2Solver::deterministic_loss_proxy", ([&] {
+                trace = host::dense::frobenius_product<scalar_t, scalar_t>(
+                        sample_terms.inverse.data_ptr<scalar_t>(), sigma.data_ptr<scalar_t>(), sigma.size(0), sigma.size(1),
+                        simd::get_kernels<scalar_t>(true)
+                );
+            }));
+
+            return torch::scalar_tensor(trace - deterministic_logdet(this->deterministic_cholesky(sigma)), sigma.options());
+        }
+
+        private:
+        /**
+         * `KullbackLeibler::loss`, from `deterministic_loss_proxy`.
+         */
+        torch::Tensor deterministic_loss(const torch::Tensor& visible_covariance) {
+            const auto& sample_terms = this->get_deterministic_sample_terms();
+            return deterministic_loss_proxy(visible_covariance).sub_(this->visible_size).add_(sample_terms.logdet).div_(2.0);
+        }
+
+        private:
+        /**
+         * `KullbackLeibler::loss_backward`, S⁻¹ - Σ⁻¹, with the inverses of `host::dense::cholesky_inverse`.
+         */
+        void deterministic_loss_backward(const torch::Tensor& visible_covariance, torch::Tensor& visible_covariance_grad) {
+            const auto& sample_terms = this->get_deterministic_sample_terms();
+            visible_covariance_grad.copy_(sample_terms.inverse);
+            visible_covariance_grad.subtract_(this->deterministic_inverse(this->deterministic_cholesky(visible_covariance), visible_covariance));
+        }
+
+        private:
+        /**
+         * out = b a⁻¹ for a unitriangular `a`; in the dtype of the loss, as `matmul_into`.
+         */
+        inline void solve_triangular_into(torch::Tensor& out, const torch::Tensor& a, const torch::Tensor& b, bool upper) const {
+            const torch::Dtype loss_dtype = this->get_loss_dtype();
+
+            if (this->deterministic && this->on_host())
+                this->deterministic_solve_triangular_into(out, a, b, upper);
+            else if (loss_dtype != this->dtype)
+                out.copy_(torch::linalg_solve_triangular(a.to(loss_dtype), b.to(loss_dtype), upper, /*left=*/false, /*unitriangular=*/true));
+            else
+                torch::linalg_solve_triangular_out(out, a, b, upper, /*left=*/false, /*unitriangular=*/true);
+        }
+
+        private:
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        inline host::HostPlan<scalar_t, index_t, accscalar_t>& get_host_plan() {
+            return *std::get<std::shared_ptr<host::HostPlan<scalar_t, index_t, accscalar_t>>>(this->host_plan);
+        }
 
         private:
         inline int32_t num_layers() {
@@ -104,7 +583,8 @@ namespace sn2_cuda {
                 torch::Dtype dtype,
                 std::shared_ptr<LossBase> loss_function,
                 METHODS method,
-                bool validate
+                bool validate,
+                std::optional<torch::Device> device
         ) {
             const int32_t total_size = structure.size(0);
             this->visible_size = structure.size(1);
@@ -113,19 +593,30 @@ namespace sn2_cuda {
             this->method = method;
             this->validate = validate;
 
-            TORCH_CHECK(torch::cuda::is_available(), "CUDA is not available. " STRINGIFY(SN2Solver) " needs CUDA to run.")
+            // Without an explicit device, the solver runs on CUDA whenever it is available
+            if (device.has_value())
+                this->device = device.value();
+            else if (torch::cuda::is_available())
+                this->device = structure.device().is_cuda() ? structure.device() : torch::Device(torch::kCUDA);
+            else
+                this->device = torch::kCPU;
+
+            TORCH_CHECK(this->device.is_cpu() || this->device.is_cuda(), STRINGIFY(SN2Solver) " runs either on CUDA or on the CPU; ", this->device, " is not supported.")
+            TORCH_CHECK(this->device.is_cpu() || torch::cuda::is_available(), "CUDA is not available. Consider initializing " STRINGIFY(SN2Solver) " with " STRINGIFY(device="cpu") ".")
             TORCH_CHECK(structure.dim() == 2, STRINGIFY(structure) " must be 2-dimensional; it is ", structure.dim(), "-dimensional.")
             TORCH_CHECK(structure.numel() > 0, STRINGIFY(structure) " needs at least one element.")
             TORCH_CHECK(latent_size >= 0, STRINGIFY(structure) " must be a vertical-rectangular matrix.")
-            TORCH_CHECK(dtype == torch::kFloat || dtype == torch::kDouble, STRINGIFY(dtype) " must be either " STRINGIFY(torch::kFloat) " or " STRINGIFY(torch::kDouble) ".")
+            TORCH_CHECK(dtype == torch::kFloat || dtype == torch::kDouble || dtype == torch::kBFloat16,
+                        STRINGIFY(dtype) " must be " STRINGIFY(torch::kFloat) ", " STRINGIFY(torch::kDouble) " or " STRINGIFY(torch::kBFloat16) ".")
+            TORCH_CHECK(dtype != torch::kBFloat16 || this->device.is_cpu(),
+                        STRINGIFY(torch::kBFloat16) " is supported on the CPU only; consider " STRINGIFY(device="cpu") ".")
             TORCH_CHECK(!parameters.defined() || parameters.sizes() == structure.sizes(), STRINGIFY(parameters) " must be of the same size as " STRINGIFY(structure) ".")
 
-            this->cuda_device_number = structure.device().is_cuda() ? structure.device().index() : -1;
             const bool parameters_exist = parameters.defined();
             const auto& base = parameters_exist ? parameters : structure;
             torch::TensorOptions options = torch::TensorOptions()
                     .dtype(dtype)
-                    .device(torch::kCUDA, this->cuda_device_number)
+                    .device(this->device)
                     .requires_grad(false);
             this->structure = structure.to(options.dtype(torch::kBool));
 
@@ -151,54 +642,260 @@ namespace sn2_cuda {
 
             this->weights = base.to(options);
             this->weights *= parameters_exist ? this->structure : torch::randn_like(this->weights);
-            this->weights.mutable_grad() = torch::zeros_like(this->weights);
             this->loss_function = loss_function ? loss_function : std::make_shared<KullbackLeibler>();
 
             if (sample_covariance.defined()) {
                 this->set_sample_covariance(sample_covariance);
             }
 
-            switch (method) {
-                case METHODS::COVAR:
-                    this->lambda = torch::zeros_like(this->weights);
-                    this->covariance = torch::zeros_like(this->weights);
-                    this->covariance.mutable_grad() = torch::zeros({2, total_size, visible_size}, options);
-                    this->visible_covariance = this->covariance.index({ Slice(latent_size, None), Slice() });
-                    this->visible_covariance.mutable_grad() = this->covariance.mutable_grad().index({ Slice(), Slice(latent_size, None), Slice() });
+            this->stochastic_loss_function = std::dynamic_pointer_cast<StochasticKullbackLeibler>(this->loss_function);
+        }
+
+        private:
+        /**
+         * Resolves `METHODS::AUTO` from the compiled structure and selects the passes of the method. With the
+         * stochastic loss, which computes products with Σ from the weights, any method becomes `METHODS::NONE`, and
+         * no costs are estimated.
+         */
+        void init_method(int64_t trial_iterations) {
+            // The stochastic loss works on products with Σ; none of the dense buffers of `method` are needed
+            if (this->stochastic_loss_function) {
+                this->method = METHODS::NONE;
+                this->forward_method = nullptr;         // `forward` has nothing to compute
+                this->backward_method = &SN2Solver::backward_stochastic;
+                return;
+            }
+
+            TORCH_CHECK(this->method != METHODS::NONE,
+                        STRINGIFY(METHODS::NONE) " is only for " STRINGIFY(StochasticKullbackLeibler) ".")
 
+            if (this->method == METHODS::AUTO)
+                this->method = this->select_method(trial_iterations);
+
+            switch (this->method) {
+                case METHODS::COVAR:
                     this->forward_method = &SN2Solver::forward_covar;
                     this->backward_method = &SN2Solver::backward_covar;
+                    this->make_lambda_blocks();
                     break;
 
                 case METHODS::ACCUM:
-                    this->visible_covariance = torch::zeros({visible_size, visible_size}, options);
-                    this->visible_covariance.mutable_grad() = torch::zeros_like(this->visible_covariance);
-                    this->weights_accum = torch::zeros({latent_size, visible_size}, options);
-                    this->omegas = torch::zeros({2, latent_size, total_size}, options);
-
                     this->forward_method = &SN2Solver::forward_accum;
                     this->backward_method = &SN2Solver::backward_accum;
                     break;
+
+                default:
+                    this->forward_method = &SN2Solver::forward_trisolve;
+                    this->backward_method = &SN2Solver::backward_trisolve;
+                    break;
+            }
+        }
+
+        private:
+        /**
+         * With a `memory_budget` smaller than lambda, the forward pass does not keep lambda; the backward pass
+         * recomputes, from the covariance, the rows that the weights kernels of a block of layers read, before the
+         * first layer of the block. The blocks are as long as their rows fit the budget, and at least one layer.
+         * A smaller budget gives more blocks, and every block recomputes its rows over all the layers.
+         */
+        void make_lambda_blocks() {
+            const int32_t total_size = latent_size + visible_size;
+            const int64_t row_bytes = int64_t(visible_size) * torch::elementSize(dtype);
+            auto& indices = this->host_indices;
+
+            if (this->memory_budget <= 0 || this->memory_budget >= row_bytes * total_size)
+                return;
+
+            const int64_t max_rows = std::max<int64_t>(this->memory_budget / row_bytes, 1);
+            std::vector<int32_t> block_of_var(total_size, -1);
+            std::vector<int32_t> layer_rows;
+
+            for (int32_t l = this->num_layers() - 2; l >= 0; l--) {
+                // The variables with children in the layer are the rows its weights kernel reads
+                layer_rows.clear();
+
+                for (int32_t v = 0; v < total_size; v++) {
+                    const int32_t idx = v * this->num_layers() + l;
+
+                    if (indices.children_bases[idx + 1] > indices.children_bases[idx])
+                        layer_rows.push_back(v - latent_size);
+                }
+
+                const int32_t block = this->lambda_blocks.size() - 1;
+                int64_t num_rows = block >= 0 ? this->lambda_blocks[block].num_rows : 0;
+
+                for (const int32_t v : layer_rows)
+                    num_rows += block >= 0 && block_of_var[v + latent_size] != block;
+
+                if (block < 0 || num_rows > max_rows)
+                    this->lambda_blocks.push_back({l, l, 0, nullptr, nullptr});
+
+                const int32_t current = this->lambda_blocks.size() - 1;
+                this->lambda_blocks[current].first_layer = l;
+
+                for (const int32_t v : layer_rows)
+                    if (block_of_var[v + latent_size] != current) {
+                        block_of_var[v + latent_size] = current;
+                        indices.lambda_rows.push_back(v);
+                        this->lambda_blocks[current].num_rows++;
+                    }
+            }
+
+            indices.lambda_row_maps.assign((this->lambda_blocks.size() + 1) * total_size, -1);
+
+            for (int32_t b = 0, offset = 0; b < this->lambda_blocks.size(); offset += this->lambda_blocks[b++].num_rows)
+                for (int32_t r = 0; r < this->lambda_blocks[b].num_rows; r++)
+                    indices.lambda_row_maps[(b + 1) * total_size + indices.lambda_rows[offset + r] + latent_size] = r;
+        }
+
+        private:
+        /**
+         * Carves all the buffers of the solver out of one `BufferArena`, laid out in the order they are used together:
+         *  - the weights and their gradient;
+         *  - the buffers of the method: λ, the covariance and its two gradient slots for `METHODS::COVAR`; the visible
+         *    covariance, its gradient, W^acc and the two Ω slots for `METHODS::ACCUM`; the visible covariance, its
+         *    gradient, W^acc and I - B for `METHODS::TRISOLVE`; none for the stochastic loss;
+         *  - the structure;
+         *  - the index buffers, uploaded from `host_indices` with a single copy.
+         * The weights and the structure are moved from the tensors made by `init_parameters`. An arena recycled from a
+         * solver of the same structure, dtype and method (see `BufferPool`) already holds the structure and the index
+         * buffers; only the weights are written.
+         */
+        void init_arena() {
+            const int64_t total_size = latent_size + visible_size;
+            const bool dense_buffers = !this->stochastic_loss_function;
+            auto& indices = this->host_indices;
+            BufferArena arena;
+
+            const int32_t weights_id = arena.add({total_size, visible_size}, dtype);
+            const int32_t weights_grad_id = arena.add({total_size, visible_size}, dtype);
+            int32_t method_ids[4] = {-1, -1, -1, -1};
+
+            if (dense_buffers) {
+                if (this->method == METHODS::COVAR) {
+                    int64_t lambda_size = this->lambda_blocks.empty() ? total_size : 1;
+
+                    for (const auto& block : this->lambda_blocks)
+                        lambda_size = std::max<int64_t>(lambda_size, block.num_rows);
+
+                    method_ids[0] = arena.add({lambda_size, visible_size}, dtype);              // λ, or the rows of a block
+                    method_ids[1] = arena.add({total_size, visible_size}, dtype);               // Covariance
+                    method_ids[2] = arena.add({2, num_latent_slots + visible_size, visible_size}, dtype);  // Its gradients
+                } else {
+                    method_ids[0] = arena.add({visible_size, visible_size}, dtype);             // Σ
+                    method_ids[1] = arena.add({visible_size, visible_size}, dtype);             // Its gradient
+                    method_ids[2] = arena.add({latent_size, visible_size}, dtype);              // W^acc
+
+                    if (this->method == METHODS::ACCUM)
+                        method_ids[3] = arena.add({2, latent_size, num_latent_slots + visible_size}, dtype);  // Ω
+                    else
+                        method_ids[3] = arena.add({visible_size, visible_size}, dtype);         // I - B
+                }
+            }
+
+            const int32_t structure_id = arena.add({total_size, visible_size}, torch::kBool);
+            const std::vector<std::pair<int32_t, const void*>> index_buffers = {
+                    {arena.add({int64_t(indices.parents.size())}, torch::kInt32), indices.parents.data()},
+                    {arena.add({int64_t(indices.parents_bases.size())}, torch::kInt32), indices.parents_bases.data()},
+                    {arena.add({int64_t(indices.children.size())}, torch::kInt32), indices.children.data()},
+                    {arena.add({total_size, this->num_layers()}, torch::kInt32), indices.children_bases.data()},
+                    {arena.add({int64_t(indices.latent_neighbors.size())}, torch::kInt32), indices.latent_neighbors.data()},
+                    {arena.add({int64_t(indices.latent_neighbors_bases.size())}, torch::kInt32), indices.latent_neighbors_bases.data()},
+                    {arena.add({latent_size, 2}, torch::kInt32), indices.latent_presence_range.data()},
+                    {arena.add({latent_size}, torch::kInt32), indices.latent_slots.data()},
+                    {arena.add({int64_t(indices.lambda_rows.size())}, torch::kInt32), indices.lambda_rows.data()},
+                    {arena.add({int64_t(indices.lambda_row_maps.size())}, torch::kInt32), indices.lambda_row_maps.data()}
+            };
+
+            const BufferPool::Key key = {
+                    BufferPool::get_fingerprint(this->host_structure), arena.get_size(), static_cast<int32_t>(dtype),
+                    dense_buffers ? static_cast<int32_t>(this->method) : -1, this->memory_budget, this->device
+            };
+            // A mapped arena is freed, and its file deleted, with the solver rather than kept by the pool
+            const torch::Tensor recycled = this->mmap_directory.has_value() ?
+                    torch::Tensor() : BufferPool::get_instance().acquire(key, this->host_structure);
+
+            if (recycled.defined()) {
+                arena.attach(recycled);
+                this->structure = arena.get(structure_id);
+            } else {
+                if (this->mmap_directory.has_value())
+                    arena.allocate_mapped(this->mmap_directory.value());
+                else
+                    try {
+                        arena.allocate(this->device);
+                    } catch (const c10::OutOfMemoryError&) {
+                        // The arenas held by the pool may be what fills the device
+                        BufferPool::get_instance().clear();
+                        arena.allocate(this->device);
+                    }
+
+                arena.upload(index_buffers);
+                this->structure = arena.get(structure_id).copy_(this->structure);
+            }
+
+            if (!this->mmap_directory.has_value())
+                this->pool_lease = BufferPool::lease(key, this->host_structure, arena.get_memory());
+            this->weights = arena.get(weights_id).copy_(this->weights);
+            this->weights.mutable_grad() = arena.get(weights_grad_id);
+            this->parents = arena.get(index_buffers[0].first);
+            this->parents_bases = arena.get(index_buffers[1].first);
+            this->children = arena.get(index_buffers[2].first);
+            this->children_bases = arena.get(index_buffers[3].first);
+            this->latent_neighbors = arena.get(index_buffers[4].first);
+            this->latent_neighbors_bases = arena.get(index_buffers[5].first);
+            this->latent_presence_range = arena.get(index_buffers[6].first);
+            this->latent_slots = arena.get(index_buffers[7].first);
+            this->lambda_rows = arena.get(index_buffers[8].first);
+            this->lambda_row_maps = arena.get(index_buffers[9].first);
+
+            for (int32_t b = 0, offset = 0; b < this->lambda_blocks.size(); offset += this->lambda_blocks[b++].num_rows) {
+                this->lambda_blocks[b].rows = this->lambda_rows.data_ptr<int32_t>() + offset;
+                this->lambda_blocks[b].row_map = this->lambda_row_maps.data_ptr<int32_t>() + (b + 1) * total_size;
+            }
+
+            for (int32_t l = 0; l < this->num_layers(); l++)
+                this->layers_vec[l].lat_vars = this->latent_neighbors.data_ptr<int32_t>() + indices.latent_neighbors_bases[l];
+
+            if (!dense_buffers)
+                return;
+
+            if (this->method == METHODS::COVAR) {
+                this->lambda = arena.get(method_ids[0]);
+                this->covariance = arena.get(method_ids[1]);
+                this->covariance.mutable_grad() = arena.get(method_ids[2]);
+                this->visible_covariance = this->covariance.index({ Slice(latent_size, None), Slice() });
+                this->visible_covariance.mutable_grad() = this->covariance.mutable_grad().index({ Slice(), Slice(num_latent_slots, None), Slice() });
+            } else {
+                this->visible_covariance = arena.get(method_ids[0]);
+                this->visible_covariance.mutable_grad() = arena.get(method_ids[1]);
+                this->weights_accum = arena.get(method_ids[2]);
+
+                if (this->method == METHODS::ACCUM)
+                    this->omegas = arena.get(method_ids[3]);
+                else
+                    this->transformation = arena.get(method_ids[3]);
             }
         }
 
         private:
         void make_structures() {
             const int32_t total_size = latent_size + visible_size;
-            torch::TensorOptions options = torch::TensorOptions()
-                    .dtype(torch::kInt32)
-                    .device(torch::kCUDA, this->cuda_device_number)
-                    .requires_grad(false);
-            int32_t edge_count = 0, rev_edge_count = 0;
+            auto& indices = this->host_indices;
+            // Read the structure on the host once rather than synchronizing on every entry
+            this->host_structure = this->structure.to(torch::kCPU).contiguous();
+            const auto structure = this->host_structure.accessor<bool, 2>();
+            int64_t edge_count = 0;
             std::vector<std::vector<int32_t>> parents_vec(this->visible_size);
             std::vector<std::vector<std::vector<int32_t>>> children_vec({std::vector<std::vector<int32_t>>(total_size)});
-            this->latent_presence_range = torch::full({latent_size, 2}, -1, options);
+            std::vector<int32_t> latent_presence_range_vec(latent_size * 2, -1);
+            this->max_num_parents = 0;
             this->layers_vec.resize(1);
             this->layers_vec.push_back(LayerData(1, 0));
 
             for (int32_t c = 0, layer_max = 0; c < visible_size; c++) {
                 for (int32_t p = -latent_size; p < visible_size; p++)
-                    if (structure[p + latent_size][c].item<bool>()) {
+                    if (structure[p + latent_size][c]) {
                         parents_vec[c].push_back(p); // Add to the parents of the current child
 
                         // If parent does not belong to previous layer, make a new layer
@@ -212,102 +909,329 @@ namespace sn2_cuda {
                     }
 
                 for (int32_t p = -latent_size; p < visible_size; p++) {
-                    if (structure[p + latent_size][c].item<bool>()) {
+                    if (structure[p + latent_size][c]) {
                         if (p < 0) {
-                            auto&& this_latent = this->latent_presence_range[p + latent_size];
-                            this_latent.index_put_(
-                                {Slice(this_latent[0].item<int32_t>() == -1 ? 0 : 1, 2)},
-                                layers_vec.back().idx - 1
-                            );
+                            int32_t* this_latent = &latent_presence_range_vec[(p + latent_size) * 2];
+                            this_latent[0] = this_latent[0] == -1 ? layers_vec.back().idx - 1 : this_latent[0];
+                            this_latent[1] = layers_vec.back().idx - 1;
                         }
 
                         children_vec.back()[p + latent_size].push_back(c); // Add to the children of the current parent
                     }
                 }
 
+                this->max_num_parents = std::max<int32_t>(this->max_num_parents, parents_vec[c].size());
                 this->layers_vec.back().num++;
             }
 
-            // Create the parents data
-            this->parents = torch::zeros(edge_count, options);
-            this->parents_bases = torch::zeros(this->visible_size + 1, options);
-
-            for (int32_t c = 0, idx = 0; c < this->visible_size; ) {
-                for (int32_t p : parents_vec[c])
-                    this->parents[idx++] = p;
+            TORCH_CHECK(edge_count <= std::numeric_limits<int32_t>::max(),
+                        STRINGIFY(structure) " has ", edge_count, " edges; at most 2³¹ - 1 are supported.")
 
-                this->parents_bases[++c] = idx;
+            // Create the parents data
+            std::vector<int32_t>& parents_flat = indices.parents;
+            std::vector<int32_t>& parents_bases_vec = indices.parents_bases;
+            parents_flat.reserve(edge_count);
+            parents_bases_vec.assign(1, 0);
+
+            for (int32_t c = 0; c < this->visible_size; c++) {
+                parents_flat.insert(parents_flat.end(), parents_vec[c].begin(), parents_vec[c].end());
+                parents_bases_vec.push_back(parents_flat.size());
             }
 
             // Create the children data
-            this->children = torch::zeros(edge_count, options);
-            this->children_bases = torch::zeros({total_size, this->num_layers()}, options);
+            std::vector<int32_t>& children_flat = indices.children;
+            std::vector<int32_t>& children_bases_vec = indices.children_bases;
+            children_flat.reserve(edge_count);
+            children_bases_vec.assign(total_size * this->num_layers(), 0);
 
-            for (int32_t p = -latent_size, idx = 0; p < visible_size; p++) {
-                this->children_bases.index_put_({p + latent_size, 0}, idx);
+            for (int32_t p = -latent_size; p < visible_size; p++) {
+                int32_t* this_bases = &children_bases_vec[int64_t(p + latent_size) * this->num_layers()];
+                this_bases[0] = children_flat.size();
 
                 for (int32_t l = 0; l < children_vec.size(); ) {
-                    for (int32_t c : children_vec[l][p + latent_size])
-                        this->children[idx++] = c;
-
-                    this->children_bases.index_put_({p + latent_size, ++l}, idx);
+                    const auto& this_children = children_vec[l][p + latent_size];
+                    children_flat.insert(children_flat.end(), this_children.begin(), this_children.end());
+                    this_bases[++l] = children_flat.size();
                 }
             }
 
-            int32_t latent_neighbors_count = 0;
             std::vector<std::vector<int32_t>> latent_neighbors_vec(this->num_layers());
 
             for (int32_t v = -this->latent_size; v < 0; v++) {
-                const auto&& this_latent = this->latent_presence_range[v + latent_size];
+                const int32_t* this_latent = &latent_presence_range_vec[(v + latent_size) * 2];
 
                 // `l >= 0` takes care of "loose" latent variables (those with no children)
-                for (int32_t l = this_latent[0].item<int32_t>(); l <= this_latent[1].item<int32_t>() && l >= 0; l++) {
+                for (int32_t l = this_latent[0]; l <= this_latent[1] && l >= 0; l++)
                     latent_neighbors_vec[l].push_back(v);
-                    latent_neighbors_count++;
-                }
             }
 
             // Create the latent neighbors data
-            this->latent_neighbors = torch::zeros(latent_neighbors_count, options);
-            this->latent_neighbors_bases = torch::zeros(latent_neighbors_vec.size() + 1, options);
-
-            for (int32_t l = 0, idx = 0; l < latent_neighbors_vec.size(); ) {
-                for (int32_t i : latent_neighbors_vec[l])
-                    this->latent_neighbors[idx++] = i;
+            std::vector<int32_t>& latent_neighbors_flat = indices.latent_neighbors;
+            std::vector<int32_t>& latent_neighbors_bases_vec = indices.latent_neighbors_bases;
+            latent_neighbors_bases_vec.assign(1, 0);
 
+            for (int32_t l = 0; l < latent_neighbors_vec.size(); l++) {
+                latent_neighbors_flat.insert(latent_neighbors_flat.end(), latent_neighbors_vec[l].begin(), latent_neighbors_vec[l].end());
+                latent_neighbors_bases_vec.push_back(latent_neighbors_flat.size());
                 this->layers_vec[l].lat_width = latent_neighbors_vec[l].size();
-                this->latent_neighbors_bases[++l] = idx;
             }
+
+            indices.latent_presence_range = std::move(latent_presence_range_vec);
+            this->make_latent_slots();
+            this->wide_indices = needs_wide_indices(latent_size, visible_size, num_latent_slots, this->num_layers());
+        }
+
+        private:
+        /**
+         * Assigns the latent variables to the slots of the backward buffers, so that the latent variables of the
+         * same layer have different slots. Each latent variable is present in an interval of layers; the intervals
+         * are coloured greedily in the order of their first layers, which takes as many slots as the widest layer.
+         */
+        void make_latent_slots() {
+            const std::vector<int32_t>& range = this->host_indices.latent_presence_range;
+            std::vector<int32_t>& slots = this->host_indices.latent_slots;
+            std::vector<int32_t> order;
+            std::vector<int32_t> slot_ends;     // The last layer of the latent variable in every slot
+            slots.assign(latent_size, 0);
+
+            for (int32_t v = 0; v < latent_size; v++)
+                if (range[v * 2] >= 0)          // Loose latent variables are in no layer
+                    order.push_back(v);
+
+            std::stable_sort(order.begin(), order.end(), [&] (int32_t u, int32_t v) { return range[u * 2] < range[v * 2]; });
+
+            for (const int32_t v : order) {
+                const auto free_slot = std::find_if(slot_ends.begin(), slot_ends.end(), [&] (int32_t end) { return end < range[v * 2]; });
+
+                if (free_slot == slot_ends.end()) {
+                    slots[v] = slot_ends.size();
+                    slot_ends.push_back(range[v * 2 + 1]);
+                } else {
+                    slots[v] = free_slot - slot_ends.begin();
+                    *free_slot = range[v * 2 + 1];
+                }
+            }
+
+            this->num_latent_slots = slot_ends.size();
+        }
+
+        private:
+        /**
+         * Enables the low-rank Kullback-Leibler path when every visible variable has a latent variable of its own
+         * and the remaining latent variables are few; then log det(Σ) and Σ⁻¹ come from an |L'|×|L'| system.
+         */
+        void make_low_rank_structures() {
+            const auto&& latent_structure = this->structure.index({Slice(None, this->latent_size), Slice()});
+            const auto num_children = latent_structure.sum(1);
+            this->private_latents = torch::nonzero(num_children == 1).flatten();
+            this->shared_latents = torch::nonzero(num_children > 1).flatten();
+            this->private_children = latent_structure.index({this->private_latents}).to(torch::kInt32).argmax(1);
+
+            const bool diagonal_covered = torch::zeros(this->visible_size, latent_structure.options())
+                    .index_fill_(0, this->private_children, true).all().item<bool>();
+
+            // The deterministic mode on the host computes the loss from Σ by `deterministic_loss_proxy` instead
+            this->low_rank = this->loss_function && typeid(*this->loss_function) == typeid(KullbackLeibler) &&
+                             diagonal_covered && this->shared_latents.numel() * LOW_RANK_RATIO <= this->visible_size &&
+                             !(this->deterministic && this->on_host());
+            this->low_rank_check_due = true;
+
+            if (this->low_rank) {
+                const auto&& visible_structure = this->structure.index({Slice(this->latent_size, None), Slice()});
+                const auto diagonal = torch::eye(this->visible_size, visible_structure.options());
+                this->transformation_edges = torch::nonzero(visible_structure.logical_or(diagonal)).t();
+            }
+        }
+
+        private:
+        LowRankFactors make_low_rank_factors() {
+            // Only the edges of the structure enter D, F and I - B
+            const auto weights = this->weights.mul(this->structure).to(this->get_loss_dtype());
+            const auto&& latent_weights = weights.index({Slice(None, this->latent_size), Slice()});
+            const auto&& visible_weights = weights.index({Slice(this->latent_size, None), Slice()});
+            const auto private_weights = latent_weights.index({this->private_latents, this->private_children});
+            const auto rows = this->transformation_edges[0];
+            const auto columns = this->transformation_edges[1];
+            const auto transformation_values = visible_weights.index({rows, columns}).neg_().add_(rows == columns);
+
+            return {
+                torch::sparse_coo_tensor(this->transformation_edges, transformation_values,
+                                         {this->visible_size, this->visible_size})._coalesced_(true),
+                torch::zeros(this->visible_size, weights.options()).index_add_(0, this->private_children, private_weights.square()),
+                latent_weights.index({this->shared_latents})
+            };
+        }
+
+        private:
+        /**
+         * @return whether the loss is computed from `low_rank_factors`; a private latent variable with a zero weight
+         *         makes D singular, and the loss of the pass is then computed from Σ as without `low_rank`
+         */
+        inline bool uses_low_rank() const {
+            return this->low_rank && this->low_rank_factors_valid;
+        }
+
+        private:
+        inline KullbackLeibler& get_low_rank_loss_function() {
+            return static_cast<KullbackLeibler&>(*this->loss_function);
         }
 
         private:
         inline void init_data() {
-            AT_DISPATCH_FLOATING_TYPES(dtype, "DeviceData::init", ([&] {
-                this->data = DeviceData<scalar_t>(
-                        structure.data_ptr<bool>(),
-                        try_get_data_ptr<scalar_t>(lambda),
-                        try_get_data_ptr<scalar_t>(weights),
-                        try_get_data_ptr<scalar_t>(covariance),
-                        try_get_data_ptr<scalar_t>(weights.mutable_grad()),
-                        try_get_data_ptr<scalar_t>(weights_accum),
-                        try_get_data_ptr<scalar_t>(covariance.mutable_grad()),
-                        try_get_data_ptr<scalar_t>(omegas),
-
-                        parents.data_ptr<int32_t>(),
-                        parents_bases.data_ptr<int32_t>(),
-                        children.data_ptr<int32_t>(),
-                        children_bases.data_ptr<int32_t>(),
-                        latent_neighbors.data_ptr<int32_t>(),
-                        latent_neighbors_bases.data_ptr<int32_t>(),
-
-                        latent_presence_range.data_ptr<int32_t>(),
-                        visible_size,
-                        latent_size,
-                        num_layers()
-                );
+            SN2_DISPATCH_FLOATING_TYPES(dtype, "DeviceData::init", ([&] {
+                SN2_DISPATCH_DATA_TYPES(this->wide_indices, this->mixed_precision, ([&] {
+                    this->data = DeviceData<scalar_t, index_t, accscalar_t>(
+                            structure.data_ptr<bool>(),
+                            try_get_data_ptr<scalar_t>(lambda),
+                            try_get_data_ptr<scalar_t>(weights),
+                            try_get_data_ptr<scalar_t>(covariance),
+                            try_get_data_ptr<scalar_t>(weights.mutable_grad()),
+                            try_get_data_ptr<scalar_t>(weights_accum),
+                            try_get_data_ptr<scalar_t>(covariance.mutable_grad()),
+                            try_get_data_ptr<scalar_t>(omegas),
+
+                            parents.data_ptr<int32_t>(),
+                            parents_bases.data_ptr<int32_t>(),
+                            children.data_ptr<int32_t>(),
+                            children_bases.data_ptr<int32_t>(),
+
+                            latent_presence_range.data_ptr<int32_t>(),
+                            latent_slots.data_ptr<int32_t>(),
+                            lambda_blocks.empty() ? nullptr : lambda_row_maps.data_ptr<int32_t>(),
+                            visible_size,
+                            latent_size,
+                            num_latent_slots,
+                            num_layers()
+                    );
+                }));
             }));
         }
 
+        private:
+        /**
+         * Calls `function(layers_vec, data)` with the layers and the index buffers of the structure on the host.
+         */
+        template <typename Function>
+        auto with_host_structure(const Function& function) {
+            const auto& indices = this->host_indices;
+            std::vector<LayerData> host_layers_vec = this->layers_vec;
+
+            for (int32_t l = 0; l < this->num_layers(); l++)
+                host_layers_vec[l].lat_vars = indices.latent_neighbors.data() + indices.latent_neighbors_bases[l];
+
+            // Only the index arrays are read; the offsets are taken in 64 bits, as the structure is read once
+            const DeviceData<float, int64_t> host_data(
+                    nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+                    indices.parents.data(),
+                    indices.parents_bases.data(),
+                    indices.children.data(),
+                    indices.children_bases.data(),
+                    indices.latent_presence_range.data(),
+                    indices.latent_slots.data(),
+                    nullptr,
+                    visible_size,
+                    latent_size,
+                    num_latent_slots,
+                    num_layers()
+            );
+
+            return function(host_layers_vec, host_data);
+        }
+
+        private:
+        /**
+         * Partitions the work of every layer by edges (see `WorkPartition`).
+         */
+        WorkPartition make_work_partition() {
+            return this->with_host_structure([] (const std::vector<LayerData>& layers_vec, const DeviceData<float, int64_t>& data) {
+                return WorkPartition(layers_vec, data);
+            });
+        }
+
+        private:
+        /**
+         * Picks the method with the lowest estimated cost (see `MethodCosts`); with `trial_iterations > 0`, the
+         * estimates are replaced by the time of as many forward and backward passes of a solver with every method.
+         * The trial solvers take the options of this one (`memory_budget`, `mmap_directory`, `mixed_precision` and
+         * `deterministic`), run one after another, and free their arenas rather than leave them in `BufferPool`.
+         */
+        METHODS select_method(int64_t trial_iterations) {
+            const int32_t scalar_size = torch::elementSize(this->dtype);
+            this->method_costs = this->with_host_structure([&] (const std::vector<LayerData>& layers_vec, const DeviceData<float, int64_t>& data) {
+                return MethodCosts(layers_vec, data, scalar_size, !this->on_host());
+            });
+
+            if (trial_iterations > 0) {
+                const auto sample_covariance = torch::eye(this->visible_size, this->weights.options());
+                const std::pair<METHODS, MethodCost*> candidates[] = {
+                        {METHODS::COVAR, &this->method_costs.covar},
+                        {METHODS::ACCUM, &this->method_costs.accum},
+                        {METHODS::TRISOLVE, &this->method_costs.trisolve}
+                };
+
+                for (const auto& [candidate_method, cost] : candidates) {
+                    SN2Solver candidate(
+                            this->structure, this->weights, sample_covariance, this->dtype, nullptr, candidate_method,
+                            /*validate=*/false, /*presolve=*/false, this->device, /*trial_iterations=*/0,
+                            this->memory_budget, this->mmap_directory, this->mixed_precision,
+                            /*promotion_threshold=*/0.0, this->deterministic
+                    );
+
+                    if (candidate.pool_lease)
+                        candidate.pool_lease->discard();
+
+                    candidate.forward();
+                    candidate.backward();
+                    candidate.synchronize();
+
+                    const auto start = std::chrono::steady_clock::now();
+
+                    for (int64_t t = 0; t < trial_iterations; t++) {
+                        candidate.forward();
+                        candidate.backward();
+                    }
+
+                    candidate.synchronize();
+                    cost->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / trial_iterations;
+                    cost->measured = true;
+                }
+            }
+
+            return static_cast<METHODS>(this->method_costs.get_cheapest());
+        }
+
+        private:
+        void synchronize() {
+            if (!this->on_host())
+                at::cuda::getCurrentCUDAStream(this->device.index()).synchronize();
+        }
+
+        private:
+        /**
+         * Builds the execution plan of the structure: the launch configurations of every layer on CUDA, or the task
+         * graphs on the CPU. The plan is replayed by every forward and backward pass.
+         */
+        void make_plan() {
+            // The dense method runs no kernels
+            if (this->method == METHODS::TRISOLVE && !this->stochastic_loss_function)
+                return;
+
+            if (this->on_host()) {
+                SN2_DISPATCH_FLOATING_TYPES(dtype, "SN2Solver::make_plan", ([&] {
+                    SN2_DISPATCH_DATA_TYPES(this->wide_indices, this->mixed_precision, ([&] {
+                        this->host_plan = std::make_shared<host::HostPlan<scalar_t, index_t, accscalar_t>>(
+                                this->layers_vec, std::get<DeviceData<scalar_t, index_t, accscalar_t>>(this->data), this->lambda_blocks,
+                                this->mmap_directory.has_value(), this->deterministic
+                        );
+                    }));
+                }));
+            } else {
+                this->device_plan = make_device_plan(
+                        this->layers_vec, this->make_work_partition(), this->lambda_blocks, this->latent_size, this->visible_size, this->device.index()
+                );
+            }
+        }
+
         private:
         /**
          * Returns the data_ptr of a (sub-)tensor; returns nullptr if tensor is not defined.
@@ -331,10 +1255,36 @@ namespace sn2_cuda {
          * SN2Solver constructor.
          * @param structure a vertical matrix of `bool` values indicating the structure of the AMASEM
          * @param parameters the initial parameters of the AMASEM
-         * @param dtype the type of matrices used for calculations: `torch::kFloat` or `torch::kDouble`
+         * @param dtype the type of matrices used for calculations: `torch::kFloat` or `torch::kDouble`, or on the CPU
+         *              `torch::kBFloat16`, which stores the buffers in `bfloat16` but accumulates the sums of the passes,
+         *              and computes the loss and its gradient, in `float`
          * @param loss_function any subclass of `LossBase`
-         * @param method The method used for calculating the derivatives
+         * @param method The method used for calculating the derivatives; `METHODS::NONE` with `StochasticKullbackLeibler`
          * @param validate Apply extra validations; set `false` to avoid unneccesary calculations
+         * @param presolve Remove and merge redundant latent variables (see `ModelReduction`) before solving;
+         *                 `weights` then refers to the reduced structure and `expanded_weights_` to the original one
+         * @param device the device on which the solver runs; CUDA if available and not given
+         * @param trial_iterations with `METHODS::AUTO`, the number of timed passes of every method that replace the
+         *                         estimated costs; 0 to rely on the estimates only
+         * @param memory_budget with `METHODS::COVAR`, the bytes of lambda to keep; if lambda is larger, the backward
+         *                      pass recomputes it in blocks of layers (see `make_lambda_blocks`). 0 for no limit
+         * @param mmap_directory a directory in which to map the buffers from a temporary file, for models whose
+         *                       buffers exceed the memory; only on the CPU. The layers are then run in streaming order
+         * @param mixed_precision with `torch::kFloat`, keep the weights and the buffers in `float` but accumulate the
+         *                        sums of the passes in `double`, and compute the loss and its gradient in `double`
+         * @param promotion_threshold with `torch::kFloat` or `torch::kBFloat16`, switch to `double` (see `promote`)
+         *                            once a check of `fit` finds that the loss decreased, but by less than this
+         *                            fraction, since the previous check; 0 to keep the dtype. `loss` never reads the
+         *                            loss on the host; loops other than `fit` call `promote` themselves
+         * @param deterministic on the CPU, compute the passes of the solver, and the dense products of the methods,
+         *                      with sums in an order that depends neither on the number of threads nor on the vector
+         *                      instructions of the CPU (see `simd::fixed`). `KullbackLeibler` then takes Σ⁻¹ and
+         *                      log det Σ from a Cholesky factorization of the same fixed sums, in place of LAPACK and
+         *                      of the low-rank path. The other losses are still computed by torch, which may depend
+         *                      on the number of threads; fix it with `torch.set_num_threads` for fits that are
+         *                      reproducible bit for bit. The CUDA kernels always sum in a fixed order
+         * @param initialization how to initialize the weights when `parameters` is not given;
+         *                       `INITIALIZATIONS::REGRESSION` needs `sample_covariance`
          */
         SN2Solver(
                 torch::Tensor structure,
@@ -343,35 +1293,239 @@ namespace sn2_cuda {
                 torch::Dtype dtype = torch::kFloat,
                 std::shared_ptr<LossBase> loss_function = nullptr,
                 METHODS method = METHODS::COVAR,
-                bool validate = true
+                bool validate = true,
+                bool presolve = false,
+                std::optional<torch::Device> device = std::nullopt,
+                int64_t trial_iterations = 0,
+                int64_t memory_budget = 0,
+                std::optional<std::string> mmap_directory = std::nullopt,
+                bool mixed_precision = false,
+                double promotion_threshold = 0.0,
+                bool deterministic = false,
+                INITIALIZATIONS initialization = INITIALIZATIONS::RANDOM
         ) {
+            TORCH_CHECK(memory_budget >= 0, STRINGIFY(memory_budget) " must not be negative.")
+            TORCH_CHECK(promotion_threshold >= 0.0, STRINGIFY(promotion_threshold) " must not be negative.")
+            TORCH_CHECK(!mixed_precision || !std::dynamic_pointer_cast<StochasticKullbackLeibler>(loss_function),
+                        STRINGIFY(mixed_precision) " is not supported with " STRINGIFY(StochasticKullbackLeibler) ".")
+            TORCH_CHECK(dtype != torch::kBFloat16 || !std::dynamic_pointer_cast<StochasticKullbackLeibler>(loss_function),
+                        STRINGIFY(torch::kBFloat16) " is not supported with " STRINGIFY(StochasticKullbackLeibler) ".")
+            this->memory_budget = memory_budget;
+            this->mmap_directory = std::move(mmap_directory);
+            this->mixed_precision = mixed_precision && dtype == torch::kFloat;  // `double` solvers accumulate in `double`
+            this->promotion_threshold = promotion_threshold;
+            this->deterministic = deterministic;
+            this->last_loss = std::numeric_limits<double>::quiet_NaN();
+
+            if (presolve) {
+                auto reduction = std::make_shared<ModelReduction>(structure);
+
+                // An irreducible structure is solved as it is, without mapping the weights back and forth
+                if (!reduction->is_identity()) {
+                    this->reduction = std::move(reduction);
+
+                    if (parameters.has_value())
+                        parameters = this->reduction->reduce(parameters.value().to(dtype));
+
+                    structure = this->reduction->get_structure();
+                }
+            }
+
+            if (!parameters.has_value() && initialization == INITIALIZATIONS::REGRESSION) {
+                TORCH_CHECK(sample_covariance.has_value(), STRINGIFY(INITIALIZATIONS::REGRESSION) " needs " STRINGIFY(sample_covariance) ".")
+                parameters = WarmStart(structure, sample_covariance.value()).get_weights();
+            }
+
             this->init_parameters(
                     structure,
                     parameters.has_value() ? parameters.value() : torch::Tensor(),
                     sample_covariance.has_value() ? sample_covariance.value() : torch::Tensor(),
-                    dtype, loss_function, method, validate
+                    dtype, loss_function, method, validate, device
             );
 
+            TORCH_CHECK(!this->mmap_directory.has_value() || this->on_host(),
+                        STRINGIFY(mmap_directory) " is supported on the CPU only; consider " STRINGIFY(device="cpu") ".")
             this->make_structures();
+            this->make_low_rank_structures();
+            this->init_method(trial_iterations);
+            this->init_arena();
             this->init_data();
+            this->make_plan();
         }
 
         public:
+        /**
+         * @return the loss, without reading it on the host
+         */
         inline torch::Tensor loss() {
             loss_function->check_has_sample_covariance();
-            return loss_function->loss(visible_covariance);
+
+            if (stochastic_loss_function)
+                return stochastic_loss_function->operator_loss(StructuredCovariance(*this));
+
+            if (uses_low_rank())
+                return get_low_rank_loss_function().low_rank_loss(visible_covariance.to(get_loss_dtype()), low_rank_factors);
+
+            if (has_deterministic_loss())
+                return deterministic_loss(visible_covariance.to(get_loss_dtype()));
+
+            return loss_function->loss(visible_covariance.to(get_loss_dtype()));
+        }
+
+        private:
+        /**
+         * @return whether the solver is to be promoted (see `promotion_threshold`) after `current_loss`: the loss
+         *         decreased, relative to its previous value, by less than `promotion_threshold`; a loss that increased
+         *         does not count
+         */
+        bool is_precision_stalled(double current_loss) {
+            if (this->promotion_threshold <= 0.0 || this->dtype == torch::kDouble)
+                return false;
+
+            const double decrease = (this->last_loss - current_loss) / std::abs(this->last_loss);
+            this->last_loss = current_loss;
+
+            // The first loss has no previous one; the decrease is then NaN. A loss that went up is noise of the optimizer
+            return decrease >= 0.0 && decrease < this->promotion_threshold;
+        }
+
+        public:
+        /**
+         * Switches a `float` or `bfloat16` solver to `double`. The buffers are laid out again in `double`, and the
+         * weights, their gradient and the tensors of `state` are converted in place, keeping their identity; an
+         * optimizer of the weights therefore keeps its state. Only the tensors of `state` of the size of the weights
+         * are converted, such as the moments of `torch.optim` optimizers, not their step counts.
+         * The forward pass is run again, since the new buffers start zeroed; a `backward` may follow right away.
+         */
+        void promote(const std::vector<torch::Tensor>& state = {}) {
+            if (this->dtype == torch::kDouble)
+                return;
+
+            torch::Tensor weights = this->weights;      // Held by the user, and possibly by an optimizer
+            const torch::Tensor weights_grad = weights.grad().to(torch::kDouble);
+            this->dtype = torch::kDouble;
+            this->mixed_precision = false;
+            this->weights = weights.to(torch::kDouble);
+
+            if (this->has_sample_covariance())
+                this->set_sample_covariance(this->get_sample_covariance());
+
+            // The rows of lambda are twice as large; the blocks are laid out for the same budget
+            if (!this->lambda_blocks.empty()) {
+                this->lambda_blocks.clear();
+                this->host_indices.lambda_rows.clear();
+                this->host_indices.lambda_row_maps.clear();
+                this->make_lambda_blocks();
+            }
+
+            this->init_arena();
+            this->weights.mutable_grad().copy_(weights_grad);
+            weights.set_data(this->weights);
+            weights.mutable_grad() = this->weights.grad();
+            this->weights = weights;
+            this->init_data();
+            this->make_plan();
+
+            for (const torch::Tensor& tensor : state)
+                if (tensor.is_floating_point() && tensor.sizes() == weights.sizes())
+                    tensor.set_data(tensor.to(torch::kDouble));
+
+            this->forward();
+        }
+
+        public:
+        /**
+         * @param state the tensors that the automatic promotion of `fit` (see `promotion_threshold`) converts along
+         *        with the weights; see `promote`
+         */
+        void set_promotion_state(const std::vector<torch::Tensor>& state) {
+            this->promotion_state = state;
+        }
+
+        public:
+        const std::vector<torch::Tensor>& get_promotion_state() const {
+            return this->promotion_state;
+        }
+
+        public:
+        /**
+         * Removes `edges`, a `bool` matrix of the size of the structure, from the structure, and builds the parents,
+         * the children, the layers and the plan again, so that the passes skip them. The weights and their gradient
+         * keep their identity, as with `promote`; the removed weights are zeroed. The forward pass is run again, since
+         * the new buffers start zeroed.
+         * @return the number of edges removed
+         */
+        int64_t prune(const torch::Tensor& edges) {
+            TORCH_CHECK(edges.sizes() == this->structure.sizes(), STRINGIFY(edges) " must be of the same size as " STRINGIFY(structure) ".")
+            const torch::Tensor removed = this->structure.logical_and(edges.to(this->structure.device(), torch::kBool));
+            const int64_t num_removed = removed.sum().item<int64_t>();
+
+            if (num_removed == 0)
+                return 0;
+
+            const torch::Tensor structure = this->structure.logical_and(removed.logical_not());
+            TORCH_CHECK(!this->validate || structure.index({Slice(None, this->latent_size), Slice()}).any(0).all().item<bool>(),
+                        "All visible variables must be connected to at least one latent variable.")
+
+            torch::Tensor weights = this->weights;      // Held by the user, and possibly by an optimizer
+            const torch::Tensor weights_grad = weights.grad().masked_fill(removed, 0.0);
+            this->weights = weights.masked_fill(removed, 0.0);
+            this->structure = structure;
+            this->host_indices = {};
+            this->lambda_blocks.clear();
+            this->layers_vec.clear();
+
+            this->make_structures();
+            this->make_low_rank_structures();
+            this->init_method(0);
+            this->init_arena();
+            this->weights.mutable_grad().copy_(weights_grad);
+            weights.set_data(this->weights);
+            weights.mutable_grad() = this->weights.grad();
+            this->weights = weights;
+            this->init_data();
+            this->make_plan();
+            this->forward();
+            return num_removed;
         }
 
         public:
         inline torch::Tensor loss_proxy() {
             loss_function->check_has_sample_covariance();
-            return loss_function->loss_proxy(visible_covariance);
+
+            if (stochastic_loss_function)
+                return stochastic_loss_function->operator_loss_proxy(StructuredCovariance(*this));
+
+            if (uses_low_rank())
+                return get_low_rank_loss_function().low_rank_loss_proxy(visible_covariance.to(get_loss_dtype()), low_rank_factors);
+
+            if (has_deterministic_loss())
+                return deterministic_loss_proxy(visible_covariance.to(get_loss_dtype()));
+
+            return loss_function->loss_proxy(visible_covariance.to(get_loss_dtype()));
         }
 
         private:
         inline void loss_backward(torch::Tensor&& visible_covariance_grad) {
             loss_function->check_has_sample_covariance();
-            loss_function->loss_backward(visible_covariance, visible_covariance_grad);
+            // Unless the loss is in the dtype of the buffers, the gradient is computed in its dtype and rounded into the buffer
+            const bool rounded = this->get_loss_dtype() != this->dtype;
+            torch::Tensor loss_grad = rounded ? torch::empty_like(visible_covariance_grad, this->get_loss_dtype()) : visible_covariance_grad;
+
+            if (uses_low_rank())
+                get_low_rank_loss_function().low_rank_loss_backward(low_rank_factors, loss_grad);
+            else if (has_deterministic_loss())
+                deterministic_loss_backward(visible_covariance.to(get_loss_dtype()), loss_grad);
+            else
+                loss_function->loss_backward(visible_covariance.to(get_loss_dtype()), loss_grad);
+
+            if (rounded)
+                visible_covariance_grad.copy_(loss_grad);
+        }
+
+        public:
+        inline bool is_low_rank() const {
+            return this->low_rank;
         }
 
         private:
@@ -384,14 +1538,14 @@ namespace sn2_cuda {
         private:
         inline torch::Tensor get_output_omega() {
 //            return omegas[(this->num_layers() + 1) % 2];
-            return omegas.index({(this->num_layers() + 1) % 2, Slice(), Slice(latent_size, None)});
+            return omegas.index({(this->num_layers() + 1) % 2, Slice(), Slice(num_latent_slots, None)});
         }
 
         public:
         torch::Tensor get_lv_transformation() {
-            TORCH_CHECK(this->method == METHODS::ACCUM,
+            TORCH_CHECK(this->method == METHODS::ACCUM || this->method == METHODS::TRISOLVE,
                         STRINGIFY(weights_accum) " is not computed when " STRINGIFY(method) " is set to " STRINGIFY(METHODS::COVAR)
-                        ". Consider initializing " STRINGIFY(SN2Solver) " with " STRINGIFY(METHODS::ACCUM) ".")
+                        ". Consider initializing " STRINGIFY(SN2Solver) " with " STRINGIFY(METHODS::ACCUM) " or " STRINGIFY(METHODS::TRISOLVE) ".")
             return this->weights_accum;
         }
 
@@ -403,7 +1557,7 @@ namespace sn2_cuda {
         public:
         void set_sample_covariance(const torch::Tensor& sample_covariance) {
             TORCH_CHECK(sample_covariance.size(0) == visible_size, STRINGIFY(sample_covariance) " must be a ", visible_size, "×", visible_size, " matrix.")
-            this->loss_function->set_sample_covariance(sample_covariance.to(this->weights.options()));
+            this->loss_function->set_sample_covariance(sample_covariance.to(this->weights.options().dtype(get_loss_dtype())));
         }
 
         public:
@@ -413,46 +1567,272 @@ namespace sn2_cuda {
 
         private:
         void forward_accum() {
-            AT_DISPATCH_FLOATING_TYPES(dtype, "SN2Solver::forward_accum", ([&] {
-                accum::forward<scalar_t>(this->layers_vec, std::get<DeviceData<scalar_t>>(this->data));
-                torch::matmul_out(visible_covariance, torch::transpose(weights_accum, 0, 1), weights_accum);
+            SN2_DISPATCH_FLOATING_TYPES(dtype, "SN2Solver::forward_accum", ([&] {
+                SN2_DISPATCH_DATA_TYPES(this->wide_indices, this->mixed_precision, ([&] {
+                    if (this->on_host())
+                        this->get_host_plan<scalar_t, index_t, accscalar_t>().accum_forward();
+                    else if constexpr (has_device_kernels<scalar_t>)
+                        accum::forward<scalar_t>(*this->device_plan, std::get<DeviceData<scalar_t, index_t, accscalar_t>>(this->data));
+                }));
             }));
+            this->matmul_into(visible_covariance, torch::transpose(weights_accum, 0, 1), weights_accum);
         }
 
         private:
         void forward_covar() {
-            AT_DISPATCH_FLOATING_TYPES(dtype, "SN2Solver::forward_covar", ([&] {
-                covar::forward<scalar_t>(this->layers_vec, std::get<DeviceData<scalar_t>>(this->data));
+            SN2_DISPATCH_FLOATING_TYPES(dtype, "SN2Solver::forward_covar", ([&] {
+                SN2_DISPATCH_DATA_TYPES(this->wide_indices, this->mixed_precision, ([&] {
+                    if (this->on_host())
+                        this->get_host_plan<scalar_t, index_t, accscalar_t>().covar_forward();
+                    else if constexpr (has_device_kernels<scalar_t>)
+                        covar::forward<scalar_t>(*this->device_plan, std::get<DeviceData<scalar_t, index_t, accscalar_t>>(this->data));
+                }));
             }));
         }
 
+        private:
+        void forward_trisolve() {
+            // A = W_L (I - B)⁻¹ by a triangular solve, and Σ = Aᵀ A, from the edges of the structure only
+            const torch::Tensor weights = this->weights * this->structure;
+            const auto&& latent_weights = weights.index({Slice(None, this->latent_size), Slice()});
+            const auto&& visible_weights = weights.index({Slice(this->latent_size, None), Slice()});
+            this->transformation.copy_(visible_weights).neg_().diagonal().add_(1.0);
+            this->solve_triangular_into(weights_accum, transformation, latent_weights, /*upper=*/true);
+            this->matmul_into(visible_covariance, torch::transpose(weights_accum, 0, 1), weights_accum);
+        }
+
+        private:
+        /**
+         * @param check_low_rank whether to read on the host if D of the low-rank factors is singular (see
+         *        `uses_low_rank`); it is also read after `set_weights` and after the structure changes. Otherwise the
+         *        path of the previous check is kept
+         */
+        void forward_pass(bool check_low_rank) {
+            // With the stochastic loss, Σ is never materialized; products with it are computed on demand from the weights
+            if (this->stochastic_loss_function)
+                return;
+
+            (this->*forward_method)();
+
+            // The factors are taken with Σ, so that the terms of the loss come from the same weights
+            if (this->low_rank) {
+                this->low_rank_factors = this->make_low_rank_factors();
+
+                if (check_low_rank || this->low_rank_check_due) {
+                    this->low_rank_factors_valid = this->low_rank_factors.diagonal.ne(0.0).all().item<bool>();
+                    this->low_rank_check_due = false;
+                }
+            }
+        }
+
         public:
+        /**
+         * Computes Σ without reading anything on the host, but after `set_weights` or a change of the structure: the
+         * low-rank loss keeps the path chosen then (see `uses_low_rank`). Weights updated in place, as by an optimizer,
+         * that zero every latent edge of a variable with a single child make D singular; the loss is then not finite
+         * until `set_weights` is called.
+         */
         void forward() {
-            (this->*forward_method)();
+            this->forward_pass(/*check_low_rank=*/false);
         }
 
         private:
         void backward_accum() {
             torch::Tensor&& output_omega = get_output_omega();
-            torch::matmul_out(output_omega, weights_accum, get_output_covariance_grad());
-            AT_DISPATCH_FLOATING_TYPES(dtype, "SN2Solver::backward_accum", ([&] {
-                accum::backward<scalar_t>(this->layers_vec, std::get<DeviceData<scalar_t>>(this->data));
+            this->matmul_into(output_omega, weights_accum, get_output_covariance_grad());
+            SN2_DISPATCH_FLOATING_TYPES(dtype, "SN2Solver::backward_accum", ([&] {
+                SN2_DISPATCH_DATA_TYPES(this->wide_indices, this->mixed_precision, ([&] {
+                    if (this->on_host())
+                        this->get_host_plan<scalar_t, index_t, accscalar_t>().accum_backward();
+                    else if constexpr (has_device_kernels<scalar_t>)
+                        accum::backward<scalar_t>(*this->device_plan, std::get<DeviceData<scalar_t, index_t, accscalar_t>>(this->data));
+                }));
             }));
         }
 
         private:
         void backward_covar() {
-            AT_DISPATCH_FLOATING_TYPES(dtype, "SN2Solver::backward_covar", ([&] {
-                covar::backward<scalar_t>(this->layers_vec, std::get<DeviceData<scalar_t>>(this->data));
+            SN2_DISPATCH_FLOATING_TYPES(dtype, "SN2Solver::backward_covar", ([&] {
+                SN2_DISPATCH_DATA_TYPES(this->wide_indices, this->mixed_precision, ([&] {
+                    if (this->on_host())
+                        this->get_host_plan<scalar_t, index_t, accscalar_t>().covar_backward();
+                    else if constexpr (has_device_kernels<scalar_t>)
+                        covar::backward<scalar_t>(*this->device_plan, std::get<DeviceData<scalar_t, index_t, accscalar_t>>(this->data));
+                }));
             }));
         }
 
+        private:
+        void backward_trisolve() {
+            // grad W_L = A G (I - B)⁻ᵀ and grad B = Aᵀ grad W_L, on the edges of the structure only
+            torch::Tensor& weights_grad = this->weights.mutable_grad();
+            auto&& latent_grad = weights_grad.index({Slice(None, this->latent_size), Slice()});
+            auto&& visible_grad = weights_grad.index({Slice(this->latent_size, None), Slice()});
+            torch::Tensor omega = torch::empty_like(weights_accum, weights_accum.options().dtype(this->get_loss_dtype()));
+            this->matmul_into(omega, weights_accum, get_output_covariance_grad());
+            this->solve_triangular_into(latent_grad, torch::transpose(transformation, 0, 1), omega, /*upper=*/false);
+            this->matmul_into(visible_grad, torch::transpose(weights_accum, 0, 1), latent_grad);
+            weights_grad.mul_(this->structure);
+        }
+
+        private:
+        void backward_stochastic() {
+            loss_function->check_has_sample_covariance();
+            stochastic_loss_function->operator_loss_backward(StructuredCovariance(*this));
+        }
+
         public:
         void backward() {
-            loss_backward(get_output_covariance_grad());
+            if (!stochastic_loss_function)
+                loss_backward(get_output_covariance_grad());
+
             (this->*backward_method)();
         }
 
+        public:
+        /**
+         * Fits the weights with Adamax (the optimizer of the examples), without reading anything on the host between
+         * two checks of `criteria`: the loss and the norm of the gradient of every iteration are recorded on the device
+         * (see `ConvergenceMonitor`). With `promotion_threshold`, the loss of every check is the one compared, and the
+         * state of the optimizer is promoted along with the weights. Whether D of the low-rank loss is singular is read
+         * at the checks only, and the conjugate-gradient solves of `StochasticKullbackLeibler` read their residuals
+         * every `criteria.cg_check_every` iterations.
+         * With `l1` or `group_l1`, every step is followed by the proximal step of the penalty, scaled by the step of
+         * Adamax: the L1 penalty shrinks every weight by `lr × l1 / u`, with `u` its infinity norm, and the group-L1
+         * penalty shrinks the weights out of every variable as a group, with the smallest step of the group. The edges
+         * of the latent variables with a single child, which stand for the unique variances, are not penalized.
+         * @param criteria when to stop
+         * @param learning_rate the learning rate of Adamax
+         * @param betas the decay rates of the first moment and of the infinity norm of Adamax
+         * @param eps added to the infinity norm of Adamax
+         * @param l1 the weight of the L1 penalty on the edges
+         * @param group_l1 the weight of the penalty on the L2 norms of the rows of the weights
+         * @param prune_after remove (see `prune`) the edges whose weights have stayed at zero for this many iterations
+         *                    at a check; 0 to keep them. An edge is kept if it is the last latent edge of its child
+         */
+        FitReport fit(const FitCriteria& criteria = FitCriteria(), double learning_rate = 1e-3,
+                      std::pair<double, double> betas = {0.9, 0.999}, double eps = 1e-8,
+                      double l1 = 0.0, double group_l1 = 0.0, int64_t prune_after = 0) {
+            TORCH_CHECK(learning_rate > 0.0, STRINGIFY(learning_rate) " must be positive.")
+            TORCH_CHECK(betas.first >= 0.0 && betas.first < 1.0 && betas.second >= 0.0 && betas.second < 1.0,
+                        STRINGIFY(betas) " must be in [0, 1).")
+            TORCH_CHECK(l1 >= 0.0 && group_l1 >= 0.0, STRINGIFY(l1) " and " STRINGIFY(group_l1) " must not be negative.")
+            TORCH_CHECK(prune_after >= 0, STRINGIFY(prune_after) " must not be negative.")
+            loss_function->check_has_sample_covariance();
+            ConvergenceMonitor monitor(criteria, this->weights.device());
+            FitReport::REASONS reason;
+
+            // In `float` for `bfloat16` weights, as `get_loss_dtype`
+            const auto state_options = this->weights.options().dtype(this->dtype == torch::kBFloat16 ? torch::kFloat : this->dtype);
+            const torch::Tensor exp_avg = torch::zeros(this->weights.sizes(), state_options);
+            const torch::Tensor exp_inf = torch::zeros(this->weights.sizes(), state_options);
+            const torch::Tensor zero_iterations = torch::zeros(this->weights.sizes(), this->weights.options().dtype(torch::kInt32));
+            torch::Tensor penalized = this->get_penalized_edges();
+            double beta1_power = 1.0;
+            int64_t num_pruned = 0;
+
+            torch::NoGradGuard no_grad;
+
+            // The conjugate-gradient solves of the stochastic loss read their residuals every `criteria.cg_check_every` iterations
+            const std::shared_ptr<StochasticKullbackLeibler> stochastic_loss_function = this->stochastic_loss_function;
+            const int64_t cg_check_every = stochastic_loss_function ? stochastic_loss_function->cg_check_every : 0;
+            const auto restore_cg_check_every = c10::make_scope_exit([&] {
+                if (stochastic_loss_function)
+                    stochastic_loss_function->cg_check_every = cg_check_every;
+            });
+
+            if (stochastic_loss_function)
+                stochastic_loss_function->cg_check_every = criteria.cg_check_every;
+
+            while (!monitor.check(reason)) {
+                bool refreshed = false;                 // Whether `promote` or `prune` already ran the forward pass
+
+                if (monitor.is_check_due() && this->is_precision_stalled(monitor.get_last_loss())) {
+                    std::vector<torch::Tensor> state = this->promotion_state;
+                    state.insert(state.end(), {exp_avg, exp_inf});
+                    this->low_rank_check_due = true;    // The forward pass of `promote` takes the check of this iteration
+                    this->promote(state);
+                    refreshed = true;
+                }
+
+                if (monitor.is_check_due() && prune_after > 0) {
+                    const torch::Tensor removed = this->structure.logical_and(zero_iterations >= prune_after);
+                    const auto&& latent_structure = this->structure.index({Slice(None, this->latent_size), Slice()});
+                    const auto&& latent_removed = removed.index({Slice(None, this->latent_size), Slice()});
+                    const torch::Tensor orphans = latent_structure.logical_and(latent_removed.logical_not()).any(0).logical_not();
+                    latent_removed.masked_fill_(orphans.unsqueeze(0), false);
+
+                    if (const int64_t num_removed = this->prune(removed); num_removed > 0) {
+                        num_pruned += num_removed;
+                        penalized = this->get_penalized_edges();
+                        exp_avg.masked_fill_(removed, 0.0);
+                        exp_inf.masked_fill_(removed, 0.0);
+                        refreshed = true;
+                    }
+                }
+
+                if (!refreshed)
+                    this->forward_pass(/*check_low_rank=*/monitor.is_check_due() || monitor.get_iterations() == 0);
+                const torch::Tensor loss = this->loss();
+                this->backward();
+
+                const torch::Tensor grad = this->weights.grad().to(exp_avg.scalar_type());
+                monitor.record(loss, grad.norm());
+
+                beta1_power *= betas.first;
+                const double step_size = learning_rate / (1.0 - beta1_power);
+
+                // The weights out of the structure, such as those of the pruned edges, are never moved; the dense method
+                // and the low-rank loss read them
+                exp_avg.lerp_(grad, 1.0 - betas.first).mul_(this->structure);
+                torch::maximum_out(exp_inf, exp_inf.mul_(betas.second), grad.abs().add_(eps));
+
+                if (l1 > 0.0 || group_l1 > 0.0)
+                    this->proximal_step(exp_avg, exp_inf, penalized, step_size, l1, group_l1);
+                else
+                    this->weights.addcdiv_(exp_avg, exp_inf, -step_size);
+
+                if (prune_after > 0)
+                    zero_iterations.add_(1).mul_(this->weights == 0.0);
+            }
+
+            FitReport report = monitor.get_report(reason);
+            report.num_pruned = num_pruned;
+            return report;
+        }
+
+        private:
+        /**
+         * @return the edges that `fit` penalizes: all but those of the latent variables with a single child
+         */
+        torch::Tensor get_penalized_edges() const {
+            return this->structure.index_fill(0, this->private_latents, false);
+        }
+
+        private:
+        /**
+         * Takes an Adamax step of the weights followed by the proximal step of the penalties of `fit`: the soft
+         * threshold of every penalized weight, then the shrinkage of the penalized weights of every row as a group.
+         */
+        void proximal_step(const torch::Tensor& exp_avg, const torch::Tensor& exp_inf, const torch::Tensor& penalized,
+                           double step_size, double l1, double group_l1) {
+            torch::Tensor weights = this->weights.to(exp_avg.scalar_type()).addcdiv_(exp_avg, exp_inf, -step_size);
+
+            if (l1 > 0.0) {
+                const torch::Tensor threshold = exp_inf.reciprocal().mul_(step_size * l1).mul_(penalized);
+                weights = weights.sign().mul_(weights.abs().sub_(threshold).clamp_min_(0.0));
+            }
+
+            if (group_l1 > 0.0) {
+                const torch::Tensor threshold = exp_inf.mul(penalized).amax(1).reciprocal_().mul_(step_size * group_l1);
+                const torch::Tensor norms = weights.mul(penalized).norm(2, 1);
+                const torch::Tensor scales = threshold.div_(norms).neg_().add_(1.0).clamp_min_(0.0);
+                weights = torch::where(penalized, weights * scales.unsqueeze(1), weights);
+            }
+
+            this->weights.copy_(weights);
+        }
+
         public:
         torch::Tensor& get_weights() {
             return this->weights;
@@ -460,7 +1840,27 @@ namespace sn2_cuda {
 
         public:
         void set_weights(const torch::Tensor& weights) {
-            this->weights.copy_(weights);
+            // The weights out of the structure are kept at zero; the dense method reads all of them
+            this->weights.copy_(weights).mul_(this->structure);
+            this->low_rank_check_due = true;
+        }
+
+        public:
+        /**
+         * @return the weights in the layout of the structure given by the user
+         */
+        torch::Tensor get_expanded_weights() {
+            return this->reduction ? this->reduction->expand(this->weights) : this->weights;
+        }
+
+        public:
+        /**
+         * @return the row of every latent variable of the user's structure in the solved structure; -1 if removed
+         */
+        torch::Tensor get_latent_map() {
+            return this->reduction ?
+                   this->reduction->get_latent_map() :
+                   torch::arange(this->latent_size, torch::dtype(torch::kInt64).device(this->weights.device()));
         }
 
         public:
@@ -474,6 +1874,8 @@ namespace sn2_cuda {
 
         public:
         torch::Tensor& get_visible_covariance() {
+            TORCH_CHECK(!this->stochastic_loss_function,
+                        STRINGIFY(visible_covariance) " is not computed when the loss is " STRINGIFY(StochasticKullbackLeibler) ".")
             return this->visible_covariance;
         }
 
@@ -482,9 +1884,25 @@ namespace sn2_cuda {
             TORCH_CHECK(this->method == METHODS::COVAR,
                         STRINGIFY(lambda) " is not computed when " STRINGIFY(method) " is set to " STRINGIFY(METHODS::ACCUM)
                         ". Consider initializing " STRINGIFY(SN2Solver) " with " STRINGIFY(method=METHODS::COVAR) ".")
+            TORCH_CHECK(this->lambda_blocks.empty(),
+                        STRINGIFY(lambda) " is not kept by the forward pass when it exceeds " STRINGIFY(memory_budget) ".")
             return this->lambda;
         }
 
+        public:
+        METHODS get_method() const {
+            return this->method;
+        }
+
+        public:
+        /**
+         * @return the estimated (or measured) costs of the methods; only computed for `METHODS::AUTO`, and empty when
+         *         the loss is `StochasticKullbackLeibler` (see `METHODS::NONE`)
+         */
+        const MethodCosts& get_method_costs() const {
+            return this->method_costs;
+        }
+
         public:
         torch::Tensor& get_omegas() {
             TORCH_CHECK(this->method == METHODS::ACCUM,
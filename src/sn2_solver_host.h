@@ -0,0 +1,823 @@
+#ifndef SN2_SOLVER_HOST_H
+#define SN2_SOLVER_HOST_H
+
+#include "device_data.h"
+#include "host_executor.h"
+#include "simd.h"
+#include <vector>
+#include <utility>
+#include <optional>
+#include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <limits>
+
+namespace sn2_cuda {
+    /*
+     * The host counterparts of the kernels in `sn2_solver_kernel.cu`, for solvers whose tensors live on the CPU.
+     * Each variable is a task of a `TaskGraph`; a task waits only for the variables it reads rather than for the whole
+     * previous layer, except where the alias reads of a method make a row depend on every variable of that layer.
+     */
+    namespace host {
+        /**
+         * Makes a graph that runs `function(v)` for every visible variable `v`, after it has run for the visible
+         * parents of `v` (or for its visible children if `descending`).
+         */
+        template <typename scalar_t, typename index_t, typename accscalar_t, typename Function>
+        TaskGraph make_per_visible_graph(const DeviceData<scalar_t, index_t, accscalar_t>& data, bool descending, const Function& function) {
+            TaskGraph graph;
+
+            for (int32_t v = 0; v < data.get_vis_len(); v++)
+                graph.add_task([function, v] { function(v); });     // The id of the task of `v` is `v`
+
+            for (int32_t v = 0; v < data.get_vis_len(); v++)
+                for (int32_t k = 0; k < data.get_num_all_parents(v); k++) {
+                    const int32_t p = data.get_all_parent(v, k);
+
+                    if (p >= 0) {
+                        if (descending)
+                            graph.add_dependency(v, p);
+                        else
+                            graph.add_dependency(p, v);
+                    }
+                }
+
+            return graph;
+        }
+
+        /**
+         * Adds tasks that run `function(x)` for every `x < width` once `join` (if not negative) is done.
+         * With `num_chunks > 0`, the `x` are split into as many ranges, a task each, so that every task sweeps
+         * consecutive rows of the buffers; otherwise every `x` is a task.
+         * @return the join of the new tasks
+         */
+        template <typename Function>
+        int32_t add_joined_tasks(TaskGraph& graph, int32_t join, int32_t width, int32_t num_chunks, Function function) {
+            const int32_t num_tasks = num_chunks > 0 ? std::min(width, num_chunks) : width;
+            std::vector<int32_t> tasks;
+
+            for (int32_t t = 0; t < num_tasks; t++) {
+                const int32_t begin = int64_t(width) * t / num_tasks;
+                const int32_t end = int64_t(width) * (t + 1) / num_tasks;
+                const int32_t task = graph.add_task([function, begin, end] () mutable {
+                    for (int32_t x = begin; x < end; x++)
+                        function(x);
+                });
+
+                if (join >= 0)
+                    graph.add_dependency(join, task);
+
+                tasks.push_back(task);
+            }
+
+            return graph.add_join(tasks);
+        }
+
+        /**
+         * Makes a graph that runs `function(layer, x)` for every `x < width(layer)` of the layers in `layer_indices`,
+         * one layer after another; see `add_joined_tasks` for `num_chunks`.
+         */
+        template <typename Function, typename Width>
+        TaskGraph make_per_layer_graph(const std::vector<LayerData>& layers_vec, const std::vector<int32_t>& layer_indices, const Width& width, const Function& function, int32_t num_chunks = 0) {
+            TaskGraph graph;
+            int32_t join = -1;
+
+            for (const int32_t l : layer_indices) {
+                const LayerData layer = layers_vec[l];
+                join = add_joined_tasks(graph, join, width(layer), num_chunks, [function, layer] (int32_t x) { function(layer, x); });
+            }
+
+            return graph;
+        }
+
+        namespace covar {
+            template <typename scalar_t, typename index_t, typename accscalar_t>
+            void forward_node(
+                    DeviceData<scalar_t, index_t, accscalar_t>& data,
+                    const simd::Kernels<scalar_t, accscalar_t>& simd_kernels,
+                    const LayerData& layer,
+                    int32_t i
+            ) {
+                /*
+                 * Same as `covar::forward_kernel` for column `i`.
+                 * The covariances of the visible parents of `i` with `j_parent` are gathered from the row of
+                 * `j_parent`; those of the latent parents are read one by one.
+                 */
+                std::vector<int32_t> vis_parents;
+                std::vector<scalar_t> vis_weights;
+                std::vector<std::pair<int32_t, scalar_t>> lat_data;
+
+                for (int32_t k = 0; k < data.get_num_parents(i, layer); k++) {
+                    const int32_t i_parent = data.get_parent(i, k, layer);
+
+                    if (i_parent >= 0) {
+                        vis_parents.push_back(i_parent);
+                        vis_weights.push_back(data.get_weight(i_parent, i, layer));
+                    } else
+                        lat_data.emplace_back(i_parent, data.get_weight(i_parent, i, layer));
+                }
+
+                if (vis_parents.empty() && lat_data.empty())
+                    return;
+
+                for (int32_t y = 0; y < layer.get_num_vars(); y++) {
+                    const int32_t j = data.get_layer_var(y, layer);
+                    const int32_t j_num_parents = data.get_num_parents(j, layer);
+
+                    if (j > i || j_num_parents == 0)
+                        continue;
+
+                    accscalar_t covariance_ij = 0.0;
+
+                    for (int32_t l = 0; l < j_num_parents; l++) {
+                        const int32_t j_parent = data.get_parent(j, l, layer);
+                        const scalar_t j_parent_weight = data.get_weight(j_parent, j, layer);
+                        accscalar_t lambda_il = simd_kernels.gather_dot(
+                                vis_weights.data(), data.get_covariance_row(j_parent), vis_parents.data(), vis_parents.size()
+                        );
+
+                        for (const auto& [i_parent, i_parent_weight] : lat_data)
+                            lambda_il += accscalar_t(i_parent_weight) * data.get_covariance(i_parent, j_parent);
+
+                        data.set_lambda(j_parent, i, lambda_il);
+                        covariance_ij += lambda_il * j_parent_weight;
+                    }
+
+                    data.set_covariance(i, j, covariance_ij);
+                }
+            }
+
+            template <typename scalar_t, typename index_t, typename accscalar_t>
+            void backward_covariance_node(DeviceData<scalar_t, index_t, accscalar_t>& data, const LayerData& layer, int32_t i) {
+                /*
+                 * Same as `covar::backward_covariance_kernel` for row `i`.
+                 */
+                int32_t i_begin, i_end, j_begin, j_end;
+                data.get_children_range(i, i_begin, i_end, layer);
+                std::vector<std::pair<int32_t, scalar_t>> i_data(i_end - i_begin);
+
+                for (int32_t k = 0; k < i_data.size(); k++) {
+                    const int32_t i_child = data.get_child(i, i_begin + k, layer);
+                    i_data[k] = {i_child, data.get_weight(i, i_child, layer)};
+                }
+
+                if (i_data.empty())
+                    return;
+
+                for (int32_t y = 0; y < layer.get_num_vars(); y++) {
+                    const int32_t j = data.get_layer_var(y, layer);
+                    data.get_children_range(j, j_begin, j_end, layer);
+
+                    if (j > i || j_end == j_begin)
+                        continue;
+
+                    accscalar_t covariance_grad_ij = 0.0;
+
+                    for (int32_t l = j_begin; l < j_end; l++) {
+                        const int32_t j_child = data.get_child(j, l, layer);
+                        const scalar_t j_child_weight = data.get_weight(j, j_child, layer);
+
+                        for (const auto& [i_child, i_child_weight] : i_data)
+                            covariance_grad_ij += accscalar_t(i_child_weight)
+                                                * data.get_covariance_grad(i_child, j_child, (layer.idx + 1) % 2)
+                                                * j_child_weight;
+                    }
+
+                    data.set_covariance_grad(i, j, covariance_grad_ij, layer.idx % 2);
+                }
+            }
+
+            template <typename scalar_t, typename index_t, typename accscalar_t>
+            void backward_weights_node(
+                    DeviceData<scalar_t, index_t, accscalar_t>& data,
+                    const simd::Kernels<scalar_t, accscalar_t>& simd_kernels,
+                    const LayerData& layer,
+                    int32_t i
+            ) {
+                /*
+                 * Same as `covar::backward_weights_kernel` for row `i`.
+                 * covariance_grad[k, j] is read down the column of `j` for k < j, and along the row of `j` for k >= j.
+                 */
+                const int8_t buff = (layer.idx + 1) % 2;
+                const int32_t vis_len = data.get_vis_len();
+                const scalar_t* lambda_i = data.get_lambda_row(i);
+                int32_t i_begin, i_end;
+                data.get_children_range(i, i_begin, i_end, layer);
+
+                for (int32_t y = 0; y < i_end; y++) {
+                    const int32_t j = data.get_child(i, y, layer);
+                    accscalar_t weight_grad_ij = simd_kernels.dot_strided(lambda_i, data.get_covariance_grad_row(0, buff) + j, vis_len, j)
+                                            + simd_kernels.dot(lambda_i + j, data.get_covariance_grad_row(j, buff) + j, vis_len - j);
+
+                    // lambda[i, i] is the variance of `i`, which is not stored in the row of lambda
+                    if (i >= 0)
+                        weight_grad_ij += accscalar_t(data.get_lambda(i, i) - lambda_i[i]) * data.get_covariance_grad(i, j, buff);
+
+                    data.set_weight_grad(i, j, weight_grad_ij);
+                }
+            }
+
+            template <typename scalar_t, typename index_t, typename accscalar_t>
+            void recompute_lambda_node(DeviceData<scalar_t, index_t, accscalar_t>& data, const std::vector<LayerData>& layers_vec, int32_t q) {
+                /*
+                 * Recompute the row of `q` of lambda, layer by layer, as the forward pass computes it.
+                 */
+                for (int32_t l = 1; l < layers_vec.size(); l++)
+                    for (int32_t k = layers_vec[l].base; k < layers_vec[l].base + layers_vec[l].num; k++)
+                        data.set_lambda(q, k, data.recompute_lambda(q, k, layers_vec[l]));
+            }
+        }
+
+        namespace accum {
+            template <typename scalar_t, typename index_t, typename accscalar_t>
+            void forward_node(DeviceData<scalar_t, index_t, accscalar_t>& data, int32_t i) {
+                /*
+                 * Compute W^acc[:, i] = Σ_p B[p, i] W^acc[:, p]; the columns of the parents of `i` are computed.
+                 */
+                const int32_t lat_len = data.get_lat_len();
+                std::vector<accscalar_t> w_accum(lat_len, 0.0);
+
+                for (int32_t k = 0; k < data.get_num_all_parents(i); k++) {
+                    const int32_t p = data.get_all_parent(i, k);
+                    const scalar_t weight = data.get_edge_weight(p, i);
+
+                    if (p < 0)
+                        w_accum[p + lat_len] += weight;
+                    else
+                        for (int32_t j = -lat_len; j < 0; j++)
+                            w_accum[j + lat_len] += accscalar_t(weight) * data.get_w_accum(j, p);
+                }
+
+                for (int32_t j = -lat_len; j < 0; j++)
+                    data.set_w_accum(j, i, w_accum[j + lat_len]);
+            }
+
+            template <typename scalar_t, typename index_t, typename accscalar_t>
+            void backward_node(DeviceData<scalar_t, index_t, accscalar_t>& data, int8_t buff, int32_t i) {
+                /*
+                 * Compute Ω[:, i] = Ω_out[:, i] + Σ_c B[i, c] Ω[:, c] in place of Ω_out; the columns of the children
+                 * of `i` are computed. Then dL/dB[p, i] = W^acc[:, p] ⋅ Ω[:, i] for the parents `p` of `i`.
+                 * Unlike the kernels, the omegas of the alias variables are not stored.
+                 */
+                const int32_t lat_len = data.get_lat_len();
+                std::vector<accscalar_t> omega(lat_len);
+                int32_t begin, end;
+                data.get_all_children_range(i, begin, end);
+
+                for (int32_t j = -lat_len; j < 0; j++)
+                    omega[j + lat_len] = data.get_omega(j, i, buff);
+
+                for (int32_t k = begin; k < end; k++) {
+                    const int32_t c = data.get_any_child(k);
+                    const scalar_t weight = data.get_edge_weight(i, c);
+
+                    for (int32_t j = -lat_len; j < 0; j++)
+                        omega[j + lat_len] += accscalar_t(weight) * data.get_omega(j, c, buff);
+                }
+
+                for (int32_t j = -lat_len; j < 0; j++)
+                    data.set_omega(j, i, omega[j + lat_len], buff);
+
+                for (int32_t k = 0; k < data.get_num_all_parents(i); k++) {
+                    const int32_t p = data.get_all_parent(i, k);
+                    accscalar_t weight_grad_pi = 0.0;
+
+                    if (p < 0)
+                        weight_grad_pi = omega[p + lat_len];
+                    else
+                        for (int32_t j = -lat_len; j < 0; j++)
+                            weight_grad_pi += data.get_w_accum(j, p) * omega[j + lat_len];
+
+                    data.set_weight_grad(p, i, weight_grad_pi);
+                }
+            }
+        }
+
+        namespace stochastic {
+            // The operands of a call; the cached graphs read them when they run
+            template <typename scalar_t>
+            struct Operands {
+                const scalar_t* in;
+                scalar_t* out;
+                const scalar_t* left_1;
+                const scalar_t* right_1;
+                const scalar_t* left_2;
+                const scalar_t* right_2;
+                scalar_t alpha;
+                int32_t num_probes;
+            };
+
+            template <typename scalar_t, typename index_t, typename accscalar_t>
+            void solve_node(DeviceData<scalar_t, index_t, accscalar_t>& data, const Operands<scalar_t>& operands, int32_t i) {
+                /*
+                 * Compute ((I - B)⁻¹ in)[i, :]; the rows of the children of `i` are computed.
+                 */
+                const int32_t num_probes = operands.num_probes;
+                scalar_t* out_i = operands.out + index_t(i) * num_probes;
+                int32_t begin, end;
+                data.get_all_children_range(i, begin, end);
+
+                for (int32_t r = 0; r < num_probes; r++)
+                    out_i[r] = operands.in[index_t(i) * num_probes + r];
+
+                for (int32_t k = begin; k < end; k++) {
+                    const int32_t c = data.get_any_child(k);
+                    const scalar_t weight = data.get_edge_weight(i, c);
+
+                    for (int32_t r = 0; r < num_probes; r++)
+                        out_i[r] += weight * operands.out[index_t(c) * num_probes + r];
+                }
+            }
+
+            template <typename scalar_t, typename index_t, typename accscalar_t>
+            void project_node(DeviceData<scalar_t, index_t, accscalar_t>& data, const Operands<scalar_t>& operands, int32_t u) {
+                /*
+                 * Compute (W_L in)[u, :] for the latent variable `u`.
+                 */
+                const int32_t num_probes = operands.num_probes;
+                scalar_t* out_u = operands.out + index_t(u + data.get_lat_len()) * num_probes;
+                int32_t begin, end;
+                data.get_all_children_range(u, begin, end);
+
+                for (int32_t r = 0; r < num_probes; r++)
+                    out_u[r] = 0.0;
+
+                for (int32_t k = begin; k < end; k++) {
+                    const int32_t c = data.get_any_child(k);
+                    const scalar_t weight = data.get_edge_weight(u, c);
+
+                    for (int32_t r = 0; r < num_probes; r++)
+                        out_u[r] += weight * operands.in[index_t(c) * num_probes + r];
+                }
+            }
+
+            template <typename scalar_t, typename index_t, typename accscalar_t>
+            void solve_transposed_projection_node(DeviceData<scalar_t, index_t, accscalar_t>& data, const Operands<scalar_t>& operands, int32_t i) {
+                /*
+                 * Compute ((I - B)⁻ᵀ W_Lᵀ latent_in)[i, :]; the rows of the parents of `i` are computed.
+                 */
+                const int32_t num_probes = operands.num_probes;
+                const int32_t lat_len = data.get_lat_len();
+                scalar_t* out_i = operands.out + index_t(i) * num_probes;
+
+                for (int32_t r = 0; r < num_probes; r++)
+                    out_i[r] = 0.0;
+
+                for (int32_t k = 0; k < data.get_num_all_parents(i); k++) {
+                    const int32_t p = data.get_all_parent(i, k);
+                    const scalar_t weight = data.get_edge_weight(p, i);
+                    const scalar_t* in_p = p < 0 ? operands.in + index_t(p + lat_len) * num_probes : operands.out + index_t(p) * num_probes;
+
+                    for (int32_t r = 0; r < num_probes; r++)
+                        out_i[r] += weight * in_p[r];
+                }
+            }
+
+            template <typename scalar_t, typename index_t, typename accscalar_t>
+            void bilinear_backward_node(DeviceData<scalar_t, index_t, accscalar_t>& data, const Operands<scalar_t>& operands, int32_t i) {
+                /*
+                 * Compute weight_grad at [p, i] for the parents `p` of `i`.
+                 */
+                const int32_t num_probes = operands.num_probes;
+
+                for (int32_t k = 0; k < data.get_num_all_parents(i); k++) {
+                    const int32_t p = data.get_all_parent(i, k);
+                    const index_t p_base = index_t(p + data.get_lat_len()) * num_probes;
+                    accscalar_t weight_grad_pi = 0.0;
+
+                    for (int32_t r = 0; r < num_probes; r++)
+                        weight_grad_pi += accscalar_t(operands.left_1[p_base + r]) * operands.right_1[index_t(i) * num_probes + r]
+                                        + accscalar_t(operands.left_2[p_base + r]) * operands.right_2[index_t(i) * num_probes + r];
+
+                    data.set_weight_grad(p, i, operands.alpha * weight_grad_pi);
+                }
+            }
+        }
+
+        /*
+         * The dense products of the methods for the deterministic mode, in place of the BLAS calls of torch, whose
+         * sums may depend on the number of threads. Every entry of the output is a single dot product of `kernels`,
+         * and every row of the output is a task.
+         */
+        namespace dense {
+            /**
+             * out = a bᵀ for the row-major matrices a (m×k) and b (n×k); `out` is row-major too.
+             */
+            template <typename scalar_t, typename accscalar_t>
+            void matmul_transposed(
+                    const scalar_t* a,
+                    const scalar_t* b,
+                    scalar_t* out,
+                    int32_t m,
+                    int32_t n,
+                    int32_t k,
+                    const simd::Kernels<scalar_t, accscalar_t>& kernels
+            ) {
+                TaskGraph graph;
+
+                for (int32_t i = 0; i < m; i++)
+                    graph.add_task([=, &kernels] {
+                        for (int32_t j = 0; j < n; j++)
+                            out[int64_t(i) * n + j] = kernels.dot(a + int64_t(i) * k, b + int64_t(j) * k, k);
+                    });
+
+                Executor::get_instance().run(graph);
+            }
+
+            /**
+             * out = b a⁻¹ for the m×n matrix b and the n×n unitriangular matrix a, given by the rows of aᵀ; row by
+             * row, out[i, j] = b[i, j] - Σ_t out[i, t] a[t, j] over t < j if `upper`, or over t > j otherwise.
+             */
+            template <typename scalar_t, typename accscalar_t>
+            void solve_unitriangular(
+                    const scalar_t* a_columns,
+                    const scalar_t* b,
+                    scalar_t* out,
+                    int32_t m,
+                    int32_t n,
+                    bool upper,
+                    const simd::Kernels<scalar_t, accscalar_t>& kernels
+            ) {
+                TaskGraph graph;
+
+                for (int32_t i = 0; i < m; i++)
+                    graph.add_task([=, &kernels] {
+                        const scalar_t* b_i = b + int64_t(i) * n;
+                        scalar_t* out_i = out + int64_t(i) * n;
+
+                        for (int32_t s = 0; s < n; s++) {
+                            const int32_t j = upper ? s : n - 1 - s;
+                            const scalar_t* a_j = a_columns + int64_t(j) * n;
+                            out_i[j] = accscalar_t(b_i[j]) - (upper ? kernels.dot(out_i, a_j, j) : kernels.dot(out_i + j + 1, a_j + j + 1, n - j - 1));
+                        }
+                    });
+
+                Executor::get_instance().run(graph);
+            }
+
+            // Rows and columns of the tiles of `cholesky`
+            constexpr int32_t CHOLESKY_BLOCK = 64;
+
+            /**
+             * The lower Cholesky factor l of the n×n symmetric positive-definite matrix a, both row-major:
+             * l[j, j] = √(a[j, j] - Σ_t l[j, t]²) and l[i, j] = (a[i, j] - Σ_t l[i, t] l[j, t]) / l[j, j] over t < j.
+             * The lower triangle is cut into tiles of `CHOLESKY_BLOCK` rows and columns, and every tile is a task of a
+             * single graph; a tile waits for the tile to its left and for the diagonal tile of its columns. Every
+             * entry is a single dot product, whatever the order in which the tiles run. The upper triangle of `l` is
+             * zeroed.
+             * @return whether `a` is positive definite; `l` holds NaN otherwise
+             */
+            template <typename scalar_t, typename accscalar_t>
+            bool cholesky(
+                    const scalar_t* a,
+                    scalar_t* l,
+                    int32_t n,
+                    const simd::Kernels<scalar_t, accscalar_t>& kernels
+            ) {
+                const int32_t num_blocks = (n + CHOLESKY_BLOCK - 1) / CHOLESKY_BLOCK;
+                std::vector<int32_t> tasks(int64_t(num_blocks) * num_blocks, -1);
+                std::atomic<bool> singular{false};
+                TaskGraph graph;
+                std::fill(l, l + int64_t(n) * n, scalar_t(0.0));
+
+                const auto entry = [=, &kernels] (int32_t i, int32_t j) {
+                    const scalar_t* l_i = l + int64_t(i) * n;
+                    const scalar_t* l_j = l + int64_t(j) * n;
+                    l[int64_t(i) * n + j] = (accscalar_t(a[int64_t(i) * n + j]) - kernels.dot(l_i, l_j, j)) / accscalar_t(l_j[j]);
+                };
+
+                for (int32_t bi = 0; bi < num_blocks; bi++)
+                    for (int32_t bj = 0; bj <= bi; bj++) {
+                        const int32_t i_begin = bi * CHOLESKY_BLOCK, i_end = std::min(n, i_begin + CHOLESKY_BLOCK);
+                        const int32_t j_begin = bj * CHOLESKY_BLOCK, j_end = std::min(n, j_begin + CHOLESKY_BLOCK);
+                        int32_t task;
+
+                        if (bi == bj)
+                            task = graph.add_task([=, &kernels, &singular] {
+                                for (int32_t j = j_begin; j < j_end; j++) {
+                                    const scalar_t* l_j = l + int64_t(j) * n;
+                                    const accscalar_t pivot = accscalar_t(a[int64_t(j) * n + j]) - kernels.dot(l_j, l_j, j);
+
+                                    if (!(pivot > accscalar_t(0.0)))
+                                        singular = true;
+
+                                    l[int64_t(j) * n + j] = pivot > accscalar_t(0.0) ? std::sqrt(pivot) : std::numeric_limits<accscalar_t>::quiet_NaN();
+
+                                    for (int32_t i = j + 1; i < i_end; i++)
+                                        entry(i, j);
+                                }
+                            });
+                        else
+                            task = graph.add_task([=] {
+                                for (int32_t j = j_begin; j < j_end; j++)
+                                    for (int32_t i = i_begin; i < i_end; i++)
+                                        entry(i, j);
+                            });
+
+                        tasks[int64_t(bi) * num_blocks + bj] = task;
+
+                        if (bj > 0)
+                            graph.add_dependency(tasks[int64_t(bi) * num_blocks + bj - 1], task);
+
+                        if (bi > bj)
+                            graph.add_dependency(tasks[int64_t(bj) * num_blocks + bj], task);
+                    }
+
+                Executor::get_instance().run(graph);
+                return !singular;
+            }
+
+            /**
+             * out = (l lᵀ)⁻¹ for the factor l of `cholesky`, given with u = lᵀ, all row-major. A task for every row c
+             * of the symmetric `out` solves l y = e_c by forward substitution and lᵀ x = y by back substitution, in
+             * place in the row.
+             */
+            template <typename scalar_t, typename accscalar_t>
+            void cholesky_inverse(
+                    const scalar_t* l,
+                    const scalar_t* u,
+                    scalar_t* out,
+                    int32_t n,
+                    const simd::Kernels<scalar_t, accscalar_t>& kernels
+            ) {
+                TaskGraph graph;
+
+                for (int32_t c = 0; c < n; c++)
+                    graph.add_task([=, &kernels] {
+                        scalar_t* x = out + int64_t(c) * n;
+                        std::fill(x, x + c, scalar_t(0.0));
+
+                        for (int32_t k = c; k < n; k++) {
+                            const scalar_t* l_k = l + int64_t(k) * n;
+                            x[k] = (accscalar_t(k == c ? 1.0 : 0.0) - kernels.dot(l_k + c, x + c, k - c)) / accscalar_t(l_k[k]);
+                        }
+
+                        for (int32_t k = n - 1; k >= 0; k--) {
+                            const scalar_t* u_k = u + int64_t(k) * n;
+                            x[k] = (accscalar_t(x[k]) - kernels.dot(u_k + k + 1, x + k + 1, n - k - 1)) / accscalar_t(u_k[k]);
+                        }
+                    });
+
+                Executor::get_instance().run(graph);
+            }
+
+            /**
+             * @return Σ_ij a[i, j] b[i, j] for the row-major m×n matrices a and b; the rows are summed in order
+             */
+            template <typename scalar_t, typename accscalar_t>
+            accscalar_t frobenius_product(
+                    const scalar_t* a,
+                    const scalar_t* b,
+                    int32_t m,
+                    int32_t n,
+                    const simd::Kernels<scalar_t, accscalar_t>& kernels
+            ) {
+                std::vector<accscalar_t> rows(m);
+                TaskGraph graph;
+
+                for (int32_t i = 0; i < m; i++)
+                    graph.add_task([=, &rows, &kernels] {
+                        rows[i] = kernels.dot(a + int64_t(i) * n, b + int64_t(i) * n, n);
+                    });
+
+                Executor::get_instance().run(graph);
+                accscalar_t sum = 0.0;
+
+                for (const accscalar_t row : rows)
+                    sum += row;
+
+                return sum;
+            }
+        }
+
+        // Class HostPlan
+        /**
+         * The host counterpart of `DevicePlan`: the task graphs of a structure, built on first use and replayed by
+         * every later call. The tasks refer to the members of the plan, so the plan is kept at a fixed address.
+         * @tparam scalar_t `float`, `double` or `c10::BFloat16`
+         * @tparam index_t the offset type of `DeviceData`
+         */
+        template <typename scalar_t, typename index_t = int32_t, typename accscalar_t = scalar_t>
+        class HostPlan {
+            private:
+            enum GRAPHS {
+                COVAR_FORWARD = 0,
+                COVAR_BACKWARD,
+                ACCUM_FORWARD,
+                ACCUM_BACKWARD,
+                SOLVE,
+                PROJECT,
+                SOLVE_TRANSPOSED_PROJECTION,
+                BILINEAR_BACKWARD,
+                NUM_GRAPHS
+            };
+
+            private:
+            std::vector<LayerData> layers_vec;
+            DeviceData<scalar_t, index_t, accscalar_t> data;
+            const simd::Kernels<scalar_t, accscalar_t>& simd_kernels;
+            std::vector<LambdaBlock> lambda_blocks; // Empty if lambda is kept whole by the forward pass
+            int32_t num_chunks;                     // Tasks per layer of the layered passes; 0 for a task per row
+            stochastic::Operands<scalar_t> operands;
+            std::optional<TaskGraph> graphs[NUM_GRAPHS];
+
+            private:
+            template <typename Builder>
+            void run(GRAPHS index, const Builder& builder) {
+                if (!this->graphs[index].has_value())
+                    this->graphs[index] = builder();
+
+                Executor::get_instance().run(this->graphs[index].value());
+            }
+
+            private:
+            TaskGraph make_covar_forward_graph() {
+                // Every row reads the covariances of the whole previous layer through the alias variables;
+                // the layers are therefore joined, while the rows of a layer run as independent tasks.
+                std::vector<int32_t> layer_indices;
+
+                for (int32_t l = 1; l < this->layers_vec.size(); l++)
+                    layer_indices.push_back(l);
+
+                return make_per_layer_graph(
+                        this->layers_vec, layer_indices,
+                        [] (const LayerData& layer) { return layer.get_num_new_vars(); },
+                        [this] (const LayerData& layer, int32_t x) { covar::forward_node(this->data, this->simd_kernels, layer, x + layer.base); },
+                        this->num_chunks
+                );
+            }
+
+            private:
+            TaskGraph make_covar_backward_graph() {
+                std::vector<int32_t> layer_indices;
+
+                for (int32_t l = this->layers_vec.size() - 2; l >= 0; l--)
+                    layer_indices.push_back(l);
+
+                // The covariance gradient and the weights gradient of a row are independent tasks, as in two streams
+                if (this->lambda_blocks.empty())
+                    return make_per_layer_graph(
+                            this->layers_vec, layer_indices,
+                            [] (const LayerData& layer) { return layer.get_num_vars() * 2; },
+                            [this] (const LayerData& layer, int32_t x) {
+                                const int32_t i = this->data.get_layer_var(x / 2, layer);
+
+                                if (x % 2 == 0)
+                                    covar::backward_weights_node(this->data, this->simd_kernels, layer, i);
+                                else if (layer.idx > 0)
+                                    covar::backward_covariance_node(this->data, layer, i);
+                            },
+                            this->num_chunks
+                    );
+
+                // Every block first recomputes its rows of lambda, split into `num_chunks` tasks; the next block
+                // overwrites them, so the blocks are joined as the layers are
+                TaskGraph graph;
+                int32_t join = -1;
+
+                for (const LambdaBlock& block : this->lambda_blocks) {
+                    DeviceData<scalar_t, index_t, accscalar_t> block_data = this->data.with_lambda_rows(block.row_map);
+
+                    join = add_joined_tasks(graph, join, block.num_rows, this->num_chunks, [this, block, block_data] (int32_t x) mutable {
+                        covar::recompute_lambda_node(block_data, this->layers_vec, block.rows[x]);
+                    });
+
+                    for (int32_t l = block.last_layer; l >= block.first_layer; l--) {
+                        const LayerData layer = this->layers_vec[l];
+                        join = add_joined_tasks(graph, join, layer.get_num_vars() * 2, this->num_chunks, [this, layer, block_data] (int32_t x) mutable {
+                            const int32_t i = block_data.get_layer_var(x / 2, layer);
+
+                            if (x % 2 == 0)
+                                covar::backward_weights_node(block_data, this->simd_kernels, layer, i);
+                            else if (layer.idx > 0)
+                                covar::backward_covariance_node(block_data, layer, i);
+                        });
+                    }
+                }
+
+                return graph;
+            }
+
+            private:
+            TaskGraph make_project_graph() {
+                TaskGraph graph;
+
+                for (int32_t u = -this->data.get_lat_len(); u < 0; u++)
+                    graph.add_task([this, u] { stochastic::project_node(this->data, this->operands, u); });
+
+                return graph;
+            }
+
+            private:
+            TaskGraph make_bilinear_backward_graph() {
+                TaskGraph graph;
+
+                for (int32_t i = 0; i < this->data.get_vis_len(); i++)
+                    graph.add_task([this, i] { stochastic::bilinear_backward_node(this->data, this->operands, i); });
+
+                return graph;
+            }
+
+            public:
+            /**
+             * @param lambda_blocks the blocks of layers whose rows of lambda the backward pass recomputes; empty if
+             *        the forward pass keeps lambda whole
+             * @param streaming whether the buffers are mapped from a file; every thread then sweeps one range of
+             *        consecutive rows per layer, so the pages are read in order rather than scattered across threads
+             * @param deterministic whether to use the dot products of a fixed shape (see `simd::fixed`), whose sums
+             *        do not depend on the CPU
+             */
+            HostPlan(
+                    const std::vector<LayerData>& layers_vec,
+                    const DeviceData<scalar_t, index_t, accscalar_t>& data,
+                    const std::vector<LambdaBlock>& lambda_blocks = {},
+                    bool streaming = false,
+                    bool deterministic = false
+            )
+            :   layers_vec(layers_vec),
+                data(data),
+                simd_kernels(simd::get_kernels<scalar_t, accscalar_t>(deterministic)),
+                lambda_blocks(lambda_blocks),
+                num_chunks(streaming ? Executor::get_instance().get_num_threads() : 0),
+                operands()
+            { }
+
+            public:
+            HostPlan(const HostPlan&) = delete;
+            HostPlan& operator=(const HostPlan&) = delete;
+
+            public:
+            void covar_forward() {
+                this->run(COVAR_FORWARD, [this] { return this->make_covar_forward_graph(); });
+            }
+
+            public:
+            void covar_backward() {
+                this->run(COVAR_BACKWARD, [this] { return this->make_covar_backward_graph(); });
+            }
+
+            public:
+            void accum_forward() {
+                this->run(ACCUM_FORWARD, [this] {
+                    return make_per_visible_graph(this->data, false, [this] (int32_t i) { accum::forward_node(this->data, i); });
+                });
+            }
+
+            public:
+            void accum_backward() {
+                const int8_t buff = (this->layers_vec.size() + 1) % 2;
+                this->run(ACCUM_BACKWARD, [this, buff] {
+                    return make_per_visible_graph(this->data, true, [this, buff] (int32_t i) { accum::backward_node(this->data, buff, i); });
+                });
+            }
+
+            public:
+            void solve(const scalar_t* in, scalar_t* out, int32_t num_probes) {
+                this->operands.in = in;
+                this->operands.out = out;
+                this->operands.num_probes = num_probes;
+                this->run(SOLVE, [this] {
+                    return make_per_visible_graph(this->data, true, [this] (int32_t i) { stochastic::solve_node(this->data, this->operands, i); });
+                });
+            }
+
+            public:
+            void project(const scalar_t* in, scalar_t* out, int32_t num_probes) {
+                this->operands.in = in;
+                this->operands.out = out;
+                this->operands.num_probes = num_probes;
+                this->run(PROJECT, [this] { return this->make_project_graph(); });
+            }
+
+            public:
+            void solve_transposed_projection(const scalar_t* latent_in, scalar_t* out, int32_t num_probes) {
+                this->operands.in = latent_in;
+                this->operands.out = out;
+                this->operands.num_probes = num_probes;
+                this->run(SOLVE_TRANSPOSED_PROJECTION, [this] {
+                    return make_per_visible_graph(this->data, false, [this] (int32_t i) { stochastic::solve_transposed_projection_node(this->data, this->operands, i); });
+                });
+            }
+
+            public:
+            void bilinear_backward(
+                    const scalar_t* left_1,
+                    const scalar_t* right_1,
+                    const scalar_t* left_2,
+                    const scalar_t* right_2,
+                    scalar_t alpha,
+                    int32_t num_probes
+            ) {
+                this->operands.left_1 = left_1;
+                this->operands.right_1 = right_1;
+                this->operands.left_2 = left_2;
+                this->operands.right_2 = right_2;
+                this->operands.alpha = alpha;
+                this->operands.num_probes = num_probes;
+                this->run(BILINEAR_BACKWARD, [this] { return this->make_bilinear_backward_graph(); });
+            }
+        };
+    }
+}
+
+#endif
\ No newline at end of file
@@ -1,11 +1,18 @@
 #include <torch/extension.h>
+#include <ATen/cuda/CUDAContext.h>
+#include <c10/cuda/CUDAGuard.h>
 #include "device_data.h"
 #include "kernel_config.h"
+#include "work_partition.h"
+#include "tiny_model.h"
 #include <vector>
 #include <cuda.h>
 #include <cuda_runtime.h>
 #include <cstdio>
 #include <utility>
+#include <type_traits>
+#include <memory>
+#include <optional>
 
 namespace sn2_cuda {
     // A structure for holding a value and its index
@@ -21,6 +28,10 @@ namespace sn2_cuda {
     template <typename scalar_t>
     using child_weight_t = indexed_scalar_t<scalar_t>;
 
+    static_assert(MAX_SEGMENT_SIZE * sizeof(parent_weight_t<double>) <= SHARED_MEMORY_SIZE_FORWARD &&
+                  MAX_SEGMENT_SIZE * sizeof(child_weight_t<double>) <= SHARED_MEMORY_SIZE_BACKWARD,
+                  "A segment of edges must fit the shared memory of a block.");
+
     // A structure for helping chunk arrays, lists, etc.
     class array_chunk {
         private:
@@ -48,31 +59,312 @@ namespace sn2_cuda {
         }
     };
 
+    /**
+     * Loads the `k_max` edges of a segment with `load(k)`. The generic kernels (`max_degree == 0`) stage them in the
+     * shared memory of the block; the kernels specialized for at most `max_degree` edges keep them in the registers of
+     * every thread, with the loop fully unrolled and no barrier.
+     */
+    template <int32_t max_degree, typename edge_t, typename Load>
+    __device__ __forceinline__ void load_edges(edge_t* i_data, const int32_t k_max, const Load& load) {
+        if constexpr (max_degree == 0) {
+            for (int32_t k = threadIdx.y; k < k_max; k += blockDim.y)
+                i_data[k] = load(k);
+
+            __syncthreads();
+        } else {
+            #pragma unroll
+            for (int32_t k = 0; k < max_degree; k++)
+                if (k < k_max)
+                    i_data[k] = load(k);
+        }
+    }
+
+    // Calls `function(k)` for the `k_max` edges of a segment; fully unrolled in the kernels specialized for `max_degree`
+    template <int32_t max_degree, typename Function>
+    __device__ __forceinline__ void for_each_edge(const int32_t k_max, const Function& function) {
+        if constexpr (max_degree == 0) {
+            for (int32_t k = 0; k < k_max; k++)
+                function(k);
+        } else {
+            #pragma unroll
+            for (int32_t k = 0; k < max_degree; k++)
+                if (k < k_max)
+                    function(k);
+        }
+    }
+
+    /**
+     * Calls `launch(std::integral_constant<int32_t, d>())` with the smallest specialized degree `d` not below
+     * `max_degree`, or with `d = 0` (the generic kernel) if `max_degree` is 0 or above `MAX_UNROLLED_DEGREE`.
+     */
+    template <typename Launch>
+    void dispatch_degree(const int32_t max_degree, const Launch& launch) {
+        static_assert(MAX_UNROLLED_DEGREE == 8, "Update the specialized degrees.");
+
+        if (max_degree <= 0 || max_degree > MAX_UNROLLED_DEGREE)
+            launch(std::integral_constant<int32_t, 0>());
+        else if (max_degree <= 1)
+            launch(std::integral_constant<int32_t, 1>());
+        else if (max_degree <= 2)
+            launch(std::integral_constant<int32_t, 2>());
+        else if (max_degree <= 4)
+            launch(std::integral_constant<int32_t, 4>());
+        else
+            launch(std::integral_constant<int32_t, 8>());
+    }
+
     std::pair<dim3, dim3> get_blocks_and_threads(const int32_t width, const int32_t height) {
         const dim3 threads(1, min(height, THREADS_PER_BLOCK));
         const dim3 blocks(width, (height + threads.y - 1) / threads.y);
         return std::make_pair(blocks, threads);
     }
 
+    /**
+     * The two streams of the backward passes and the events that order them without synchronizing the host.
+     * At layer `l`, the propagation kernel (covariance gradient or omega) writes buffer `l % 2` and reads buffer
+     * `(l + 1) % 2`; the weights kernel reads buffer `(l + 1) % 2`. So the weights kernel of layer `l` waits for the
+     * propagation kernel of layer `l + 1`, and the propagation kernel of layer `l` waits for the weights kernel of
+     * layer `l + 1`, which reads the buffer it overwrites.
+     * The streams and events are created once per solver and reused by every backward pass.
+     */
+    class BackwardStreams {
+        public:
+        cudaStream_t stream;                    // The current stream; produces the output gradient, and waits for the result
+        cudaStream_t propagation_stream;
+        cudaStream_t weights_stream;
+
+        private:
+        cudaEvent_t propagation_done;
+        cudaEvent_t weights_done;
+        bool first_layer;
+
+        public:
+        BackwardStreams() {
+            cudaStreamCreateWithFlags(&propagation_stream, cudaStreamNonBlocking);
+            cudaStreamCreateWithFlags(&weights_stream, cudaStreamNonBlocking);
+            cudaEventCreateWithFlags(&propagation_done, cudaEventDisableTiming);
+            cudaEventCreateWithFlags(&weights_done, cudaEventDisableTiming);
+        }
+
+        public:
+        BackwardStreams(const BackwardStreams&) = delete;
+        BackwardStreams& operator=(const BackwardStreams&) = delete;
+
+        public:
+        void begin() {
+            // Both streams start once the output gradient is ready
+            stream = at::cuda::getCurrentCUDAStream();
+            first_layer = true;
+            cudaEventRecord(propagation_done, stream);
+            cudaStreamWaitEvent(propagation_stream, propagation_done, 0);
+            cudaStreamWaitEvent(weights_stream, propagation_done, 0);
+        }
+
+        public:
+        void wait_for_layer() {
+            if (!first_layer) {
+                cudaStreamWaitEvent(weights_stream, propagation_done, 0);
+                cudaStreamWaitEvent(propagation_stream, weights_done, 0);
+            }
+
+            first_layer = false;
+        }
+
+        public:
+        void record_layer() {
+            cudaEventRecord(propagation_done, propagation_stream);
+            cudaEventRecord(weights_done, weights_stream);
+        }
+
+        public:
+        void end() {
+            // The rest of the work on the current stream waits for both streams; the host never does
+            cudaStreamWaitEvent(stream, propagation_done, 0);
+            cudaStreamWaitEvent(stream, weights_done, 0);
+        }
+
+        public:
+        ~BackwardStreams() {
+            cudaEventDestroy(propagation_done);
+            cudaEventDestroy(weights_done);
+            cudaStreamDestroy(propagation_stream);
+            cudaStreamDestroy(weights_stream);
+        }
+    };
+
+    // A precomputed kernel launch; empty if there is nothing to launch
+    struct LaunchConfig {
+        dim3 blocks = dim3(0, 0);
+        dim3 threads = dim3(0, 0);
+
+        bool empty() const {
+            return blocks.x == 0 || blocks.y == 0;
+        }
+    };
+
+    // The launches of a kernel on a layer, over the segments of its edge-balanced partition
+    struct PartitionLaunch {
+        const WorkSegment* segments = nullptr;
+        const SplitRow* split_rows = nullptr;
+        int32_t num_slots = 0;
+        int32_t max_degree = 0;                 // The longest segment; selects the kernel specialized for it
+        LaunchConfig config;                    // One block (column) per segment
+        LaunchConfig reduce_config;             // One block per split row; empty if no row is split
+    };
+
+    /**
+     * Everything about launching the kernels of a structure that does not change between iterations:
+     * the edge-balanced partition and the launch configuration of every kernel on every layer, the buffer of the
+     * partial sums of split rows, and the streams and events of the backward passes.
+     */
+    class DevicePlan {
+        public:
+        std::vector<LayerData> layers_vec;
+        std::vector<PartitionLaunch> covar_forward;
+        std::vector<PartitionLaunch> covar_backward_covariance;
+        std::vector<PartitionLaunch> accum_forward;
+        std::vector<PartitionLaunch> accum_backward_omega;
+        std::vector<PartitionLaunch> backward_weights;
+        std::vector<LambdaBlock> lambda_blocks; // Empty if lambda is kept whole by the forward pass
+        std::vector<std::vector<LaunchConfig>> recompute_lambda;   // Per block and layer: one block per new variable
+        at::Tensor segments;                    // The segments and split rows of all the partitions
+        at::Tensor partial_sums;                // Large enough for the slots of any layer, in `double`
+        int32_t partial_stride;                 // Number of partial sums in a slot
+        BackwardStreams backward_streams;
+
+        public:
+        DevicePlan(
+                const std::vector<LayerData>& layers_vec,
+                const WorkPartition& partition,
+                const std::vector<LambdaBlock>& lambda_blocks,
+                const int32_t lat_len,
+                const int32_t vis_len
+        ):  layers_vec(layers_vec),
+            lambda_blocks(lambda_blocks),
+            partial_stride(lat_len + vis_len)
+        {
+            int32_t max_num_slots = 0;
+
+            for (const auto& layer : layers_vec)
+                partial_stride = std::max(partial_stride, lat_len + vis_len + layer.get_num_vars());
+
+            // Lay out all the segments and split rows in one buffer; the pointers are rebased after the upload
+            std::vector<int32_t> host_segments;
+            std::vector<std::pair<size_t, size_t>> offsets;
+            const auto add = [&] (std::vector<PartitionLaunch>& launches, const LayerPartition& layer_partition, const int32_t height) {
+                PartitionLaunch launch;
+                const auto segments_data = reinterpret_cast<const int32_t*>(layer_partition.segments.data());
+                const auto split_rows_data = reinterpret_cast<const int32_t*>(layer_partition.split_rows.data());
+                const size_t segments_offset = host_segments.size();
+                host_segments.insert(host_segments.end(), segments_data, segments_data + layer_partition.segments.size() * 4);
+                const size_t split_rows_offset = host_segments.size();
+                host_segments.insert(host_segments.end(), split_rows_data, split_rows_data + layer_partition.split_rows.size() * 3);
+
+                launch.num_slots = layer_partition.get_num_slots();
+                launch.max_degree = layer_partition.max_segment_size;
+                launch.config = make_launch_config(layer_partition.segments.size(), height);
+                launch.reduce_config = make_launch_config(layer_partition.split_rows.size(), THREADS_PER_BLOCK);
+                max_num_slots = std::max(max_num_slots, launch.num_slots);
+                launches.push_back(launch);
+                offsets.emplace_back(segments_offset, split_rows_offset);
+            };
+
+            for (int32_t l = 0; l < layers_vec.size(); l++) {
+                const auto& layer = layers_vec[l];
+                add(covar_forward, partition.parents[l], layer.get_num_vars());
+                add(covar_backward_covariance, partition.children[l], layer.get_num_vars());
+                add(accum_forward, partition.parents[l], lat_len);
+                add(accum_backward_omega, partition.children[l], lat_len);
+                add(backward_weights, partition.weights[l], partition.weights[l].max_segment_size);
+            }
+
+            for (const auto& block : lambda_blocks) {
+                recompute_lambda.emplace_back();
+
+                for (const auto& layer : layers_vec)
+                    recompute_lambda.back().push_back(make_launch_config(layer.idx > 0 ? layer.get_num_new_vars() : 0, block.num_rows));
+            }
+
+            const auto options = at::TensorOptions().device(at::kCUDA).dtype(at::kInt);
+            segments = at::from_blob(host_segments.data(), {static_cast<int64_t>(host_segments.size())}, at::kInt).to(options);
+            partial_sums = at::empty({std::max<int64_t>(int64_t(max_num_slots) * partial_stride, 1)}, options.dtype(at::kDouble));
+
+            size_t index = 0;
+            const int32_t* base = segments.data_ptr<int32_t>();
+
+            for (int32_t l = 0; l < layers_vec.size(); l++)
+                for (auto* launches : {&covar_forward, &covar_backward_covariance, &accum_forward, &accum_backward_omega, &backward_weights}) {
+                    auto& launch = (*launches)[l];
+                    const auto& [segments_offset, split_rows_offset] = offsets[index++];
+                    launch.segments = reinterpret_cast<const WorkSegment*>(base + segments_offset);
+                    launch.split_rows = reinterpret_cast<const SplitRow*>(base + split_rows_offset);
+                }
+        }
+
+        public:
+        template <typename scalar_t>
+        scalar_t* get_partial_sums() {
+            return reinterpret_cast<scalar_t*>(partial_sums.data_ptr<double>());
+        }
+
+        private:
+        static LaunchConfig make_launch_config(const int32_t width, const int32_t height) {
+            LaunchConfig config;
+
+            // Not launched; e.g., the dummy layer or the weights kernel of the last layer
+            if (width <= 0 || height <= 0)
+                return config;
+
+            std::tie(config.blocks, config.threads) = get_blocks_and_threads(width, height);
+            return config;
+        }
+    };
+
+    std::shared_ptr<DevicePlan> make_device_plan(
+            const std::vector<LayerData>& layers_vec,
+            const WorkPartition& partition,
+            const std::vector<LambdaBlock>& lambda_blocks,
+            int32_t lat_len,
+            int32_t vis_len,
+            int32_t device_index
+    ) {
+        c10::cuda::OptionalCUDAGuard device_guard;
+
+        if (device_index >= 0)
+            device_guard.set_index(device_index);
+
+        return std::make_shared<DevicePlan>(layers_vec, partition, lambda_blocks, lat_len, vis_len);
+    }
+
     // Concrete types
-    template class DeviceData<float>;
-    template class DeviceData<double>;
+    template class DeviceData<float, int32_t>;
+    template class DeviceData<float, int32_t, double>;
+    template class DeviceData<float, int64_t>;
+    template class DeviceData<float, int64_t, double>;
+    template class DeviceData<double, int32_t>;
+    template class DeviceData<double, int64_t>;
 
     namespace covar {
-        template <typename scalar_t>
+        template <typename scalar_t, int32_t max_degree, typename index_t, typename accscalar_t>
         __global__ void forward_kernel(
-                DeviceData<scalar_t> data,
-                LayerData layer
+                DeviceData<scalar_t, index_t, accscalar_t> data,
+                LayerData layer,
+                const WorkSegment* segments,
+                accscalar_t* partial_sums,
+                int32_t partial_stride
         ) {
             /*
-             * Compute covariance at [i, j].
+             * Compute covariance at [i, j] over the parents of `i` in the segment.
              * This requires to get the Pa(i)×Pa(j) covariance sub-matrix.
              * The only parent of the nodes previously met (alias nodes) is themselves.
+             * If `i` is split, lambda and covariance are written to the slot of the segment and summed by `forward_reduce_kernel`.
              */
-            __shared__ unsigned char shared_memory[SHARED_MEMORY_SIZE_FORWARD];
-            const int32_t i = blockIdx.x * blockDim.x + threadIdx.x + layer.base;
+            __shared__ unsigned char shared_memory[max_degree == 0 ? SHARED_MEMORY_SIZE_FORWARD : 1];
+            parent_weight_t<scalar_t> i_registers[max_degree == 0 ? 1 : max_degree];
+            const WorkSegment segment = segments[blockIdx.x];
+            const int32_t i = segment.x + layer.base;
             const int32_t y = blockIdx.y * blockDim.y + threadIdx.y;
-            const int32_t i_num_parents = data.get_num_parents(i, layer);
+            const int32_t k_max = segment.end - segment.begin;
             int32_t j, j_num_parents;
 
             if (y < layer.get_num_vars()) {
@@ -80,63 +372,96 @@ namespace sn2_cuda {
                 j_num_parents = data.get_num_parents(j, layer);
             }
 
-            auto i_data = reinterpret_cast<parent_weight_t<scalar_t> *>(shared_memory);
-            const int32_t shared_size = SHARED_MEMORY_SIZE_FORWARD / sizeof(parent_weight_t<scalar_t>);
-            const array_chunk chunker(i_num_parents, shared_size);
-
-            for (int32_t shared_round = 0; shared_round < chunker.num_chunks(); shared_round++) {
-                const int32_t k_max = chunker.chunk_size(shared_round);
-                const int32_t shared_base = chunker.chunk_base(shared_round);
-
-                // Store data to shared memory
-                for (int32_t k = threadIdx.y; k < k_max; k += blockDim.y) {
-                    const int32_t i_parent = data.get_parent(i, shared_base + k, layer);
-                    i_data[k].index = i_parent;
-                    i_data[k].value = data.get_weight(i_parent, i, layer);
+            // The segments fit the shared memory (see `MAX_SEGMENT_SIZE`)
+            auto i_data = max_degree == 0 ? reinterpret_cast<parent_weight_t<scalar_t> *>(shared_memory) : i_registers;
+
+            // Store data to shared memory, or to registers if the segments are short
+            load_edges<max_degree>(i_data, k_max, [&] (const int32_t k) {
+                const int32_t i_parent = data.get_parent(i, segment.begin + k, layer);
+                return parent_weight_t<scalar_t>{i_parent, data.get_weight(i_parent, i, layer)};
+            });
+
+            if (y < layer.get_num_vars() && j <= i && j_num_parents > 0) {
+                accscalar_t* partial_sums_i = segment.slot >= 0 ? partial_sums + index_t(segment.slot) * partial_stride : nullptr;
+                accscalar_t covariance_ij = 0.0;
+
+                for (int32_t l = 0; l < j_num_parents; l++) {
+                    const int32_t j_parent = data.get_parent(j, l, layer);
+                    const scalar_t j_parent_weight = data.get_weight(j_parent, j, layer);
+                    accscalar_t lambda_il = 0.0;
+
+                    for_each_edge<max_degree>(k_max, [&] (const int32_t k) {
+                        const accscalar_t lambda_ikl = accscalar_t(i_data[k].value) * data.get_covariance(i_data[k].index, j_parent);
+                        lambda_il += lambda_ikl;
+                        covariance_ij += lambda_ikl * j_parent_weight;
+                    });
+
+                    // lambda is computed and stored along with covariance
+                    if (partial_sums_i)
+                        partial_sums_i[j_parent + data.get_lat_len()] = lambda_il;
+                    else
+                        data.set_lambda(j_parent, i, lambda_il);
                 }
 
-                __syncthreads();
+                if (partial_sums_i)
+                    partial_sums_i[data.get_lat_len() + data.get_vis_len() + y] = covariance_ij;
+                else
+                    data.set_covariance(i, j, covariance_ij);
+            }
+        }
 
-                if (y < layer.get_num_vars() && j <= i && j_num_parents > 0) {
-                    scalar_t covariance_ij = shared_round > 0 ? data.get_covariance(i, j) : 0.0;
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        __global__ void forward_reduce_kernel(
+                DeviceData<scalar_t, index_t, accscalar_t> data,
+                LayerData layer,
+                const SplitRow* split_rows,
+                const accscalar_t* partial_sums,
+                int32_t partial_stride
+        ) {
+            /*
+             * Sum the partial lambdas and covariances of the segments of the split row `i`.
+             * The slots are zeroed beforehand, so the lambdas that no segment computed are summed to zero.
+             */
+            const SplitRow row = split_rows[blockIdx.x];
+            const int32_t i = row.x + layer.base;
+            const int32_t lat_len = data.get_lat_len();
+            const int32_t total_len = lat_len + data.get_vis_len();
 
-                    for (int32_t l = 0; l < j_num_parents; l++) {
-                        const int32_t j_parent = data.get_parent(j, l, layer);
-                        const scalar_t j_parent_weight = data.get_weight(j_parent, j, layer);
-                        scalar_t lambda_il = 0.0;
+            for (int32_t t = threadIdx.y; t < total_len + layer.get_num_vars(); t += blockDim.y) {
+                accscalar_t sum = 0.0;
 
-                        for (int32_t k = 0; k < k_max; k++) {
-                            const scalar_t lambda_ikl = i_data[k].value * data.get_covariance(i_data[k].index, j_parent);
-                            lambda_il += lambda_ikl;
-                            covariance_ij += lambda_ikl * j_parent_weight;
-                        }
+                for (int32_t slot = row.slot_begin; slot < row.slot_end; slot++)
+                    sum += partial_sums[index_t(slot) * partial_stride + t];
 
-                        // lambda is computed and stored along with covariance
-                        data.set_lambda(j_parent, i, lambda_il + (shared_round > 0 ? data.get_lambda(j_parent, i) : 0.0));
-                    }
+                if (t < total_len)
+                    data.set_lambda(t - lat_len, i, sum);
+                else {
+                    const int32_t j = data.get_layer_var(t - total_len, layer);
 
-                    data.set_covariance(i, j, covariance_ij);
+                    if (j <= i && data.get_num_parents(j, layer) > 0)
+                        data.set_covariance(i, j, sum);
                 }
-
-                __syncthreads();
             }
         }
 
-        template <typename scalar_t>
+        template <typename scalar_t, int32_t max_degree, typename index_t, typename accscalar_t>
         __global__ void backward_covariance_kernel(
-                DeviceData<scalar_t> data,
-                LayerData layer
+                DeviceData<scalar_t, index_t, accscalar_t> data,
+                LayerData layer,
+                const WorkSegment* segments,
+                accscalar_t* partial_sums,
+                int32_t partial_stride
         ) {
             /*
-             * Compute covariance_grad at [i, j].
+             * Compute covariance_grad at [i, j] over the children of `i` in the segment.
+             * If `i` is split, it is written to the slot of the segment and summed by `backward_covariance_reduce_kernel`.
              */
-            __shared__ unsigned char shared_memory[SHARED_MEMORY_SIZE_BACKWARD];
-            const int32_t x = blockIdx.x * blockDim.x + threadIdx.x;
+            __shared__ unsigned char shared_memory[max_degree == 0 ? SHARED_MEMORY_SIZE_BACKWARD : 1];
+            child_weight_t<scalar_t> i_registers[max_degree == 0 ? 1 : max_degree];
+            const WorkSegment segment = segments[blockIdx.x];
             const int32_t y = blockIdx.y * blockDim.y + threadIdx.y;
-            const int32_t i = data.get_layer_var(x, layer);
-            int32_t i_begin, i_end;
-            data.get_children_range(i, i_begin, i_end, layer);
-            const int32_t i_num_children = i_end - i_begin;
+            const int32_t i = data.get_layer_var(segment.x, layer);
+            const int32_t k_max = segment.end - segment.begin;
             int32_t j, j_begin, j_end, j_num_children;
 
             if (y < layer.get_num_vars()) {
@@ -145,40 +470,61 @@ namespace sn2_cuda {
                 j_num_children = j_end - j_begin;
             }
 
-            auto i_data = reinterpret_cast<child_weight_t<scalar_t> *>(shared_memory);
-            const int32_t shared_size = SHARED_MEMORY_SIZE_BACKWARD / sizeof(child_weight_t<scalar_t>);
-            const array_chunk chunker(i_num_children, shared_size);
+            auto i_data = max_degree == 0 ? reinterpret_cast<child_weight_t<scalar_t> *>(shared_memory) : i_registers;
 
-            for (int32_t shared_round = 0; shared_round < chunker.num_chunks(); shared_round++) {
-                const int32_t k_max = chunker.chunk_size(shared_round);
-                const int32_t shared_base = chunker.chunk_base(shared_round);
+            load_edges<max_degree>(i_data, k_max, [&] (const int32_t k) {
+                const int32_t i_child = data.get_child(i, segment.begin + k, layer);
+                return child_weight_t<scalar_t>{i_child, data.get_weight(i, i_child, layer)};
+            });
 
-                for (int32_t k = threadIdx.y; k < k_max; k += blockDim.y) {
-                    const int32_t i_child = data.get_child(i, i_begin + shared_base + k, layer);
-                    i_data[k].index = i_child;
-                    i_data[k].value = data.get_weight(i, i_child, layer);
+            if (y < layer.get_num_vars() && j <= i && j_num_children > 0) {
+                accscalar_t covariance_grad_ij = 0.0;
+
+                for (int32_t l = 0; l < j_num_children; l++) {
+                    const int32_t j_child = data.get_child(j, j_begin + l, layer);
+                    const scalar_t j_child_weight = data.get_weight(j, j_child, layer);
+
+                    for_each_edge<max_degree>(k_max, [&] (const int32_t k) {
+                        covariance_grad_ij += accscalar_t(i_data[k].value)
+                                            * data.get_covariance_grad(i_data[k].index, j_child, (layer.idx + 1) % 2)
+                                            * j_child_weight;
+                    });
                 }
 
-                __syncthreads();
+                if (segment.slot >= 0)
+                    partial_sums[index_t(segment.slot) * partial_stride + y] = covariance_grad_ij;
+                else
+                    data.set_covariance_grad(i, j, covariance_grad_ij, layer.idx % 2);
+            }
+        }
 
-                if (y < layer.get_num_vars() && j <= i && j_num_children > 0) {
-                    scalar_t covariance_grad_ij = shared_round > 0 ? data.get_covariance_grad(i, j, layer.idx % 2) : 0.0;
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        __global__ void backward_covariance_reduce_kernel(
+                DeviceData<scalar_t, index_t, accscalar_t> data,
+                LayerData layer,
+                const SplitRow* split_rows,
+                const accscalar_t* partial_sums,
+                int32_t partial_stride
+        ) {
+            /*
+             * Sum the partial covariance_grads of the segments of the split row `i`.
+             */
+            const SplitRow row = split_rows[blockIdx.x];
+            const int32_t i = data.get_layer_var(row.x, layer);
 
-                    for (int32_t l = 0; l < j_num_children; l++) {
-                        const int32_t j_child = data.get_child(j, j_begin + l, layer);
-                        const scalar_t j_child_weight = data.get_weight(j, j_child, layer);
+            for (int32_t y = threadIdx.y; y < layer.get_num_vars(); y += blockDim.y) {
+                const int32_t j = data.get_layer_var(y, layer);
+                int32_t j_begin, j_end;
+                data.get_children_range(j, j_begin, j_end, layer);
 
-                        for (int32_t k = 0; k < k_max; k++) {
-                            covariance_grad_ij += i_data[k].value
-                                                * data.get_covariance_grad(i_data[k].index, j_child, (layer.idx + 1) % 2)
-                                                * j_child_weight;
-                        }
-                    }
+                if (j <= i && j_end > j_begin) {
+                    accscalar_t sum = 0.0;
 
-                    data.set_covariance_grad(i, j, covariance_grad_ij, layer.idx % 2);
-                }
+                    for (int32_t slot = row.slot_begin; slot < row.slot_end; slot++)
+                        sum += partial_sums[index_t(slot) * partial_stride + y];
 
-                __syncthreads();
+                    data.set_covariance_grad(i, j, sum, layer.idx % 2);
+                }
             }
         }
 
@@ -208,21 +554,19 @@ namespace sn2_cuda {
     //         }
     //     }
 
-        template <typename scalar_t> /* * */
+        template <typename scalar_t, typename index_t, typename accscalar_t> /* * */
         __global__ void backward_weights_kernel(
-                DeviceData<scalar_t> data,
-                LayerData layer
+                DeviceData<scalar_t, index_t, accscalar_t> data,
+                LayerData layer,
+                const WorkSegment* segments
         ) {
             /*
-             * Compute weight_grad at [i, j].
+             * Compute weight_grad at [i, j] for the children `j` of `i` in the segment.
              */
             __shared__ unsigned char shared_memory[SHARED_MEMORY_SIZE_BACKWARD];
-            const int32_t x = blockIdx.x * blockDim.x + threadIdx.x;
-            const int32_t y = blockIdx.y * blockDim.y + threadIdx.y;
-            const int32_t i = data.get_layer_var(x, layer);
-            int32_t i_begin, i_end;
-            data.get_children_range(i, i_begin, i_end, layer);
-            const int32_t i_num_children = i_end - i_begin;
+            const WorkSegment segment = segments[blockIdx.x];
+            const int32_t y = segment.begin + threadIdx.y;
+            const int32_t i = data.get_layer_var(segment.x, layer);
 
             auto i_data = reinterpret_cast<scalar_t*>(shared_memory);
             const int32_t shared_size = SHARED_MEMORY_SIZE_BACKWARD / sizeof(scalar_t);
@@ -238,12 +582,12 @@ namespace sn2_cuda {
 
                 __syncthreads();
 
-                if (y < i_end) {
+                if (y < segment.end) {
                     const int32_t j = data.get_child(i, y, layer);
-                    scalar_t weight_grad_ij = shared_round > 0 ? data.get_weight_grad(i, j, layer) : 0.0;
+                    accscalar_t weight_grad_ij = shared_round > 0 ? data.get_weight_grad(i, j, layer) : 0.0;
 
                     for (int32_t k = 0; k < k_max; k++) {
-                        weight_grad_ij += i_data[k] * data.get_covariance_grad(shared_base + k, j, (layer.idx + 1) % 2);
+                        weight_grad_ij += accscalar_t(i_data[k]) * data.get_covariance_grad(shared_base + k, j, (layer.idx + 1) % 2);
                     }
 
                     data.set_weight_grad(i, j, weight_grad_ij);
@@ -253,6 +597,23 @@ namespace sn2_cuda {
             }
         }
 
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        __global__ void recompute_lambda_kernel(
+                DeviceData<scalar_t, index_t, accscalar_t> data,
+                LayerData layer,
+                const int32_t* rows,
+                int32_t num_rows
+        ) {
+            /*
+             * Recompute lambda at [q, k] for the rows `q` of a block and the new variable `k` of the layer (column).
+             */
+            const int32_t k = blockIdx.x + layer.base;
+            const int32_t y = blockIdx.y * blockDim.y + threadIdx.y;
+
+            if (y < num_rows)
+                data.set_lambda(rows[y], k, data.recompute_lambda(rows[y], k, layer));
+        }
+
         // template <typename scalar_t>
         // void forward_accum(const std::vector<LayerData>& layers_vec, DeviceData<scalar_t>& data) {
         //     dim3 threads, blocks;
@@ -267,94 +628,165 @@ namespace sn2_cuda {
         // }
 
         // The forward CUDA function. Calls the cuda forward kernel layer by layer.
-        template <typename scalar_t>
-        void forward(const std::vector<LayerData>& layers_vec, DeviceData<scalar_t>& data) {
-            dim3 threads, blocks;
-
-            for (int32_t l = 1; l < layers_vec.size(); l++) {
-                const auto& layer = layers_vec[l];
-                std::tie(blocks, threads) = get_blocks_and_threads(layer.get_num_new_vars(), layer.get_num_vars());
-                forward_kernel<scalar_t><<<blocks, threads>>>(data, layer);
+        // Split rows write partial sums that a second kernel adds up.
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        void forward(DevicePlan& plan, DeviceData<scalar_t, index_t, accscalar_t>& data) {
+            const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+            accscalar_t* partial_sums = plan.get_partial_sums<accscalar_t>();
+
+            for (int32_t l = 1; l < plan.layers_vec.size(); l++) {
+                const auto& layer = plan.layers_vec[l];
+                const auto& launch = plan.covar_forward[l];
+
+                if (launch.config.empty())
+                    continue;
+
+                if (!launch.reduce_config.empty())
+                    cudaMemsetAsync(partial_sums, 0, sizeof(accscalar_t) * launch.num_slots * plan.partial_stride, stream);
+
+                dispatch_degree(launch.max_degree, [&] (auto max_degree) {
+                    forward_kernel<scalar_t, decltype(max_degree)::value><<<launch.config.blocks, launch.config.threads, 0, stream>>>(
+                            data, layer, launch.segments, partial_sums, plan.partial_stride);
+                });
+
+                if (!launch.reduce_config.empty())
+                    forward_reduce_kernel<scalar_t><<<launch.reduce_config.blocks, launch.reduce_config.threads, 0, stream>>>(
+                            data, layer, launch.split_rows, partial_sums, plan.partial_stride);
             }
         }
 
         // The backward CUDA function. Calls the two cuda backward kernels concurrently layer by layer.
         // These kernels compute the weights gradient and the temporary covariance gradient.
-        template <typename scalar_t>
-        void backward(const std::vector<LayerData>& layers_vec, DeviceData<scalar_t>& data) {
-            dim3 threads, blocks;
-            cudaStream_t covariance_stream, weights_stream;
-            cudaStreamCreate(&covariance_stream);
-            cudaStreamCreate(&weights_stream);
+        // If lambda is not kept by the forward pass, every block of layers first recomputes its rows of lambda on the
+        // weights stream, after the weights kernels of the previous block have read theirs.
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        void backward(DevicePlan& plan, DeviceData<scalar_t, index_t, accscalar_t>& data) {
+            BackwardStreams& streams = plan.backward_streams;
+            accscalar_t* partial_sums = plan.get_partial_sums<accscalar_t>();
+            DeviceData<scalar_t, index_t, accscalar_t> weights_data = data;
+            int32_t block = -1;
+            streams.begin();
+
+            for (int32_t l = plan.layers_vec.size() - 2; l >= 0; l--) {
+                const auto& layer = plan.layers_vec[l];
+                streams.wait_for_layer();
+
+                if (block + 1 < plan.lambda_blocks.size() && plan.lambda_blocks[block + 1].last_layer == l) {
+                    const LambdaBlock& lambda_block = plan.lambda_blocks[++block];
+                    weights_data = data.with_lambda_rows(lambda_block.row_map);
+
+                    for (int32_t m = 1; m < plan.layers_vec.size(); m++) {
+                        const auto& config = plan.recompute_lambda[block][m];
+
+                        if (!config.empty())
+                            recompute_lambda_kernel<scalar_t><<<config.blocks, config.threads, 0, streams.weights_stream>>>(
+                                    weights_data, plan.layers_vec[m], lambda_block.rows, lambda_block.num_rows);
+                    }
+                }
 
-            for (int32_t l = layers_vec.size() - 2; l >= 0; l--) {
-                const auto& layer = layers_vec[l];
-                const auto& next_layer = layers_vec[l + 1];
+                if (l > 0 && !plan.covar_backward_covariance[l].config.empty()) {
+                    const auto& launch = plan.covar_backward_covariance[l];
+                    dispatch_degree(launch.max_degree, [&] (auto max_degree) {
+                        backward_covariance_kernel<scalar_t, decltype(max_degree)::value><<<launch.config.blocks, launch.config.threads, 0, streams.propagation_stream>>>(
+                                data, layer, launch.segments, partial_sums, plan.partial_stride);
+                    });
 
-                if (l > 0) {
-                    std::tie(blocks, threads) = get_blocks_and_threads(layer.get_num_vars(), layer.get_num_vars());
-                    backward_covariance_kernel<scalar_t><<<blocks, threads, 0, covariance_stream>>>(data, layer);
+                    if (!launch.reduce_config.empty())
+                        backward_covariance_reduce_kernel<scalar_t><<<launch.reduce_config.blocks, launch.reduce_config.threads, 0, streams.propagation_stream>>>(
+                                data, layer, launch.split_rows, partial_sums, plan.partial_stride);
                 }
 
-                std::tie(blocks, threads) = get_blocks_and_threads(layer.get_num_vars(), next_layer.get_num_new_vars());
-                backward_weights_kernel<scalar_t><<<blocks, threads, 0, weights_stream>>>(data, layer);
-                cudaDeviceSynchronize();
+                const auto& launch = plan.backward_weights[l];
+
+                if (!launch.config.empty())
+                    backward_weights_kernel<scalar_t><<<launch.config.blocks, launch.config.threads, 0, streams.weights_stream>>>(
+                            weights_data, layer, launch.segments);
+
+                streams.record_layer();
             }
 
-            cudaStreamDestroy(covariance_stream);
-            cudaStreamDestroy(weights_stream);
+            streams.end();
         }
 
         // ==============
         // Concrete types
-        template void forward<float>(const std::vector<LayerData>&, DeviceData<float>&);
-        template void forward<double>(const std::vector<LayerData>&, DeviceData<double>&);
-        template void backward<float>(const std::vector<LayerData>&, DeviceData<float>&);
-        template void backward<double>(const std::vector<LayerData>&, DeviceData<double>&);
+        template void forward<float, int32_t>(DevicePlan&, DeviceData<float, int32_t>&);
+        template void forward<float, int32_t, double>(DevicePlan&, DeviceData<float, int32_t, double>&);
+        template void forward<float, int64_t>(DevicePlan&, DeviceData<float, int64_t>&);
+        template void forward<float, int64_t, double>(DevicePlan&, DeviceData<float, int64_t, double>&);
+        template void forward<double, int32_t>(DevicePlan&, DeviceData<double, int32_t>&);
+        template void forward<double, int64_t>(DevicePlan&, DeviceData<double, int64_t>&);
+        template void backward<float, int32_t>(DevicePlan&, DeviceData<float, int32_t>&);
+        template void backward<float, int32_t, double>(DevicePlan&, DeviceData<float, int32_t, double>&);
+        template void backward<float, int64_t>(DevicePlan&, DeviceData<float, int64_t>&);
+        template void backward<float, int64_t, double>(DevicePlan&, DeviceData<float, int64_t, double>&);
+        template void backward<double, int32_t>(DevicePlan&, DeviceData<double, int32_t>&);
+        template void backward<double, int64_t>(DevicePlan&, DeviceData<double, int64_t>&);
     }
 
     namespace accum {
-        template <typename scalar_t>
+        template <typename scalar_t, int32_t max_degree, typename index_t, typename accscalar_t>
         __global__ void forward_kernel(
-                DeviceData<scalar_t> data,
-                LayerData layer
+                DeviceData<scalar_t, index_t, accscalar_t> data,
+                LayerData layer,
+                const WorkSegment* segments,
+                accscalar_t* partial_sums,
+                int32_t partial_stride
         ) {
             /*
-             * Compute W^acc[:, i].
+             * Compute W^acc[:, i] over the parents of `i` in the segment.
+             * If `i` is split, it is written to the slot of the segment and summed by `forward_reduce_kernel`.
              */
-            __shared__ unsigned char shared_memory[SHARED_MEMORY_SIZE_FORWARD];
-            const int32_t i = blockIdx.x * blockDim.x + threadIdx.x + layer.base;
+            __shared__ unsigned char shared_memory[max_degree == 0 ? SHARED_MEMORY_SIZE_FORWARD : 1];
+            parent_weight_t<scalar_t> i_registers[max_degree == 0 ? 1 : max_degree];
+            const WorkSegment segment = segments[blockIdx.x];
+            const int32_t i = segment.x + layer.base;
             const int32_t j = blockIdx.y * blockDim.y + threadIdx.y - data.get_lat_len();
-            const int32_t i_num_parents = data.get_num_parents(i, layer);
+            const int32_t k_max = segment.end - segment.begin;
 
-            auto i_data = reinterpret_cast<parent_weight_t<scalar_t> *>(shared_memory);
-            const int32_t shared_size = SHARED_MEMORY_SIZE_FORWARD / sizeof(parent_weight_t<scalar_t>);
-            const array_chunk chunker(i_num_parents, shared_size);
+            auto i_data = max_degree == 0 ? reinterpret_cast<parent_weight_t<scalar_t> *>(shared_memory) : i_registers;
 
-            for (int32_t shared_round = 0; shared_round < chunker.num_chunks(); shared_round++) {
-                const int32_t k_max = chunker.chunk_size(shared_round);
-                const int32_t shared_base = chunker.chunk_base(shared_round);
+            // Store data to shared memory, or to registers if the segments are short
+            load_edges<max_degree>(i_data, k_max, [&] (const int32_t k) {
+                const int32_t i_parent = data.get_parent(i, segment.begin + k, layer);
+                return parent_weight_t<scalar_t>{i_parent, data.get_weight(i_parent, i, layer)};
+            });
 
-                // Store data to shared memory
-                for (int32_t k = threadIdx.y; k < k_max; k += blockDim.y) {
-                    const int32_t i_parent = data.get_parent(i, shared_base + k, layer);
-                    i_data[k].index = i_parent;
-                    i_data[k].value = data.get_weight(i_parent, i, layer);
-                }
+            if (j < 0) {
+                accscalar_t w_accum = 0.0;
 
-                __syncthreads();
+                for_each_edge<max_degree>(k_max, [&] (const int32_t k) {
+                    w_accum += accscalar_t(i_data[k].value) * data.get_w_accum(j, i_data[k].index);
+                });
 
-                if (j < 0) {
-                    scalar_t w_accum = shared_round > 0 ? data.get_w_accum(j, i) : 0.0;
+                if (segment.slot >= 0)
+                    partial_sums[index_t(segment.slot) * partial_stride + j + data.get_lat_len()] = w_accum;
+                else
+                    data.set_w_accum(j, i, w_accum);
+            }
+        }
 
-                    for (int32_t k = 0; k < k_max; k++) {
-                        w_accum += i_data[k].value * data.get_w_accum(j, i_data[k].index);
-                    }
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        __global__ void forward_reduce_kernel(
+                DeviceData<scalar_t, index_t, accscalar_t> data,
+                LayerData layer,
+                const SplitRow* split_rows,
+                const accscalar_t* partial_sums,
+                int32_t partial_stride
+        ) {
+            /*
+             * Sum the partial W^acc[:, i] of the segments of the split row `i`.
+             */
+            const SplitRow row = split_rows[blockIdx.x];
+            const int32_t i = row.x + layer.base;
 
-                    data.set_w_accum(j, i, w_accum);
-                }
+            for (int32_t j = threadIdx.y - data.get_lat_len(); j < 0; j += blockDim.y) {
+                accscalar_t sum = 0.0;
 
-                __syncthreads();
+                for (int32_t slot = row.slot_begin; slot < row.slot_end; slot++)
+                    sum += partial_sums[index_t(slot) * partial_stride + j + data.get_lat_len()];
+
+                data.set_w_accum(j, i, sum);
             }
         }
 
@@ -378,65 +810,84 @@ namespace sn2_cuda {
 //             }
 //         }
 
-        template <typename scalar_t>
+        template <typename scalar_t, int32_t max_degree, typename index_t, typename accscalar_t>
         __global__ void backward_omega_kernel(
-                DeviceData<scalar_t> data,
-                LayerData layer
+                DeviceData<scalar_t, index_t, accscalar_t> data,
+                LayerData layer,
+                const WorkSegment* segments,
+                accscalar_t* partial_sums,
+                int32_t partial_stride
         ) {
-            __shared__ unsigned char shared_memory[SHARED_MEMORY_SIZE_BACKWARD];
-            const int32_t x = blockIdx.x * blockDim.x + threadIdx.x;
-            const int32_t i = data.get_layer_var(x, layer);
+            /*
+             * Compute Ω[:, i] over the children of `i` in the segment.
+             * If `i` is split, it is written to the slot of the segment and summed by `backward_omega_reduce_kernel`.
+             */
+            __shared__ unsigned char shared_memory[max_degree == 0 ? SHARED_MEMORY_SIZE_BACKWARD : 1];
+            child_weight_t<scalar_t> i_registers[max_degree == 0 ? 1 : max_degree];
+            const WorkSegment segment = segments[blockIdx.x];
+            const int32_t i = data.get_layer_var(segment.x, layer);
             const int32_t j = blockIdx.y * blockDim.y + threadIdx.y - data.get_lat_len();
-            int32_t i_begin, i_end;
-            data.get_children_range(i, i_begin, i_end, layer);
-            const int32_t i_num_children = i_end - i_begin;
+            const int32_t k_max = segment.end - segment.begin;
 
-            auto i_data = reinterpret_cast<child_weight_t<scalar_t> *>(shared_memory);
-            const int32_t shared_size = SHARED_MEMORY_SIZE_BACKWARD / sizeof(child_weight_t<scalar_t>);
-            const array_chunk chunker(i_num_children, shared_size);
+            auto i_data = max_degree == 0 ? reinterpret_cast<child_weight_t<scalar_t> *>(shared_memory) : i_registers;
 
-            for (int32_t shared_round = 0; shared_round < chunker.num_chunks(); shared_round++) {
-                const int32_t k_max = chunker.chunk_size(shared_round);
-                const int32_t shared_base = chunker.chunk_base(shared_round);
+            load_edges<max_degree>(i_data, k_max, [&] (const int32_t k) {
+                const int32_t i_child = data.get_child(i, segment.begin + k, layer);
+                return child_weight_t<scalar_t>{i_child, data.get_weight(i, i_child, layer)};
+            });
 
-                for (int32_t k = threadIdx.y; k < k_max; k += blockDim.y) {
-                    const int32_t i_child = data.get_child(i, i_begin + shared_base + k, layer);
-                    i_data[k].index = i_child;
-                    i_data[k].value = data.get_weight(i, i_child, layer);
-                }
+            if (j < 0) {
+                accscalar_t omega_ji = 0.0;
 
-                __syncthreads();
+                for_each_edge<max_degree>(k_max, [&] (const int32_t k) {
+                    omega_ji += accscalar_t(i_data[k].value)
+                              * data.get_omega(j, i_data[k].index, (layer.idx + 1) % 2);
+                });
 
-                if (j < 0) {
-                    scalar_t omega_ji = shared_round > 0 ? data.get_omega(j, i, layer.idx % 2) : 0.0;
+                if (segment.slot >= 0)
+                    partial_sums[index_t(segment.slot) * partial_stride + j + data.get_lat_len()] = omega_ji;
+                else
+                    data.set_omega(j, i, omega_ji, layer.idx % 2);
+            }
+        }
 
-                    for (int32_t k = 0; k < k_max; k++) {
-                        omega_ji += i_data[k].value
-                                  * data.get_omega(j, i_data[k].index, (layer.idx + 1) % 2);
-                    }
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        __global__ void backward_omega_reduce_kernel(
+                DeviceData<scalar_t, index_t, accscalar_t> data,
+                LayerData layer,
+                const SplitRow* split_rows,
+                const accscalar_t* partial_sums,
+                int32_t partial_stride
+        ) {
+            /*
+             * Sum the partial Ω[:, i] of the segments of the split row `i`.
+             */
+            const SplitRow row = split_rows[blockIdx.x];
+            const int32_t i = data.get_layer_var(row.x, layer);
 
-                    data.set_omega(j, i, omega_ji, layer.idx % 2);
-                }
+            for (int32_t j = threadIdx.y - data.get_lat_len(); j < 0; j += blockDim.y) {
+                accscalar_t sum = 0.0;
 
-                __syncthreads();
+                for (int32_t slot = row.slot_begin; slot < row.slot_end; slot++)
+                    sum += partial_sums[index_t(slot) * partial_stride + j + data.get_lat_len()];
+
+                data.set_omega(j, i, sum, layer.idx % 2);
             }
         }
 
-        template <typename scalar_t>
+        template <typename scalar_t, typename index_t, typename accscalar_t>
         __global__ void backward_weights_kernel(
-                DeviceData<scalar_t> data,
-                LayerData layer
+                DeviceData<scalar_t, index_t, accscalar_t> data,
+                LayerData layer,
+                const WorkSegment* segments
         ) {
             /*
-             * Compute weight_grad at [i, j].
+             * Compute weight_grad at [i, j] for the children `j` of `i` in the segment.
              */
             __shared__ unsigned char shared_memory[SHARED_MEMORY_SIZE_BACKWARD];
-            const int32_t x = blockIdx.x * blockDim.x + threadIdx.x;
-            const int32_t y = blockIdx.y * blockDim.y + threadIdx.y;
-            const int32_t i = data.get_layer_var(x, layer);
-            int32_t i_begin, i_end;
-            data.get_children_range(i, i_begin, i_end, layer);
-            const int32_t i_num_children = i_end - i_begin;
+            const WorkSegment segment = segments[blockIdx.x];
+            const int32_t y = segment.begin + threadIdx.y;
+            const int32_t i = data.get_layer_var(segment.x, layer);
             const int32_t lat_len = data.get_lat_len();
 
             auto i_data = reinterpret_cast<scalar_t*>(shared_memory);
@@ -453,12 +904,12 @@ namespace sn2_cuda {
 
                 __syncthreads();
 
-                if (y < i_end) {
+                if (y < segment.end) {
                     const int32_t j = data.get_child(i, y, layer);
-                    scalar_t weight_grad_ij = shared_round > 0 ? data.get_weight_grad(i, j, layer) : 0.0;
+                    accscalar_t weight_grad_ij = shared_round > 0 ? data.get_weight_grad(i, j, layer) : 0.0;
 
                     for (int32_t k = 0; k < k_max; k++) {
-                        weight_grad_ij += i_data[k] * data.get_omega(shared_base + k - lat_len, j, (layer.idx + 1) % 2);
+                        weight_grad_ij += accscalar_t(i_data[k]) * data.get_omega(shared_base + k - lat_len, j, (layer.idx + 1) % 2);
                     }
 
                     data.set_weight_grad(i, j, weight_grad_ij);
@@ -468,46 +919,318 @@ namespace sn2_cuda {
             }
         }
 
-        template <typename scalar_t>
-        void forward(const std::vector<LayerData>& layers_vec, DeviceData<scalar_t>& data) {
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        void forward(DevicePlan& plan, DeviceData<scalar_t, index_t, accscalar_t>& data) {
+            const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+            accscalar_t* partial_sums = plan.get_partial_sums<accscalar_t>();
+
+            for (int32_t l = 1; l < plan.layers_vec.size(); l++) {
+                const auto& layer = plan.layers_vec[l];
+                const auto& launch = plan.accum_forward[l];
+
+                if (launch.config.empty())
+                    continue;
+
+                dispatch_degree(launch.max_degree, [&] (auto max_degree) {
+                    forward_kernel<scalar_t, decltype(max_degree)::value><<<launch.config.blocks, launch.config.threads, 0, stream>>>(
+                            data, layer, launch.segments, partial_sums, plan.partial_stride);
+                });
+
+                if (!launch.reduce_config.empty())
+                    forward_reduce_kernel<scalar_t><<<launch.reduce_config.blocks, launch.reduce_config.threads, 0, stream>>>(
+                            data, layer, launch.split_rows, partial_sums, plan.partial_stride);
+            }
+        }
+
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        void backward(DevicePlan& plan, DeviceData<scalar_t, index_t, accscalar_t>& data) {
+            BackwardStreams& streams = plan.backward_streams;
+            accscalar_t* partial_sums = plan.get_partial_sums<accscalar_t>();
+            streams.begin();
+
+            for (int32_t l = plan.layers_vec.size() - 2; l >= 0; l--) {
+                const auto& layer = plan.layers_vec[l];
+                streams.wait_for_layer();
+
+                if (l > 0 && !plan.accum_backward_omega[l].config.empty()) {
+                    const auto& launch = plan.accum_backward_omega[l];
+                    dispatch_degree(launch.max_degree, [&] (auto max_degree) {
+                        backward_omega_kernel<scalar_t, decltype(max_degree)::value><<<launch.config.blocks, launch.config.threads, 0, streams.propagation_stream>>>(
+                                data, layer, launch.segments, partial_sums, plan.partial_stride);
+                    });
+
+                    if (!launch.reduce_config.empty())
+                        backward_omega_reduce_kernel<scalar_t><<<launch.reduce_config.blocks, launch.reduce_config.threads, 0, streams.propagation_stream>>>(
+                                data, layer, launch.split_rows, partial_sums, plan.partial_stride);
+                }
+
+                const auto& launch = plan.backward_weights[l];
+
+                if (!launch.config.empty())
+                    backward_weights_kernel<scalar_t><<<launch.config.blocks, launch.config.threads, 0, streams.weights_stream>>>(
+                            data, layer, launch.segments);
+
+                streams.record_layer();
+            }
+
+            streams.end();
+        }
+
+        // Concrete types
+        template void forward<float, int32_t>(DevicePlan&, DeviceData<float, int32_t>&);
+        template void forward<float, int32_t, double>(DevicePlan&, DeviceData<float, int32_t, double>&);
+        template void forward<float, int64_t>(DevicePlan&, DeviceData<float, int64_t>&);
+        template void forward<float, int64_t, double>(DevicePlan&, DeviceData<float, int64_t, double>&);
+        template void forward<double, int32_t>(DevicePlan&, DeviceData<double, int32_t>&);
+        template void forward<double, int64_t>(DevicePlan&, DeviceData<double, int64_t>&);
+        template void backward<float, int32_t>(DevicePlan&, DeviceData<float, int32_t>&);
+        template void backward<float, int32_t, double>(DevicePlan&, DeviceData<float, int32_t, double>&);
+        template void backward<float, int64_t>(DevicePlan&, DeviceData<float, int64_t>&);
+        template void backward<float, int64_t, double>(DevicePlan&, DeviceData<float, int64_t, double>&);
+        template void backward<double, int32_t>(DevicePlan&, DeviceData<double, int32_t>&);
+        template void backward<double, int64_t>(DevicePlan&, DeviceData<double, int64_t>&);
+    }
+
+    namespace stochastic {
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        __global__ void solve_kernel(
+                DeviceData<scalar_t, index_t, accscalar_t> data,
+                LayerData layer,
+                const scalar_t* in,
+                scalar_t* out,
+                int32_t num_probes
+        ) {
+            /*
+             * Compute ((I - B)⁻¹ in)[i, r] = in[i, r] + Σ_c B[i, c] out[c, r]; the children are in later layers.
+             */
+            const int32_t i = blockIdx.x * blockDim.x + threadIdx.x + layer.base;
+            const int32_t r = blockIdx.y * blockDim.y + threadIdx.y;
+
+            if (r < num_probes) {
+                int32_t begin, end;
+                data.get_all_children_range(i, begin, end);
+                scalar_t out_ir = in[index_t(i) * num_probes + r];
+
+                for (int32_t k = begin; k < end; k++) {
+                    const int32_t c = data.get_any_child(k);
+                    out_ir += data.get_edge_weight(i, c) * out[index_t(c) * num_probes + r];
+                }
+
+                out[index_t(i) * num_probes + r] = out_ir;
+            }
+        }
+
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        __global__ void project_kernel(
+                DeviceData<scalar_t, index_t, accscalar_t> data,
+                const scalar_t* in,
+                scalar_t* out,
+                int32_t num_probes
+        ) {
+            /*
+             * Compute (W_L in)[u, r] for the latent variable `u`.
+             */
+            const int32_t u = blockIdx.x * blockDim.x + threadIdx.x - data.get_lat_len();
+            const int32_t r = blockIdx.y * blockDim.y + threadIdx.y;
+
+            if (r < num_probes) {
+                int32_t begin, end;
+                data.get_all_children_range(u, begin, end);
+                scalar_t out_ur = 0.0;
+
+                for (int32_t k = begin; k < end; k++) {
+                    const int32_t c = data.get_any_child(k);
+                    out_ur += data.get_edge_weight(u, c) * in[index_t(c) * num_probes + r];
+                }
+
+                out[index_t(u + data.get_lat_len()) * num_probes + r] = out_ur;
+            }
+        }
+
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        __global__ void solve_transposed_projection_kernel(
+                DeviceData<scalar_t, index_t, accscalar_t> data,
+                LayerData layer,
+                const scalar_t* latent_in,
+                scalar_t* out,
+                int32_t num_probes
+        ) {
+            /*
+             * Compute ((I - B)⁻ᵀ W_Lᵀ latent_in)[i, r]; the parents are in earlier layers.
+             */
+            const int32_t i = blockIdx.x * blockDim.x + threadIdx.x + layer.base;
+            const int32_t r = blockIdx.y * blockDim.y + threadIdx.y;
+            const int32_t lat_len = data.get_lat_len();
+
+            if (r < num_probes) {
+                scalar_t out_ir = 0.0;
+
+                for (int32_t k = 0; k < data.get_num_all_parents(i); k++) {
+                    const int32_t p = data.get_all_parent(i, k);
+                    const scalar_t in_pr = p < 0 ? latent_in[index_t(p + lat_len) * num_probes + r] : out[index_t(p) * num_probes + r];
+                    out_ir += data.get_edge_weight(p, i) * in_pr;
+                }
+
+                out[index_t(i) * num_probes + r] = out_ir;
+            }
+        }
+
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        __global__ void bilinear_backward_kernel(
+                DeviceData<scalar_t, index_t, accscalar_t> data,
+                const scalar_t* left_1,
+                const scalar_t* right_1,
+                const scalar_t* left_2,
+                const scalar_t* right_2,
+                scalar_t alpha,
+                int32_t num_probes
+        ) {
+            /*
+             * Compute weight_grad at [p, i] for the `k`-th parent `p` of `i`.
+             */
+            const int32_t i = blockIdx.x * blockDim.x + threadIdx.x;
+            const int32_t k = blockIdx.y * blockDim.y + threadIdx.y;
+
+            if (k < data.get_num_all_parents(i)) {
+                const int32_t p = data.get_all_parent(i, k);
+                const index_t p_base = index_t(p + data.get_lat_len()) * num_probes;
+                accscalar_t weight_grad_pi = 0.0;
+
+                for (int32_t r = 0; r < num_probes; r++) {
+                    weight_grad_pi += accscalar_t(left_1[p_base + r]) * right_1[index_t(i) * num_probes + r]
+                                    + accscalar_t(left_2[p_base + r]) * right_2[index_t(i) * num_probes + r];
+                }
+
+                data.set_weight_grad(p, i, alpha * weight_grad_pi);
+            }
+        }
+
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        void solve(DevicePlan& plan, DeviceData<scalar_t, index_t, accscalar_t>& data, const scalar_t* in, scalar_t* out, int32_t num_probes) {
             dim3 threads, blocks;
+            const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
 
-            for (int32_t l = 1; l < layers_vec.size(); l++) {
-                const auto& layer = layers_vec[l];
-                std::tie(blocks, threads) = get_blocks_and_threads(layer.get_num_new_vars(), data.get_lat_len());
-                forward_kernel<scalar_t><<<blocks, threads>>>(data, layer);
+            for (int32_t l = plan.layers_vec.size() - 1; l > 0; l--) {
+                const auto& layer = plan.layers_vec[l];
+                std::tie(blocks, threads) = get_blocks_and_threads(layer.get_num_new_vars(), num_probes);
+                solve_kernel<scalar_t><<<blocks, threads, 0, stream>>>(data, layer, in, out, num_probes);
             }
         }
 
-        template <typename scalar_t>
-        void backward(const std::vector<LayerData>& layers_vec, DeviceData<scalar_t>& data) {
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        void project(DeviceData<scalar_t, index_t, accscalar_t>& data, const scalar_t* in, scalar_t* out, int32_t num_probes) {
             dim3 threads, blocks;
-            cudaStream_t omega_stream, weights_stream;
-            cudaStreamCreate(&omega_stream);
-            cudaStreamCreate(&weights_stream);
+            const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
 
-            for (int32_t l = layers_vec.size() - 2; l >= 0; l--) {
-                const auto& layer = layers_vec[l];
-                const auto& next_layer = layers_vec[l + 1];
+            if (data.get_lat_len() > 0) {
+                std::tie(blocks, threads) = get_blocks_and_threads(data.get_lat_len(), num_probes);
+                project_kernel<scalar_t><<<blocks, threads, 0, stream>>>(data, in, out, num_probes);
+            }
+        }
 
-                if (l > 0) {
-                    std::tie(blocks, threads) = get_blocks_and_threads(layer.get_num_vars(), data.get_lat_len());
-                    backward_omega_kernel<scalar_t><<<blocks, threads, 0, omega_stream>>>(data, layer);
-                }
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        void solve_transposed_projection(DevicePlan& plan, DeviceData<scalar_t, index_t, accscalar_t>& data, const scalar_t* latent_in, scalar_t* out, int32_t num_probes) {
+            dim3 threads, blocks;
+            const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
 
-                std::tie(blocks, threads) = get_blocks_and_threads(layer.get_num_vars(), next_layer.get_num_new_vars());
-                backward_weights_kernel<scalar_t><<<blocks, threads, 0, weights_stream>>>(data, layer);
-                cudaDeviceSynchronize();
+            for (int32_t l = 1; l < plan.layers_vec.size(); l++) {
+                const auto& layer = plan.layers_vec[l];
+                std::tie(blocks, threads) = get_blocks_and_threads(layer.get_num_new_vars(), num_probes);
+                solve_transposed_projection_kernel<scalar_t><<<blocks, threads, 0, stream>>>(data, layer, latent_in, out, num_probes);
             }
+        }
 
-            cudaStreamDestroy(omega_stream);
-            cudaStreamDestroy(weights_stream);
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        void bilinear_backward(
+                DeviceData<scalar_t, index_t, accscalar_t>& data,
+                const scalar_t* left_1,
+                const scalar_t* right_1,
+                const scalar_t* left_2,
+                const scalar_t* right_2,
+                scalar_t alpha,
+                int32_t num_probes,
+                int32_t max_num_parents
+        ) {
+            dim3 threads, blocks;
+            const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+
+            if (max_num_parents > 0) {
+                std::tie(blocks, threads) = get_blocks_and_threads(data.get_vis_len(), max_num_parents);
+                bilinear_backward_kernel<scalar_t><<<blocks, threads, 0, stream>>>(data, left_1, right_1, left_2, right_2, alpha, num_probes);
+            }
+        }
+
+        // Concrete types
+        template void solve<float, int32_t>(DevicePlan&, DeviceData<float, int32_t>&, const float*, float*, int32_t);
+        template void solve<float, int32_t, double>(DevicePlan&, DeviceData<float, int32_t, double>&, const float*, float*, int32_t);
+        template void solve<float, int64_t>(DevicePlan&, DeviceData<float, int64_t>&, const float*, float*, int32_t);
+        template void solve<float, int64_t, double>(DevicePlan&, DeviceData<float, int64_t, double>&, const float*, float*, int32_t);
+        template void solve<double, int32_t>(DevicePlan&, DeviceData<double, int32_t>&, const double*, double*, int32_t);
+        template void solve<double, int64_t>(DevicePlan&, DeviceData<double, int64_t>&, const double*, double*, int32_t);
+        template void project<float, int32_t>(DeviceData<float, int32_t>&, const float*, float*, int32_t);
+        template void project<float, int32_t, double>(DeviceData<float, int32_t, double>&, const float*, float*, int32_t);
+        template void project<float, int64_t>(DeviceData<float, int64_t>&, const float*, float*, int32_t);
+        template void project<float, int64_t, double>(DeviceData<float, int64_t, double>&, const float*, float*, int32_t);
+        template void project<double, int32_t>(DeviceData<double, int32_t>&, const double*, double*, int32_t);
+        template void project<double, int64_t>(DeviceData<double, int64_t>&, const double*, double*, int32_t);
+        template void solve_transposed_projection<float, int32_t>(DevicePlan&, DeviceData<float, int32_t>&, const float*, float*, int32_t);
+        template void solve_transposed_projection<float, int32_t, double>(DevicePlan&, DeviceData<float, int32_t, double>&, const float*, float*, int32_t);
+        template void solve_transposed_projection<float, int64_t>(DevicePlan&, DeviceData<float, int64_t>&, const float*, float*, int32_t);
+        template void solve_transposed_projection<float, int64_t, double>(DevicePlan&, DeviceData<float, int64_t, double>&, const float*, float*, int32_t);
+        template void solve_transposed_projection<double, int32_t>(DevicePlan&, DeviceData<double, int32_t>&, const double*, double*, int32_t);
+        template void solve_transposed_projection<double, int64_t>(DevicePlan&, DeviceData<double, int64_t>&, const double*, double*, int32_t);
+        template void bilinear_backward<float, int32_t>(DeviceData<float, int32_t>&, const float*, const float*, const float*, const float*, float, int32_t, int32_t);
+        template void bilinear_backward<float, int32_t, double>(DeviceData<float, int32_t, double>&, const float*, const float*, const float*, const float*, float, int32_t, int32_t);
+        template void bilinear_backward<float, int64_t>(DeviceData<float, int64_t>&, const float*, const float*, const float*, const float*, float, int32_t, int32_t);
+        template void bilinear_backward<float, int64_t, double>(DeviceData<float, int64_t, double>&, const float*, const float*, const float*, const float*, float, int32_t, int32_t);
+        template void bilinear_backward<double, int32_t>(DeviceData<double, int32_t>&, const double*, const double*, const double*, const double*, double, int32_t, int32_t);
+        template void bilinear_backward<double, int64_t>(DeviceData<double, int64_t>&, const double*, const double*, const double*, const double*, double, int32_t, int32_t);
+    }
+
+    namespace tiny {
+        template <typename scalar_t, int32_t size>
+        __global__ void forward_kernel(BatchData<scalar_t> data) {
+            const int64_t b = int64_t(blockIdx.x) * blockDim.x + threadIdx.x;
+
+            if (b < data.batch_size)
+                forward_model<scalar_t, size>(data, b);
+        }
+
+        template <typename scalar_t, int32_t size>
+        __global__ void backward_kernel(BatchData<scalar_t> data) {
+            const int64_t b = int64_t(blockIdx.x) * blockDim.x + threadIdx.x;
+
+            if (b < data.batch_size)
+                backward_model<scalar_t, size>(data, b);
+        }
+
+        // One model per thread; the whole batch is a single launch
+        template <typename scalar_t>
+        void forward(BatchData<scalar_t>& data) {
+            const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+            const dim3 blocks((data.batch_size + TINY_THREADS_PER_BLOCK - 1) / TINY_THREADS_PER_BLOCK);
+
+            if (data.batch_size > 0)
+                dispatch_size(data, [&] (auto size) {
+                    forward_kernel<scalar_t, decltype(size)::value><<<blocks, TINY_THREADS_PER_BLOCK, 0, stream>>>(data);
+                });
+        }
+
+        template <typename scalar_t>
+        void backward(BatchData<scalar_t>& data) {
+            const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+            const dim3 blocks((data.batch_size + TINY_THREADS_PER_BLOCK - 1) / TINY_THREADS_PER_BLOCK);
+
+            if (data.batch_size > 0)
+                dispatch_size(data, [&] (auto size) {
+                    backward_kernel<scalar_t, decltype(size)::value><<<blocks, TINY_THREADS_PER_BLOCK, 0, stream>>>(data);
+                });
         }
 
         // Concrete types
-        template void forward<float>(const std::vector<LayerData>&, DeviceData<float>&);
-        template void forward<double>(const std::vector<LayerData>&, DeviceData<double>&);
-        template void backward<float>(const std::vector<LayerData>&, DeviceData<float>&);
-        template void backward<double>(const std::vector<LayerData>&, DeviceData<double>&);
+        template void forward<float>(BatchData<float>&);
+        template void forward<double>(BatchData<double>&);
+        template void backward<float>(BatchData<float>&);
+        template void backward<double>(BatchData<double>&);
     }
 }
\ No newline at end of file
@@ -4,8 +4,46 @@
 #include <torch/extension.h>
 #include "stringify.h"
 #include "declarations.h"
+#include <functional>
+#include <algorithm>
 
 namespace sn2_cuda::loss {
+    /**
+     * Factors of the visible covariance Σ = (I - B)⁻ᵀ (D + FᵀF) (I - B)⁻¹, where `D` holds the variances
+     * contributed by the latent variables with a single child and `F` the loadings of the remaining latent variables.
+     */
+    struct LowRankFactors {
+        torch::Tensor transformation;           // I - B; a sparse |V|×|V| unit upper-triangular matrix, coalesced
+        torch::Tensor diagonal;                 // diag(D); a |V| vector
+        torch::Tensor loadings;                 // F; a |L'|×|V| matrix
+    };
+
+    /**
+     * A matrix-free view of the visible covariance Σ; used by the losses that never materialize Σ.
+     */
+    class CovarianceOperator {
+        public:
+        virtual int64_t get_size() const = 0;
+
+        public:
+        /**
+         * @param x a |V|×p block of vectors
+         * @return Σ x
+         */
+        virtual torch::Tensor apply(const torch::Tensor& x) const = 0;
+
+        public:
+        /**
+         * Stores alpha ∂(tr(xᵀ Σ y))/∂w into the gradient of the weights.
+         * @param x a |V|×p block of vectors
+         * @param y a |V|×p block of vectors
+         */
+        virtual void bilinear_backward(const torch::Tensor& x, const torch::Tensor& y, double alpha) const = 0;
+
+        public:
+        virtual ~CovarianceOperator() = default;
+    };
+
     // Custom loss method
     class LossBase {
         friend class sn2_cuda::SN2Solver;
@@ -31,7 +69,7 @@ namespace sn2_cuda::loss {
             if (sample_covariance.defined()) {
                 auto loss_data_iter = loss_data_map.find(sample_covariance);
 
-                if (loss_data_iter->second.use_count() <= 2)
+                if (loss_data_iter != loss_data_map.end() && loss_data_iter->second.use_count() <= 2)
                     loss_data_map.erase(loss_data_iter);
             }
         }
@@ -105,6 +143,8 @@ namespace sn2_cuda::loss {
     };
 
     class KullbackLeibler : public LossBase {
+        friend class sn2_cuda::SN2Solver;
+
         protected:
         virtual torch::Tensor loss_proxy(const torch::Tensor& visible_covariance) const {
             return torch::subtract(
@@ -128,6 +168,230 @@ namespace sn2_cuda::loss {
             visible_covariance_grad.copy_(get_sample_covariance_inv());
             visible_covariance_grad.subtract_(torch::inverse(visible_covariance));
         }
+
+        private:
+        /**
+         * The |L'|×|L'| capacitance matrix I + F D⁻¹ Fᵀ of the Woodbury identity.
+         */
+        static inline torch::Tensor get_capacitance(const LowRankFactors& factors) {
+            return torch::eye(factors.loadings.size(0), factors.loadings.options()).add_(
+                torch::mm(torch::div(factors.loadings, factors.diagonal), factors.loadings.t())
+            );
+        }
+
+        private:
+        /**
+         * Same as `loss_proxy`; log det(Σ) = log det(D) + log det(I + F D⁻¹ Fᵀ) is taken from the |L'|×|L'| system.
+         */
+        torch::Tensor low_rank_loss_proxy(const torch::Tensor& visible_covariance, const LowRankFactors& factors) const {
+            return torch::subtract(
+                torch::mul(get_sample_covariance_inv(), visible_covariance).sum(),
+                torch::add(torch::log(factors.diagonal).sum(), torch::logdet(get_capacitance(factors)))
+            );
+        }
+
+        private:
+        torch::Tensor low_rank_loss(const torch::Tensor& visible_covariance, const LowRankFactors& factors) const {
+            return torch::div(
+                torch::add(
+                    torch::subtract(low_rank_loss_proxy(visible_covariance, factors), get_size()),
+                    get_sample_covariance_logdet()
+                )
+            , 2.0);
+        }
+
+        private:
+        /**
+         * Same as `loss_backward`; Σ⁻¹ = (I - B) D⁻¹ (I - B)ᵀ - U (I + F D⁻¹ Fᵀ)⁻¹ Uᵀ with U = (I - B) D⁻¹ Fᵀ.
+         * The first term is a sparse product over the edges of B; only the correction of rank |L'| is dense.
+         */
+        void low_rank_loss_backward(const LowRankFactors& factors, torch::Tensor& visible_covariance_grad) const {
+            const auto& edges = factors.transformation.indices();
+            const auto scaled_transformation = torch::sparse_coo_tensor(
+                    edges,
+                    torch::div(factors.transformation.values(), factors.diagonal.index({edges[1]})),
+                    factors.transformation.sizes()
+            )._coalesced_(true);
+            const auto precision = torch::mm(scaled_transformation, factors.transformation.t()).coalesce();
+            const auto& precision_edges = precision.indices();
+            const auto factor = torch::mm(scaled_transformation, factors.loadings.t());
+            visible_covariance_grad.copy_(get_sample_covariance_inv());
+            visible_covariance_grad.index_put_({precision_edges[0], precision_edges[1]}, precision.values().neg(), /*accumulate=*/true);
+            visible_covariance_grad.add_(torch::mm(factor, torch::linalg::solve(get_capacitance(factors), factor.t())));
+        }
+    };
+
+    /**
+     * Kullback-Leibler divergence estimated without materializing Σ: the trace term by Hutchinson's estimator, log det(Σ)
+     * by stochastic Lanczos quadrature, and the gradient through conjugate-gradient solves. The solver feeds it products
+     * with Σ computed from the structure; given a dense Σ it falls back to the exact `KullbackLeibler`.
+     */
+    class StochasticKullbackLeibler : public KullbackLeibler {
+        friend class sn2_cuda::SN2Solver;
+        using MatVec = std::function<torch::Tensor(const torch::Tensor&)>;
+
+        int64_t num_probes;
+        int64_t num_lanczos_steps;
+        double cg_tolerance;
+        int64_t cg_max_iterations;
+        int64_t cg_check_every = 1;             // Iterations between two reads of the residuals; 0 for none (see `SN2Solver::fit`)
+        mutable torch::Tensor sample_covariance_logdet_estimate;
+        mutable torch::Tensor estimated_sample_covariance;
+
+        public:
+        /**
+         * @param num_probes number of Rademacher probe vectors per estimate
+         * @param num_lanczos_steps number of Lanczos steps per probe for log det(Σ)
+         * @param cg_tolerance relative residual at which the conjugate-gradient solves stop
+         * @param cg_max_iterations maximum number of conjugate-gradient iterations
+         */
+        StochasticKullbackLeibler(
+                int64_t num_probes = 16,
+                int64_t num_lanczos_steps = 32,
+                double cg_tolerance = 1e-6,
+                int64_t cg_max_iterations = 1000
+        ):  num_probes(num_probes),
+            num_lanczos_steps(num_lanczos_steps),
+            cg_tolerance(cg_tolerance),
+            cg_max_iterations(cg_max_iterations)
+        {
+            TORCH_CHECK(num_probes > 0, STRINGIFY(num_probes) " must be positive.")
+            TORCH_CHECK(num_lanczos_steps > 0, STRINGIFY(num_lanczos_steps) " must be positive.")
+            TORCH_CHECK(cg_max_iterations > 0, STRINGIFY(cg_max_iterations) " must be positive.")
+        }
+
+        public:
+        /**
+         * @return a new loss with the same settings and no sample covariance
+         */
+        std::shared_ptr<StochasticKullbackLeibler> make_unset() const {
+            return std::make_shared<StochasticKullbackLeibler>(num_probes, num_lanczos_steps, cg_tolerance, cg_max_iterations);
+        }
+
+        private:
+        static inline torch::Tensor safe_div(const torch::Tensor& numerator, const torch::Tensor& denominator) {
+            return torch::div(numerator, denominator.clamp_min(1e-30));
+        }
+
+        private:
+        torch::Tensor get_probes() const {
+            const auto& sample_covariance = get_sample_covariance();
+            return torch::randint(0, 2, {get_size(), num_probes}, sample_covariance.options()).mul_(2).sub_(1);
+        }
+
+        private:
+        /**
+         * Solves `matvec(x) = rhs` for every column of `rhs` by the conjugate-gradient method. The columns that have
+         * converged are frozen on the device; whether all have is read on the host every `cg_check_every` iterations.
+         */
+        torch::Tensor conjugate_gradient(const MatVec& matvec, const torch::Tensor& rhs) const {
+            auto x = torch::zeros_like(rhs);
+            auto r = rhs.clone();
+            auto p = rhs.clone();
+            auto rs = r.square().sum(0, true);
+            const auto threshold = rs * (cg_tolerance * cg_tolerance);
+
+            for (int64_t iteration = 0; iteration < cg_max_iterations; iteration++) {
+                const auto ap = matvec(p);
+                const auto alpha = safe_div(rs, torch::mul(p, ap).sum(0, true)).mul_(torch::gt(rs, threshold));
+                x.add_(alpha * p);
+                r.sub_(alpha * ap);
+                const auto rs_next = r.square().sum(0, true);
+
+                if (cg_check_every > 0 && (iteration + 1) % cg_check_every == 0 && torch::le(rs_next, threshold).all().item<bool>())
+                    break;
+
+                p = r + safe_div(rs_next, rs) * p;
+                rs = rs_next;
+            }
+
+            return x;
+        }
+
+        private:
+        /**
+         * Estimates log det of the operator by stochastic Lanczos quadrature started at the columns of `probes`.
+         */
+        torch::Tensor lanczos_logdet(const MatVec& matvec, const torch::Tensor& probes) const {
+            const int64_t size = probes.size(0);
+            const int64_t steps = std::min(num_lanczos_steps, size);
+            auto alphas = torch::zeros({probes.size(1), steps}, probes.options());
+            auto betas = torch::zeros({probes.size(1), steps}, probes.options());
+            auto q = safe_div(probes, probes.square().sum(0, true).sqrt());
+            auto q_prev = torch::zeros_like(q);
+            auto beta = torch::zeros({1, probes.size(1)}, probes.options());
+
+            for (int64_t k = 0; k < steps; k++) {
+                auto w = matvec(q).sub_(beta * q_prev);
+                const auto alpha = torch::mul(q, w).sum(0, true);
+                w.sub_(alpha * q);
+                beta = w.square().sum(0, true).sqrt();
+                alphas.select(1, k).copy_(alpha.squeeze(0));
+                betas.select(1, k).copy_(beta.squeeze(0));
+                q_prev = q;
+                q = safe_div(w, beta);
+            }
+
+            const auto off_diagonal = betas.narrow(1, 0, steps - 1);
+            const auto tridiagonal = torch::diag_embed(alphas)
+                    .add_(torch::diag_embed(off_diagonal, 1))
+                    .add_(torch::diag_embed(off_diagonal, -1));
+            const auto [eigenvalues, eigenvectors] = torch::linalg::eigh(tridiagonal, "L");
+            const auto weights = eigenvectors.select(1, 0).square();
+            return torch::mul(weights, torch::log(eigenvalues.clamp_min(1e-30))).sum(1).mean().mul(size);
+        }
+
+        private:
+        inline MatVec get_sample_covariance_product() const {
+            return [this] (const torch::Tensor& x) { return torch::mm(get_sample_covariance(), x); };
+        }
+
+        private:
+        const torch::Tensor& get_sample_covariance_logdet_estimate() const {
+            if (!this->estimated_sample_covariance.is_same(get_sample_covariance())) {
+                this->sample_covariance_logdet_estimate = lanczos_logdet(get_sample_covariance_product(), get_probes());
+                this->estimated_sample_covariance = get_sample_covariance();
+            }
+
+            return this->sample_covariance_logdet_estimate;
+        }
+
+        private:
+        torch::Tensor operator_loss_proxy(const CovarianceOperator& covariance) const {
+            const MatVec covariance_product = [&covariance] (const torch::Tensor& x) { return covariance.apply(x); };
+            const auto probes = get_probes();
+            const auto trace = torch::mul(
+                    conjugate_gradient(get_sample_covariance_product(), probes),
+                    covariance.apply(probes)
+            ).sum().div(num_probes);
+
+            return torch::subtract(trace, lanczos_logdet(covariance_product, probes));
+        }
+
+        private:
+        torch::Tensor operator_loss(const CovarianceOperator& covariance) const {
+            return torch::div(
+                torch::add(
+                    torch::subtract(operator_loss_proxy(covariance), get_size()),
+                    get_sample_covariance_logdet_estimate()
+                )
+            , 2.0);
+        }
+
+        private:
+        /**
+         * ∂loss/∂w = tr((S⁻¹ - Σ⁻¹) ∂Σ/∂w) / 2, estimated as the mean of xᵀ (∂Σ/∂w) z / 2 with x = (S⁻¹ - Σ⁻¹) z.
+         */
+        void operator_loss_backward(const CovarianceOperator& covariance) const {
+            const MatVec covariance_product = [&covariance] (const torch::Tensor& x) { return covariance.apply(x); };
+            const auto probes = get_probes();
+            const auto x = torch::subtract(
+                    conjugate_gradient(get_sample_covariance_product(), probes),
+                    conjugate_gradient(covariance_product, probes)
+            );
+
+            covariance.bilinear_backward(x, probes, 0.5 / num_probes);
+        }
     };
 
     class Bhattacharyya : public LossBase {
@@ -0,0 +1,161 @@
+#ifndef SN2_WARM_START_H
+#define SN2_WARM_START_H
+
+#include <torch/extension.h>
+#include "stringify.h"
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+namespace sn2_cuda {
+    using namespace torch::indexing;
+
+    // Class WarmStart
+    /**
+     * Initial weights of a structure estimated from a sample covariance S, in two steps:
+     *  1. every visible variable is regressed on its visible parents, B[Pa(c), c] = S[Pa(c), Pa(c)]⁻¹ S[Pa(c), c];
+     *  2. the latent weights are fitted to the covariance R = (I - B)ᵀ S (I - B) of the residuals of the regressions,
+     *     which the model expresses as W_Lᵀ W_L, by a few sweeps of alternating least squares: the row of every latent
+     *     variable is in turn replaced by the leading eigenpair of what the other rows leave of R on its children.
+     * The latent variables are independent with unit variance, so the latent variables with a single child act as the
+     * unique factors of factor analysis. Everything is computed in `double` on the host.
+     */
+    class WarmStart {
+        public:
+        static constexpr int32_t NUM_SWEEPS = 10;
+        static constexpr double MIN_VARIANCE = 1e-3;    // Of a latent variable, relative to the variances of its children
+
+        private:
+        torch::Tensor structure;                // On the host
+        torch::Tensor sample_covariance;        // ^ `double`
+        int64_t visible_size;
+        int64_t latent_size;
+
+        private:
+        static torch::Tensor to_index_tensor(const std::vector<int64_t>& vec) {
+            return torch::from_blob(const_cast<int64_t*>(vec.data()), {static_cast<int64_t>(vec.size())}, torch::kInt64).clone();
+        }
+
+        private:
+        std::vector<int64_t> get_parents(int64_t c) const {
+            const auto structure_acc = this->structure.accessor<bool, 2>();
+            std::vector<int64_t> parents;
+
+            for (int64_t p = 0; p < this->visible_size; p++)
+                if (structure_acc[this->latent_size + p][c])
+                    parents.push_back(p);
+
+            return parents;
+        }
+
+        private:
+        std::vector<int64_t> get_children(int64_t l) const {
+            const auto structure_acc = this->structure.accessor<bool, 2>();
+            std::vector<int64_t> children;
+
+            for (int64_t c = 0; c < this->visible_size; c++)
+                if (structure_acc[l][c])
+                    children.push_back(c);
+
+            return children;
+        }
+
+        private:
+        /**
+         * @return the least-squares weights of the visible edges, |V|×|V|; a singular S[Pa(c), Pa(c)] gets the
+         *         minimum-norm solution
+         */
+        torch::Tensor regress() const {
+            torch::Tensor visible_weights = torch::zeros({this->visible_size, this->visible_size}, torch::kDouble);
+
+            for (int64_t c = 0; c < this->visible_size; c++) {
+                const std::vector<int64_t> parents_vec = this->get_parents(c);
+
+                if (parents_vec.empty())
+                    continue;
+
+                const auto parents = to_index_tensor(parents_vec);
+                const auto solution = std::get<0>(torch::linalg_lstsq(
+                        this->sample_covariance.index({parents.unsqueeze(1), parents}),
+                        this->sample_covariance.index({parents, c}).unsqueeze(1),
+                        std::nullopt, "gelsd"
+                ));
+                visible_weights.index_put_({parents, c}, solution.squeeze(1));
+            }
+
+            return visible_weights;
+        }
+
+        private:
+        /**
+         * @param residual_covariance R, |V|×|V|
+         * @return the latent weights, |L|×|V|
+         */
+        torch::Tensor factorize(const torch::Tensor& residual_covariance) const {
+            torch::Tensor latent_weights = torch::zeros({this->latent_size, this->visible_size}, torch::kDouble);
+            torch::Tensor remainder = residual_covariance.clone();     // R - W_Lᵀ W_L
+            std::vector<torch::Tensor> children(this->latent_size);
+            std::vector<int64_t> order;
+
+            for (int64_t l = 0; l < this->latent_size; l++) {
+                const std::vector<int64_t> children_vec = this->get_children(l);
+
+                if (!children_vec.empty()) {
+                    children[l] = to_index_tensor(children_vec);
+                    order.push_back(l);
+                }
+            }
+
+            // The shared latent variables first, so that the first sweep fits the covariances before the variances
+            std::stable_sort(order.begin(), order.end(), [&] (int64_t a, int64_t b) { return children[a].size(0) > children[b].size(0); });
+
+            for (int32_t sweep = 0; sweep < NUM_SWEEPS; sweep++)
+                for (const int64_t l : order) {
+                    const auto& c = children[l];
+                    const torch::Tensor row = latent_weights.index({l, c});
+                    const torch::Tensor target = remainder.index({c.unsqueeze(1), c}) + torch::outer(row, row);
+                    const auto [eigenvalues, eigenvectors] = torch::linalg_eigh(target);
+
+                    // A zero row would have a zero gradient, so every latent variable keeps some variance
+                    const double min_variance = MIN_VARIANCE * residual_covariance.index({c, c}).mean().item<double>();
+                    const double variance = std::max(eigenvalues[-1].item<double>(), min_variance);
+                    const torch::Tensor new_row = eigenvectors.index({Slice(), -1}) * std::sqrt(variance);
+
+                    latent_weights.index_put_({l, c}, new_row);
+                    remainder.index_put_({c.unsqueeze(1), c}, target - torch::outer(new_row, new_row));
+                }
+
+            return latent_weights;
+        }
+
+        public:
+        /**
+         * WarmStart constructor.
+         * @param structure a vertical matrix of `bool` values indicating the structure of the AMASEM
+         * @param sample_covariance the |V|×|V| sample covariance
+         */
+        WarmStart(const torch::Tensor& structure, const torch::Tensor& sample_covariance) {
+            TORCH_CHECK(structure.dim() == 2 && structure.size(0) >= structure.size(1), STRINGIFY(structure) " must be a vertical-rectangular matrix.")
+            this->visible_size = structure.size(1);
+            this->latent_size = structure.size(0) - this->visible_size;
+            TORCH_CHECK(sample_covariance.dim() == 2 && sample_covariance.size(0) == this->visible_size && sample_covariance.size(1) == this->visible_size,
+                        STRINGIFY(sample_covariance) " must be a ", this->visible_size, "×", this->visible_size, " matrix.")
+
+            this->structure = structure.to(torch::kCPU, torch::kBool).contiguous();
+            this->sample_covariance = sample_covariance.to(torch::kCPU, torch::kDouble).contiguous();
+        }
+
+        public:
+        /**
+         * @return the initial weights, of the size of the structure, in `double` on the host
+         */
+        torch::Tensor get_weights() const {
+            const torch::Tensor visible_weights = this->regress();
+            const torch::Tensor residual_transform = torch::eye(this->visible_size, torch::kDouble) - visible_weights;  // I - B
+            const torch::Tensor residual_covariance = residual_transform.t().mm(this->sample_covariance).mm(residual_transform);
+            return torch::cat({this->factorize(residual_covariance), visible_weights});
+        }
+    };
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,233 @@
+#ifndef TINY_MODEL_H
+#define TINY_MODEL_H
+
+#include "device_data.h"
+#include "kernel_config.h"
+#include <type_traits>
+#include <math.h>
+
+namespace sn2_cuda {
+    /*
+     * A fixed-size engine for batches of tiny models; every model is computed by one thread (a lane on the device)
+     * with its weights and covariance in stack arrays of a compile-time size, so there is no layer structure, no
+     * tensor allocation and a single launch per batch.
+     * Σ = Aᵀ A, where A = W_L (I - B)⁻¹ is |L|×|V|; the gradients are those of the Kullback-Leibler loss.
+     */
+    namespace tiny {
+        /**
+         * Stores the references to the batched matrices of `SN2BatchSolver`; the matrices of model `b` are contiguous.
+         * @tparam scalar_t `float` or `double`
+         */
+        template <typename scalar_t>
+        class BatchData {
+            public:
+            const bool* structure;                  // B×(|L|+|V|)×|V|
+            const scalar_t* weights;                // ^
+            scalar_t* weights_grad;                 // ^
+            scalar_t* visible_covariance;           // B×|V|×|V|
+            const scalar_t* sample_covariance_inv;  // ^
+            int64_t batch_size;
+            int32_t lat_len;
+            int32_t vis_len;
+
+            public:
+            SN2_HOST_DEVICE int64_t get_weights_size() const {
+                return int64_t(lat_len + vis_len) * vis_len;
+            }
+
+            public:
+            SN2_HOST_DEVICE scalar_t get_weight(int64_t b, int32_t p, int32_t c) const {
+                const int64_t index = b * get_weights_size() + int64_t(p + lat_len) * vis_len + c;
+                return structure[index] ? weights[index] : 0.0;
+            }
+
+            public:
+            SN2_HOST_DEVICE bool has_edge(int64_t b, int32_t p, int32_t c) const {
+                return structure[b * get_weights_size() + int64_t(p + lat_len) * vis_len + c];
+            }
+
+            public:
+            SN2_HOST_DEVICE void set_weight_grad(int64_t b, int32_t p, int32_t c, scalar_t val) {
+                weights_grad[b * get_weights_size() + int64_t(p + lat_len) * vis_len + c] = val;
+            }
+
+            public:
+            SN2_HOST_DEVICE scalar_t get_sample_covariance_inv(int64_t b, int32_t u, int32_t v) const {
+                return sample_covariance_inv[(b * vis_len + u) * vis_len + v];
+            }
+
+            public:
+            SN2_HOST_DEVICE void set_visible_covariance(int64_t b, int32_t u, int32_t v, scalar_t val) {
+                visible_covariance[(b * vis_len + u) * vis_len + v] = val;
+            }
+        };
+
+        /**
+         * Computes A = W_L (I - B)⁻¹ of model `b` column by column; the variables are in topological order.
+         * The latent parents are indexed by -|L| ≤ p < 0, as in `DeviceData`.
+         * @param a |L|×|V| with a row stride of `size`
+         */
+        template <typename scalar_t, int32_t size>
+        SN2_HOST_DEVICE void accumulate(const BatchData<scalar_t>& data, int64_t b, scalar_t* a) {
+            const int32_t lat_len = data.lat_len;
+
+            for (int32_t c = 0; c < data.vis_len; c++) {
+                for (int32_t j = 0; j < lat_len; j++)
+                    a[j * size + c] = data.get_weight(b, j - lat_len, c);
+
+                for (int32_t p = 0; p < c; p++) {
+                    const scalar_t w_pc = data.get_weight(b, p, c);
+
+                    if (w_pc != 0.0)
+                        for (int32_t j = 0; j < lat_len; j++)
+                            a[j * size + c] += w_pc * a[j * size + p];
+                }
+            }
+        }
+
+        /**
+         * Computes Σ = Aᵀ A; only the lower triangle is written.
+         */
+        template <typename scalar_t, int32_t size>
+        SN2_HOST_DEVICE void covariance(const BatchData<scalar_t>& data, const scalar_t* a, scalar_t* sigma) {
+            for (int32_t u = 0; u < data.vis_len; u++)
+                for (int32_t v = 0; v <= u; v++) {
+                    scalar_t sigma_uv = 0.0;
+
+                    for (int32_t j = 0; j < data.lat_len; j++)
+                        sigma_uv += a[j * size + u] * a[j * size + v];
+
+                    sigma[u * size + v] = sigma_uv;
+                }
+        }
+
+        /**
+         * Computes Σ⁻¹ from the lower triangle of Σ through its Cholesky factor, which overwrites `sigma`.
+         * A Σ that is not positive definite gives non-finite values, as `torch::inverse` does for a singular Σ.
+         */
+        template <typename scalar_t, int32_t size>
+        SN2_HOST_DEVICE void inverse(const int32_t n, scalar_t* sigma, scalar_t* sigma_inv) {
+            // Σ = R Rᵀ, R lower-triangular
+            for (int32_t i = 0; i < n; i++)
+                for (int32_t j = 0; j <= i; j++) {
+                    scalar_t sum = sigma[i * size + j];
+
+                    for (int32_t k = 0; k < j; k++)
+                        sum -= sigma[i * size + k] * sigma[j * size + k];
+
+                    sigma[i * size + j] = (i == j) ? sqrt(sum) : sum / sigma[j * size + j];
+                }
+
+            // R⁻¹ in place, column by column
+            for (int32_t j = 0; j < n; j++) {
+                sigma[j * size + j] = scalar_t(1.0) / sigma[j * size + j];
+
+                for (int32_t i = j + 1; i < n; i++) {
+                    scalar_t sum = 0.0;
+
+                    for (int32_t k = j; k < i; k++)
+                        sum += sigma[i * size + k] * sigma[k * size + j];
+
+                    sigma[i * size + j] = -sum / sigma[i * size + i];
+                }
+            }
+
+            // Σ⁻¹ = R⁻ᵀ R⁻¹
+            for (int32_t u = 0; u < n; u++)
+                for (int32_t v = 0; v <= u; v++) {
+                    scalar_t sum = 0.0;
+
+                    for (int32_t k = u; k < n; k++)
+                        sum += sigma[k * size + u] * sigma[k * size + v];
+
+                    sigma_inv[u * size + v] = sigma_inv[v * size + u] = sum;
+                }
+        }
+
+        template <typename scalar_t, int32_t size>
+        SN2_HOST_DEVICE void forward_model(BatchData<scalar_t>& data, int64_t b) {
+            scalar_t a[size * size];
+            scalar_t sigma[size * size];
+            accumulate<scalar_t, size>(data, b, a);
+            covariance<scalar_t, size>(data, a, sigma);
+
+            for (int32_t u = 0; u < data.vis_len; u++)
+                for (int32_t v = 0; v <= u; v++) {
+                    data.set_visible_covariance(b, u, v, sigma[u * size + v]);
+                    data.set_visible_covariance(b, v, u, sigma[u * size + v]);
+                }
+        }
+
+        template <typename scalar_t, int32_t size>
+        SN2_HOST_DEVICE void backward_model(BatchData<scalar_t>& data, int64_t b) {
+            /*
+             * With G = S⁻¹ - Σ⁻¹, Ω = A G is the gradient of A; it is propagated back through (I - B)⁻¹ in reverse
+             * topological order: Ω[:, p] += B[p, c] Ω[:, c] for every child `c` of `p`.
+             * Then weight_grad[j, c] = Ω[j, c] for the latent parents and weight_grad[p, c] = A[:, p] · Ω[:, c].
+             */
+            const int32_t lat_len = data.lat_len;
+            const int32_t vis_len = data.vis_len;
+            scalar_t a[size * size];
+            scalar_t m[size * size];                // Σ, then its Cholesky factor, then Ω
+            scalar_t g[size * size];                // Σ⁻¹, then G
+            accumulate<scalar_t, size>(data, b, a);
+            covariance<scalar_t, size>(data, a, m);
+            inverse<scalar_t, size>(vis_len, m, g);
+
+            for (int32_t u = 0; u < vis_len; u++)
+                for (int32_t v = 0; v < vis_len; v++)
+                    g[u * size + v] = data.get_sample_covariance_inv(b, u, v) - g[u * size + v];
+
+            for (int32_t j = 0; j < lat_len; j++)
+                for (int32_t v = 0; v < vis_len; v++) {
+                    scalar_t omega_jv = 0.0;
+
+                    for (int32_t u = 0; u < vis_len; u++)
+                        omega_jv += a[j * size + u] * g[u * size + v];
+
+                    m[j * size + v] = omega_jv;
+                }
+
+            for (int32_t p = vis_len - 1; p >= 0; p--)
+                for (int32_t c = p + 1; c < vis_len; c++) {
+                    const scalar_t w_pc = data.get_weight(b, p, c);
+
+                    if (w_pc != 0.0)
+                        for (int32_t j = 0; j < lat_len; j++)
+                            m[j * size + p] += w_pc * m[j * size + c];
+                }
+
+            for (int32_t c = 0; c < vis_len; c++) {
+                for (int32_t j = 0; j < lat_len; j++)
+                    data.set_weight_grad(b, j - lat_len, c, data.has_edge(b, j - lat_len, c) ? m[j * size + c] : 0.0);
+
+                for (int32_t p = 0; p < vis_len; p++) {
+                    scalar_t weight_grad_pc = 0.0;
+
+                    if (data.has_edge(b, p, c))
+                        for (int32_t j = 0; j < lat_len; j++)
+                            weight_grad_pc += a[j * size + p] * m[j * size + c];
+
+                    data.set_weight_grad(b, p, c, weight_grad_pc);
+                }
+            }
+        }
+
+        /**
+         * Calls `function(std::integral_constant<int32_t, size>())` with the smallest compiled size that fits both
+         * |L| and |V| of the models of `data`.
+         */
+        template <typename scalar_t, typename Function>
+        void dispatch_size(const BatchData<scalar_t>& data, const Function& function) {
+            static_assert(MAX_TINY_MODEL_SIZE == 32, "Update the compiled sizes.");
+            const int32_t size = data.lat_len > data.vis_len ? data.lat_len : data.vis_len;
+
+            if (size <= 16)
+                function(std::integral_constant<int32_t, 16>());
+            else
+                function(std::integral_constant<int32_t, 32>());
+        }
+    }
+}
+
+#endif
\ No newline at end of file
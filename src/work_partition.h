@@ -0,0 +1,129 @@
+#ifndef WORK_PARTITION_H
+#define WORK_PARTITION_H
+
+#include "device_data.h"
+#include "kernel_config.h"
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+namespace sn2_cuda {
+    // A run [begin, end) of the edges of row `x` of a layer; `slot` is the row of its partial sums if `x` is split
+    struct WorkSegment {
+        int32_t x;
+        int32_t begin;
+        int32_t end;
+        int32_t slot;
+    };
+
+    // A row of a layer that is split into several segments, and the slots [slot_begin, slot_end) of their partial sums
+    struct SplitRow {
+        int32_t x;
+        int32_t slot_begin;
+        int32_t slot_end;
+    };
+
+    // Class LayerPartition
+    /**
+     * Edge-balanced partition of the rows of a layer. Every row becomes one segment, except for the rows with many
+     * more edges than the average row of the layer (hubs), which are split into segments of about the average size.
+     * Each segment runs on its own block, so a hub no longer keeps a single block busy while the rest finish.
+     */
+    class LayerPartition {
+        public:
+        std::vector<WorkSegment> segments;
+        std::vector<SplitRow> split_rows;
+        int32_t max_segment_size = 0;
+
+        public:
+        /**
+         * @param ranges the range [begin, end) of the edges of every row
+         * @param max_size the largest segment; e.g., the number of edges that fit in the shared memory of a block
+         * @param reduced whether the segments of a split row write partial sums that are reduced afterwards;
+         *                otherwise every edge of a segment is an independent output
+         */
+        LayerPartition(const std::vector<std::pair<int32_t, int32_t>>& ranges, const int32_t max_size, const bool reduced) {
+            int64_t num_edges = 0, num_rows = 0;
+
+            for (const auto& [begin, end] : ranges)
+                if (end > begin) {
+                    num_edges += end - begin;
+                    num_rows++;
+                }
+
+            if (num_rows == 0)
+                return;
+
+            const int32_t average_size = static_cast<int32_t>((num_edges + num_rows - 1) / num_rows);
+            const int32_t segment_size = std::min(std::max(average_size, MIN_SEGMENT_SIZE), max_size);
+            int32_t num_slots = 0;
+
+            for (int32_t x = 0; x < ranges.size(); x++) {
+                const auto& [begin, end] = ranges[x];
+
+                if (end <= begin)
+                    continue;
+                else if (end - begin <= segment_size || !reduced) {
+                    for (int32_t k = begin; k < end; k += segment_size)
+                        this->segments.push_back({x, k, std::min(k + segment_size, end), -1});
+                } else {
+                    const int32_t slot_begin = num_slots;
+
+                    for (int32_t k = begin; k < end; k += segment_size)
+                        this->segments.push_back({x, k, std::min(k + segment_size, end), num_slots++});
+
+                    this->split_rows.push_back({x, slot_begin, num_slots});
+                }
+            }
+
+            for (const auto& segment : this->segments)
+                this->max_segment_size = std::max(this->max_segment_size, segment.end - segment.begin);
+        }
+
+        public:
+        int32_t get_num_slots() const {
+            return this->split_rows.empty() ? 0 : this->split_rows.back().slot_end;
+        }
+    };
+
+    // Class WorkPartition
+    /**
+     * The edge-balanced partitions of every layer of a structure, for the three shapes of work of the kernels:
+     * the parents of the new variables (forward), the children of the variables (backward propagation), and the
+     * children of the variables as independent outputs (backward weights).
+     */
+    class WorkPartition {
+        public:
+        std::vector<LayerPartition> parents;
+        std::vector<LayerPartition> children;
+        std::vector<LayerPartition> weights;
+
+        public:
+        /**
+         * @param layers_vec the layers, with `lat_vars` readable from the host
+         * @param data the structure, with the index arrays readable from the host
+         */
+        template <typename scalar_t, typename index_t, typename accscalar_t>
+        WorkPartition(const std::vector<LayerData>& layers_vec, const DeviceData<scalar_t, index_t, accscalar_t>& data) {
+            for (const auto& layer : layers_vec) {
+                std::vector<std::pair<int32_t, int32_t>> parent_ranges, children_ranges, weights_ranges;
+
+                for (int32_t x = 0; x < layer.get_num_new_vars(); x++)
+                    parent_ranges.emplace_back(0, data.get_num_parents(x + layer.base, layer));
+
+                for (int32_t x = 0; x < layer.get_num_vars(); x++) {
+                    int32_t begin, end;
+                    data.get_children_range(data.get_layer_var(x, layer), begin, end, layer);
+                    children_ranges.emplace_back(begin, end);
+                    weights_ranges.emplace_back(0, end);
+                }
+
+                this->parents.emplace_back(parent_ranges, MAX_SEGMENT_SIZE, true);
+                this->children.emplace_back(children_ranges, MAX_SEGMENT_SIZE, true);
+                this->weights.emplace_back(weights_ranges, THREADS_PER_BLOCK, false);
+            }
+        }
+    };
+}
+
+#endif
\ No newline at end of file